@@ -33,6 +33,7 @@
 #include <bluetooth/sdp_lib.h>
 
 #include "src/shared/util.h"
+#include "src/shared/att.h"
 #include "lib/uuid.h"
 #include "att.h"
 #include "gattrib.h"
@@ -816,16 +817,64 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	return id;
 }
 
+/*
+ * Number of Prepare Write Requests handed to the ATT layer ahead of the
+ * echo currently being waited for. ATT allows a single outstanding request
+ * per bearer, so anything beyond the first sits on the bt_att request queue
+ * and is written out as soon as the previous response arrives.
+ */
+#define PREP_WRITE_WINDOW	8
+
 struct write_long_data {
+	int ref;
 	GAttrib *attrib;
 	GAttribResultFunc func;
 	gpointer user_data;
 	guint16 handle;
-	uint16_t offset;
-	uint8_t *value;
+	uint16_t chunk;		/* Value bytes carried by each Prepare Write */
 	size_t vlen;
+	uint8_t *pdus;		/* Every Prepare Write PDU, encoded back to back */
+	unsigned int num;	/* Number of PDUs in the sequence */
+	unsigned int sent;	/* PDUs handed to g_attrib_send() */
+	unsigned int acked;	/* Echoes received and validated */
+	guint *ids;
+	gboolean failed;
 };
 
+static uint8_t *prep_write_pdu(struct write_long_data *long_write,
+					unsigned int index, uint16_t *plen)
+{
+	size_t vlen = long_write->vlen - (size_t) index * long_write->chunk;
+
+	if (vlen > long_write->chunk)
+		vlen = long_write->chunk;
+
+	*plen = 5 + vlen;
+
+	return long_write->pdus + (size_t) index * (5 + long_write->chunk);
+}
+
+static struct write_long_data *long_write_ref(
+					struct write_long_data *long_write)
+{
+	__sync_fetch_and_add(&long_write->ref, 1);
+
+	return long_write;
+}
+
+static void long_write_unref(void *data)
+{
+	struct write_long_data *long_write = data;
+
+	if (__sync_sub_and_fetch(&long_write->ref, 1) > 0)
+		return;
+
+	g_attrib_unref(long_write->attrib);
+	g_free(long_write->pdus);
+	g_free(long_write->ids);
+	g_free(long_write);
+}
+
 static guint execute_write(GAttrib *attrib, uint8_t flags,
 				GAttribResultFunc func, gpointer user_data)
 {
@@ -841,50 +890,180 @@ static guint execute_write(GAttrib *attrib, uint8_t flags,
 	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
 }
 
-static guint prepare_write(struct write_long_data *long_write);
+/* Nothing to do once the server dropped its queue */
+static void cancel_prep_writes_cb(guint8 status, const guint8 *rpdu,
+					guint16 rlen, gpointer user_data)
+{
+}
+
+static void cancel_prep_writes(GAttrib *attrib)
+{
+	/* bt_att refuses to queue a request that has no response handler */
+	execute_write(attrib, ATT_CANCEL_ALL_PREP_WRITES,
+					cancel_prep_writes_cb, NULL);
+}
+
+static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data);
+
+static gboolean prepare_write_fill(struct write_long_data *long_write)
+{
+	while (long_write->sent < long_write->num &&
+			long_write->sent - long_write->acked < PREP_WRITE_WINDOW) {
+		unsigned int index = long_write->sent;
+		uint8_t *pdu;
+		guint16 plen;
+		guint id;
+
+		pdu = prep_write_pdu(long_write, index, &plen);
+
+		id = g_attrib_send(long_write->attrib, 0, pdu, plen,
+					prepare_write_cb, long_write_ref(long_write),
+					long_write_unref);
+		if (id == 0) {
+			long_write_unref(long_write);
+			return FALSE;
+		}
+
+		long_write->ids[index] = id;
+		long_write->sent++;
+	}
+
+	return TRUE;
+}
+
+static void prepare_write_abort(struct write_long_data *long_write,
+					guint8 status, const guint8 *rpdu,
+					guint16 rlen)
+{
+	unsigned int i;
+
+	long_write->failed = TRUE;
+
+	/* Drop the Prepare Writes still queued behind the failed one */
+	for (i = long_write->acked + 1; i < long_write->sent; i++)
+		g_attrib_cancel(long_write->attrib, long_write->ids[i]);
+
+	cancel_prep_writes(long_write->attrib);
+
+	long_write->func(status, rpdu, rlen, long_write->user_data);
+}
 
 static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
 							gpointer user_data)
 {
 	struct write_long_data *long_write = user_data;
+	const uint8_t *pdu;
+	guint16 plen;
+
+	if (long_write->failed)
+		return;
 
 	if (status != 0) {
-		long_write->func(status, rpdu, rlen, long_write->user_data);
+		prepare_write_abort(long_write, status, rpdu, rlen);
 		return;
 	}
 
-	/* Skip Prepare Write Response PDU header (5 bytes) */
-	long_write->offset += rlen - 5;
+	/*
+	 * Responses arrive in request order, so the echo belongs to the oldest
+	 * unacknowledged PDU. It must carry the handle, offset and value that
+	 * were sent, otherwise the server queued something else.
+	 */
+	pdu = prep_write_pdu(long_write, long_write->acked, &plen);
+	if (rlen != plen || rpdu[0] != ATT_OP_PREP_WRITE_RESP ||
+					memcmp(&rpdu[1], &pdu[1], plen - 1)) {
+		prepare_write_abort(long_write, ATT_ECODE_UNLIKELY, rpdu, rlen);
+		return;
+	}
 
-	if (long_write->offset == long_write->vlen) {
-		execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
-				long_write->func, long_write->user_data);
-		g_free(long_write->value);
-		g_free(long_write);
+	long_write->acked++;
 
+	if (long_write->acked == long_write->num) {
+		if (!execute_write(long_write->attrib,
+					ATT_WRITE_ALL_PREP_WRITES,
+					long_write->func,
+					long_write->user_data))
+			long_write->func(ATT_ECODE_IO, NULL, 0,
+						long_write->user_data);
 		return;
 	}
 
-	prepare_write(long_write);
+	if (!prepare_write_fill(long_write))
+		prepare_write_abort(long_write, ATT_ECODE_IO, NULL, 0);
 }
 
-static guint prepare_write(struct write_long_data *long_write)
+static guint prepare_write(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				GAttribResultFunc func, gpointer user_data)
 {
-	GAttrib *attrib = long_write->attrib;
-	uint16_t handle = long_write->handle;
-	uint16_t offset = long_write->offset;
-	uint8_t *buf, *value = long_write->value + offset;
-	size_t buflen, vlen = long_write->vlen - offset;
-	guint16 plen;
+	struct write_long_data *long_write;
+	size_t buflen, stride;
+	unsigned int i;
+	guint id;
 
-	buf = g_attrib_get_buffer(attrib, &buflen);
+	g_attrib_get_buffer(attrib, &buflen);
 
-	plen = enc_prep_write_req(handle, offset, value, vlen, buf, buflen);
-	if (plen == 0)
+	/* The offset of every Prepare Write must fit in 16 bits */
+	if (buflen <= 5 || vlen == 0 || vlen > 0xffff)
 		return 0;
 
-	return g_attrib_send(attrib, 0, buf, plen, prepare_write_cb, long_write,
-									NULL);
+	long_write = g_try_new0(struct write_long_data, 1);
+	if (long_write == NULL)
+		return 0;
+
+	long_write->attrib = g_attrib_ref(attrib);
+	long_write->func = func;
+	long_write->user_data = user_data;
+	long_write->handle = handle;
+	long_write->vlen = vlen;
+	long_write->chunk = buflen - 5;
+	long_write->num = (vlen + long_write->chunk - 1) / long_write->chunk;
+
+	/* Encode the whole sequence up front into a single allocation */
+	stride = 5 + long_write->chunk;
+	long_write->pdus = g_try_malloc(stride * long_write->num);
+	long_write->ids = g_try_new0(guint, long_write->num);
+	if (long_write->pdus == NULL || long_write->ids == NULL)
+		goto fail;
+
+	for (i = 0; i < long_write->num; i++) {
+		size_t offset = (size_t) i * long_write->chunk;
+
+		enc_prep_write_req(handle, offset, value + offset,
+					vlen - offset, long_write->pdus +
+					i * stride, stride);
+	}
+
+	long_write_ref(long_write);
+
+	if (!prepare_write_fill(long_write) || long_write->sent == 0) {
+		/*
+		 * Withdraw whatever made it onto the queue so the caller is
+		 * never called back for a write it was told did not start.
+		 */
+		long_write->failed = TRUE;
+
+		for (i = 0; i < long_write->sent; i++)
+			g_attrib_cancel(attrib, long_write->ids[i]);
+
+		if (long_write->sent > 0)
+			cancel_prep_writes(attrib);
+
+		long_write_unref(long_write);
+		return 0;
+	}
+
+	id = long_write->ids[0];
+	long_write_unref(long_write);
+
+	return id;
+
+fail:
+	g_attrib_unref(long_write->attrib);
+	g_free(long_write->pdus);
+	g_free(long_write->ids);
+	g_free(long_write);
+	return 0;
 }
 
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
@@ -892,7 +1071,6 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 {
 	uint8_t *buf;
 	size_t buflen;
-	struct write_long_data *long_write;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
@@ -910,18 +1088,7 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 	}
 
 	/* Write Long Characteristic Values */
-	long_write = g_try_new0(struct write_long_data, 1);
-	if (long_write == NULL)
-		return 0;
-
-	long_write->attrib = attrib;
-	long_write->func = func;
-	long_write->user_data = user_data;
-	long_write->handle = handle;
-	long_write->value = g_memdup(value, vlen);
-	long_write->vlen = vlen;
-
-	return prepare_write(long_write);
+	return prepare_write(attrib, handle, value, vlen, func, user_data);
 }
 
 guint gatt_execute_write(GAttrib *attrib, uint8_t flags,
@@ -935,17 +1102,12 @@ guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
 					GAttribResultFunc func,
 					gpointer user_data)
 {
-	uint8_t *buf;
-	guint16 plen;
-	size_t buflen;
-
-	buf = g_attrib_get_buffer(attrib, &buflen);
-
-	plen = enc_prep_write_req(handle, 0, value, vlen, buf, buflen);
-	if (!plen)
-		return 0;
-
-	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
+	/*
+	 * Reliable Writes always go through the prepare queue, even when the
+	 * value would fit in a single PDU, so that every echo is checked
+	 * against the value sent before the server is asked to execute.
+	 */
+	return prepare_write(attrib, handle, value, vlen, func, user_data);
 }
 
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
@@ -1088,6 +1250,180 @@ guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 	return g_attrib_send(attrib, 0, buf, plen, NULL, user_data, notify);
 }
 
+/*
+ * Number of Write Commands allowed to sit in the bt_att write queue. The
+ * queue only drains as the socket becomes writable, so a full window means
+ * the kernel send buffer is full and the stream waits for it to empty.
+ */
+#define WRITE_CMD_WINDOW	4
+
+struct write_stream {
+	int ref;
+	GAttrib *attrib;
+	uint16_t handle;
+	uint16_t chunk;
+	uint8_t *value;
+	size_t vlen;
+	size_t queued;		/* Bytes handed to g_attrib_send() */
+	size_t written;		/* Bytes written out to the socket */
+	unsigned int pending;
+	gboolean failed;
+	gatt_write_stream_cb_t func;
+	gpointer user_data;
+};
+
+static uint32_t stream_crc32(const uint8_t *data, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static void write_stream_unref(struct write_stream *stream)
+{
+	if (__sync_sub_and_fetch(&stream->ref, 1) > 0)
+		return;
+
+	g_attrib_unref(stream->attrib);
+	g_free(stream->value);
+	g_free(stream);
+}
+
+static void write_stream_fail(struct write_stream *stream)
+{
+	if (stream->failed)
+		return;
+
+	stream->failed = TRUE;
+
+	if (stream->func)
+		stream->func(ATT_ECODE_IO, stream->written, stream->user_data);
+}
+
+static void write_stream_cmd_done(gpointer user_data);
+
+static void write_stream_fill(struct write_stream *stream)
+{
+	uint8_t *buf;
+	size_t buflen;
+
+	buf = g_attrib_get_buffer(stream->attrib, &buflen);
+
+	while (stream->queued < stream->vlen &&
+				stream->pending < WRITE_CMD_WINDOW) {
+		size_t len = MIN(stream->vlen - stream->queued, stream->chunk);
+		guint16 plen;
+
+		plen = enc_write_cmd(stream->handle,
+					stream->value + stream->queued, len,
+					buf, buflen);
+
+		__sync_fetch_and_add(&stream->ref, 1);
+
+		if (plen == 0 || !g_attrib_send(stream->attrib, 0, buf, plen,
+					NULL, stream, write_stream_cmd_done)) {
+			write_stream_unref(stream);
+			write_stream_fail(stream);
+			return;
+		}
+
+		stream->queued += len;
+		stream->pending++;
+	}
+}
+
+static void write_stream_cmd_done(gpointer user_data)
+{
+	struct write_stream *stream = user_data;
+
+	/* Write Commands leave the bt_att write queue in order */
+	stream->pending--;
+
+	if (stream->failed)
+		goto done;
+
+	/*
+	 * The queue is also flushed on disconnect, in which case this PDU
+	 * was cancelled rather than written and the stream is over.
+	 */
+	if (!bt_att_is_connected(g_attrib_get_att(stream->attrib))) {
+		write_stream_fail(stream);
+		goto done;
+	}
+
+	stream->written = MIN(stream->written + stream->chunk, stream->vlen);
+
+	if (stream->written == stream->vlen) {
+		if (stream->func)
+			stream->func(0, stream->written, stream->user_data);
+		goto done;
+	}
+
+	write_stream_fill(stream);
+
+done:
+	write_stream_unref(stream);
+}
+
+gboolean gatt_write_cmd_stream(GAttrib *attrib, uint16_t handle,
+					const uint8_t *value, size_t vlen,
+					gboolean checksum,
+					gatt_write_stream_cb_t func,
+					gpointer user_data)
+{
+	struct write_stream *stream;
+	size_t buflen;
+
+	g_attrib_get_buffer(attrib, &buflen);
+	if (buflen <= 3 || vlen == 0)
+		return FALSE;
+
+	stream = g_try_new0(struct write_stream, 1);
+	if (stream == NULL)
+		return FALSE;
+
+	stream->vlen = checksum ? vlen + 4 : vlen;
+	stream->value = g_try_malloc(stream->vlen);
+	if (stream->value == NULL) {
+		g_free(stream);
+		return FALSE;
+	}
+
+	memcpy(stream->value, value, vlen);
+
+	/* CRC-32 of the payload trails it, little endian */
+	if (checksum)
+		put_le32(stream_crc32(value, vlen), stream->value + vlen);
+
+	stream->ref = 1;
+	stream->attrib = g_attrib_ref(attrib);
+	stream->handle = handle;
+	stream->chunk = buflen - 3;
+
+	write_stream_fill(stream);
+
+	/* Failures before anything reached the socket are reported here */
+	if (stream->failed) {
+		write_stream_unref(stream);
+		return FALSE;
+	}
+
+	stream->func = func;
+	stream->user_data = user_data;
+
+	write_stream_unref(stream);
+
+	return TRUE;
+}
+
 guint gatt_signed_write_cmd(GAttrib *attrib, uint16_t handle,
 						const uint8_t *value, int vlen,
 						struct bt_crypto *crypto,
@@ -47,6 +47,8 @@
 #define GATT_CLIENT_CHARAC_CFG_IND_BIT		0x0002
 
 typedef void (*gatt_cb_t) (uint8_t status, GSList *l, void *user_data);
+typedef void (*gatt_write_stream_cb_t) (uint8_t status, size_t written,
+							void *user_data);
 
 struct gatt_primary {
 	char uuid[MAX_LEN_UUID_STR + 1];
@@ -105,6 +107,12 @@ guint gatt_execute_write(GAttrib *attrib, uint8_t flags,
 guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 			int vlen, GDestroyNotify notify, gpointer user_data);
 
+gboolean gatt_write_cmd_stream(GAttrib *attrib, uint16_t handle,
+					const uint8_t *value, size_t vlen,
+					gboolean checksum,
+					gatt_write_stream_cb_t func,
+					gpointer user_data);
+
 guint gatt_signed_write_cmd(GAttrib *attrib, uint16_t handle,
 						const uint8_t *value, int vlen,
 						struct bt_crypto *crypto,
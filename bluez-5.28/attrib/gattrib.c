@@ -324,13 +324,25 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 		cb->destroy_func = notify;
 		cb->parent = attrib;
 		queue_push_head(attrib->callbacks, cb);
-		response_cb = attrib_callback_result;
 		destroy_cb = attrib_callbacks_remove;
 
+		/* bt_att rejects a response handler for commands */
+		if (func)
+			response_cb = attrib_callback_result;
+
 	}
 
 	pend_id = bt_att_send(attrib->att, pdu[0], (void *) pdu + 1, len - 1,
 						response_cb, cb, destroy_cb);
+	if (pend_id == 0) {
+		/* Nothing was queued, so nobody may be called back */
+		if (cb) {
+			queue_remove(attrib->callbacks, cb);
+			free(cb);
+		}
+
+		return 0;
+	}
 
 	/*
 	 * We store here pair as it is easier to handle it in response and in
@@ -46,6 +46,8 @@
 #include "lib/l2cap.h"
 #include "lib/rfcomm.h"
 #include "lib/sco.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
 
 #ifndef BT_FLUSHABLE
 #define BT_FLUSHABLE	8
@@ -1525,6 +1527,78 @@ gboolean bt_io_get(GIOChannel *io, GError **err, BtIOOption opt1, ...)
 	return ret;
 }
 
+/*
+ * Ask the controller owning the link to move an LE connection to new
+ * parameters. Intervals are in units of 1.25 ms and the supervision timeout
+ * in units of 10 ms. The command is only queued: the outcome is reported
+ * by the controller in an LE Connection Update Complete event, so the
+ * caller's main loop is never held up waiting for the next anchor point.
+ */
+gboolean bt_io_set_le_conn_params(GIOChannel *io, uint16_t min_interval,
+					uint16_t max_interval, uint16_t latency,
+					uint16_t timeout, GError **err)
+{
+	le_connection_update_cp cp;
+	struct sockaddr_l2 src;
+	char addr[18];
+	uint16_t handle;
+	int sock, dev_id, dd, ret;
+
+	if (bt_io_get_type(io, err) != BT_IO_L2CAP) {
+		if (err && *err == NULL)
+			g_set_error(err, BT_IO_ERROR, EINVAL,
+					"Not an L2CAP channel");
+		return FALSE;
+	}
+
+	sock = g_io_channel_unix_get_fd(io);
+
+	if (!get_src(sock, &src, sizeof(src), err))
+		return FALSE;
+
+	if (src.l2_bdaddr_type == BDADDR_BREDR) {
+		g_set_error(err, BT_IO_ERROR, EINVAL, "Not an LE link");
+		return FALSE;
+	}
+
+	ret = l2cap_get_info(sock, &handle, NULL);
+	if (ret < 0) {
+		ERROR_FAILED(err, "getsockopt(L2CAP_CONNINFO)", -ret);
+		return FALSE;
+	}
+
+	ba2str(&src.l2_bdaddr, addr);
+	dev_id = hci_devid(addr);
+	if (dev_id < 0) {
+		ERROR_FAILED(err, "hci_devid", ENODEV);
+		return FALSE;
+	}
+
+	dd = hci_open_dev(dev_id);
+	if (dd < 0) {
+		ERROR_FAILED(err, "hci_open_dev", errno);
+		return FALSE;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+	cp.min_interval = htobs(min_interval);
+	cp.max_interval = htobs(max_interval);
+	cp.latency = htobs(latency);
+	cp.supervision_timeout = htobs(timeout);
+	cp.min_ce_length = htobs(0x0001);
+	cp.max_ce_length = htobs(0x0001);
+
+	ret = hci_send_cmd(dd, OGF_LE_CTL, OCF_LE_CONN_UPDATE,
+					LE_CONN_UPDATE_CP_SIZE, &cp);
+	if (ret < 0)
+		ERROR_FAILED(err, "LE Connection Update", errno);
+
+	hci_close_dev(dd);
+
+	return ret < 0 ? FALSE : TRUE;
+}
+
 static GIOChannel *create_io(gboolean server, struct set_opts *opts,
 								GError **err)
 {
@@ -88,6 +88,10 @@ GIOChannel *bt_io_connect(BtIOConnect connect, gpointer user_data,
 				GDestroyNotify destroy, GError **gerr,
 				BtIOOption opt1, ...);
 
+gboolean bt_io_set_le_conn_params(GIOChannel *io, uint16_t min_interval,
+					uint16_t max_interval, uint16_t latency,
+					uint16_t timeout, GError **err);
+
 GIOChannel *bt_io_listen(BtIOConnect connect, BtIOConfirm confirm,
 				gpointer user_data, GDestroyNotify destroy,
 				GError **err, BtIOOption opt1, ...);
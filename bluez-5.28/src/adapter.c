@@ -32,10 +32,12 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -53,6 +55,8 @@
 #include "lib/mgmt.h"
 #include "src/shared/mgmt.h"
 #include "src/shared/util.h"
+#include "src/shared/ad-cache.h"
+#include "src/shared/crypto.h"
 
 #include "hcid.h"
 #include "sdpd.h"
@@ -81,6 +85,11 @@
 #define IDLE_DISCOV_TIMEOUT (5)
 #define TEMP_DEV_TIMEOUT (3 * 60)
 #define BONDING_TIMEOUT (2 * 60)
+#define AD_CACHE_SIZE (1024)
+#define LOAD_THREADS_MAX (8)
+#define LOAD_THREADS_MIN_DEVICES (64)
+#define LOAD_BATCH (32)
+#define LOAD_BATCH_INTERVAL (20)	/* ms */
 
 static DBusConnection *dbus_conn = NULL;
 
@@ -135,10 +144,28 @@ struct conn_param {
 	uint16_t timeout;
 };
 
+#define DISTANCE_VAL_INVALID	0x7FFF
+#define HCI_RSSI_INVALID	127
+
+/*
+ * Discovery filter of a single client. All configured conditions must be
+ * met for a report to be of interest to the client. UUIDs are stored as
+ * little endian 128-bit values, the same layout the kernel expects.
+ */
+struct discovery_filter {
+	int16_t rssi;			/* DISTANCE_VAL_INVALID if unset */
+	uint16_t pathloss;		/* DISTANCE_VAL_INVALID if unset */
+	unsigned int uuid_count;
+	uint8_t (*uuids)[16];
+	unsigned int company_count;
+	uint16_t *companies;
+};
+
 struct watch_client {
 	struct btd_adapter *adapter;
 	char *owner;
 	guint watch;
+	struct discovery_filter *filter;
 };
 
 struct service_auth {
@@ -158,6 +185,17 @@ struct btd_adapter_pin_cb_iter {
 	/* When the iterator reaches the end, it is NULL and attempt is 0 */
 };
 
+/*
+ * Device list with O(1) membership tests and removal: the hash table
+ * maps each member to its link in the list, which keeps the order in
+ * which devices were added.
+ */
+struct device_set {
+	GList *head;
+	GList *tail;
+	GHashTable *links;		/* device -> GList link */
+};
+
 struct btd_adapter {
 	int ref_count;
 
@@ -188,7 +226,14 @@ struct btd_adapter {
 	uint8_t discovery_enable;	/* discovery enabled/disabled */
 	bool discovery_suspended;	/* discovery has been suspended */
 	GSList *discovery_list;		/* list of discovery clients */
-	GSList *discovery_found;	/* list of found devices */
+	GSList *set_filter_list;	/* clients with filter, not started */
+	uint8_t *discovery_cp;		/* last start discovery parameters */
+	uint16_t discovery_cp_len;
+	struct device_set discovery_found;	/* found devices */
+	struct ad_cache *ad_cache;	/* last payload of found devices */
+	struct bt_crypto_resolver *resolver;	/* stored IRKs */
+	GSList *resolver_irks;		/* irk_info of the resolver's IRKs */
+	bool resolve_rpas;		/* kernel can not resolve RPAs */
 	guint discovery_idle_timeout;	/* timeout between discovery runs */
 	guint passive_scan_timeout;	/* timeout between passive scans */
 	guint temp_devices_timeout;	/* timeout for temporary devices */
@@ -197,9 +242,13 @@ struct btd_adapter {
 	guint auth_idle_id;		/* Pending authorization dequeue */
 	GQueue *auths;			/* Ongoing and pending auths */
 	bool pincode_requested;		/* PIN requested during last bonding */
-	GSList *connections;		/* Connected devices */
+	struct device_set connections;	/* Connected devices */
 	GSList *devices;		/* Devices structure pointers */
-	GSList *connect_list;		/* Devices to connect when found */
+	GHashTable *devices_addr;	/* bdaddr -> GQueue of devices */
+	GHashTable *devices_path;	/* object path -> device */
+	GHashTable *stored_devices;	/* bdaddr -> not yet created device */
+	guint stored_devices_id;
+	struct device_set connect_list;	/* Devices to connect when found */
 	struct btd_device *connect_le;	/* LE device waiting to be connected */
 	sdp_list_t *services;		/* Services associated to adapter */
 
@@ -394,11 +443,14 @@ static void store_adapter_info(struct btd_adapter *adapter)
 	GKeyFile *key_file;
 	char filename[PATH_MAX];
 	char address[18];
-	char *str;
-	gsize length = 0;
 	gboolean discoverable;
 
-	key_file = g_key_file_new();
+	ba2str(&adapter->bdaddr, address);
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/settings", address);
+
+	/* Rebuilt from scratch so unset values fall back to the defaults */
+	key_file = storage_keyfile_get(filename);
+	g_key_file_remove_group(key_file, "General", NULL);
 
 	if (adapter->pairable_timeout != main_opts.pairto)
 		g_key_file_set_integer(key_file, "General", "PairableTimeout",
@@ -422,16 +474,7 @@ static void store_adapter_info(struct btd_adapter *adapter)
 		g_key_file_set_string(key_file, "General", "Alias",
 							adapter->stored_alias);
 
-	ba2str(&adapter->bdaddr, address);
-	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/settings", address);
-
-	create_file(filename, S_IRUSR | S_IWUSR);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
 }
 
 static void trigger_pairable_timeout(struct btd_adapter *adapter);
@@ -736,13 +779,184 @@ int adapter_set_name(struct btd_adapter *adapter, const char *name)
 	return set_name(adapter, name);
 }
 
+static void device_set_init(struct device_set *set)
+{
+	set->head = NULL;
+	set->tail = NULL;
+	set->links = g_hash_table_new(NULL, NULL);
+}
+
+static bool device_set_contains(struct device_set *set,
+						struct btd_device *device)
+{
+	return g_hash_table_lookup(set->links, device) != NULL;
+}
+
+static bool device_set_is_empty(struct device_set *set)
+{
+	return set->head == NULL;
+}
+
+static bool device_set_append(struct device_set *set,
+						struct btd_device *device)
+{
+	if (device_set_contains(set, device))
+		return false;
+
+	if (!set->tail) {
+		set->head = g_list_append(NULL, device);
+		set->tail = set->head;
+	} else {
+		g_list_append(set->tail, device);
+		set->tail = set->tail->next;
+	}
+
+	g_hash_table_insert(set->links, device, set->tail);
+
+	return true;
+}
+
+static bool device_set_prepend(struct device_set *set,
+						struct btd_device *device)
+{
+	if (device_set_contains(set, device))
+		return false;
+
+	set->head = g_list_prepend(set->head, device);
+	if (!set->tail)
+		set->tail = set->head;
+
+	g_hash_table_insert(set->links, device, set->head);
+
+	return true;
+}
+
+static bool device_set_remove(struct device_set *set,
+						struct btd_device *device)
+{
+	GList *link;
+
+	link = g_hash_table_lookup(set->links, device);
+	if (!link)
+		return false;
+
+	g_hash_table_remove(set->links, device);
+
+	if (link == set->tail)
+		set->tail = link->prev;
+
+	set->head = g_list_delete_link(set->head, link);
+
+	return true;
+}
+
+static void device_set_clear(struct device_set *set, GDestroyNotify destroy)
+{
+	g_hash_table_remove_all(set->links);
+
+	if (destroy)
+		g_list_free_full(set->head, destroy);
+	else
+		g_list_free(set->head);
+
+	set->head = NULL;
+	set->tail = NULL;
+}
+
+static void device_set_free(struct device_set *set)
+{
+	device_set_clear(set, NULL);
+	g_hash_table_destroy(set->links);
+}
+
+static guint bdaddr_hash(gconstpointer key)
+{
+	const uint8_t *b = ((const bdaddr_t *) key)->b;
+
+	return (b[0] | b[1] << 8 | b[2] << 16 | b[3] << 24) ^
+							(b[4] | b[5] << 8);
+}
+
+static gboolean bdaddr_equal(gconstpointer a, gconstpointer b)
+{
+	return !bacmp(a, b);
+}
+
+/* Object paths given over D-Bus are matched case insensitively */
+static guint path_hash(gconstpointer key)
+{
+	const char *p;
+	guint hash = 5381;
+
+	for (p = key; *p; p++)
+		hash = hash * 33 + g_ascii_tolower(*p);
+
+	return hash;
+}
+
+static gboolean path_equal(gconstpointer a, gconstpointer b)
+{
+	return !strcasecmp(a, b);
+}
+
+/*
+ * The device list is indexed by address and by object path so lookups on
+ * the advertising path do not scan every known device. Addresses map to
+ * a short queue since a public and a random address may coincide; the
+ * full match is still decided by device_addr_type_cmp. The queue is
+ * changed in place, so the table never replaces a value still in use.
+ */
+static void device_index_add(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	const bdaddr_t *bdaddr = device_get_address(device);
+	GQueue *queue;
+
+	queue = g_hash_table_lookup(adapter->devices_addr, bdaddr);
+	if (!queue) {
+		queue = g_queue_new();
+		g_hash_table_insert(adapter->devices_addr,
+				g_memdup(bdaddr, sizeof(*bdaddr)), queue);
+	}
+
+	g_queue_push_tail(queue, device);
+
+	g_hash_table_insert(adapter->devices_path,
+				(gpointer) device_get_path(device), device);
+}
+
+static void device_index_remove(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	const bdaddr_t *bdaddr = device_get_address(device);
+	GQueue *queue;
+
+	queue = g_hash_table_lookup(adapter->devices_addr, bdaddr);
+	if (queue) {
+		g_queue_remove(queue, device);
+		if (g_queue_is_empty(queue))
+			g_hash_table_remove(adapter->devices_addr, bdaddr);
+	}
+
+	g_hash_table_remove(adapter->devices_path, device_get_path(device));
+}
+
+static void device_index_free(gpointer data)
+{
+	g_queue_free(data);
+}
+
+static void load_stored_address(struct btd_adapter *adapter,
+						const bdaddr_t *bdaddr);
+
 struct btd_device *btd_adapter_find_device(struct btd_adapter *adapter,
 							const bdaddr_t *dst,
 							uint8_t bdaddr_type)
 {
 	struct device_addr_type addr;
 	struct btd_device *device;
-	GSList *list;
+	GQueue *queue;
+	GList *list;
 
 	if (!adapter)
 		return NULL;
@@ -750,8 +964,14 @@ struct btd_device *btd_adapter_find_device(struct btd_adapter *adapter,
 	bacpy(&addr.bdaddr, dst);
 	addr.bdaddr_type = bdaddr_type;
 
-	list = g_slist_find_custom(adapter->devices, &addr,
-							device_addr_type_cmp);
+	if (adapter->stored_devices_id)
+		load_stored_address(adapter, dst);
+
+	queue = g_hash_table_lookup(adapter->devices_addr, dst);
+	if (!queue)
+		return NULL;
+
+	list = g_queue_find_custom(queue, &addr, device_addr_type_cmp);
 	if (!list)
 		return NULL;
 
@@ -1072,6 +1292,7 @@ static struct btd_device *adapter_create_device(struct btd_adapter *adapter,
 		return NULL;
 
 	adapter->devices = g_slist_append(adapter->devices, device);
+	device_index_add(adapter, device);
 
 	return device;
 }
@@ -1104,18 +1325,21 @@ void btd_adapter_remove_device(struct btd_adapter *adapter,
 {
 	GList *l;
 
-	adapter->connect_list = g_slist_remove(adapter->connect_list, dev);
+	device_set_remove(&adapter->connect_list, dev);
 
 	adapter->devices = g_slist_remove(adapter->devices, dev);
+	device_index_remove(adapter, dev);
 
-	adapter->discovery_found = g_slist_remove(adapter->discovery_found,
-									dev);
+	device_set_remove(&adapter->discovery_found, dev);
 
-	adapter->connections = g_slist_remove(adapter->connections, dev);
+	device_set_remove(&adapter->connections, dev);
 
 	if (adapter->connect_le == dev)
 		adapter->connect_le = NULL;
 
+	ad_cache_remove(adapter->ad_cache, device_get_address(dev)->b,
+					btd_device_get_bdaddr_type(dev));
+
 	l = adapter->auths->head;
 	while (l != NULL) {
 		struct service_auth *auth = l->data;
@@ -1235,7 +1459,7 @@ static void trigger_passive_scanning(struct btd_adapter *adapter)
 	 * If the list of connectable Low Energy devices is empty,
 	 * then do not start passive scanning.
 	 */
-	if (!adapter->connect_list)
+	if (device_set_is_empty(&adapter->connect_list))
 		return;
 
 	adapter->passive_scan_timeout = g_timeout_add_seconds(CONN_SCAN_TIMEOUT,
@@ -1359,11 +1583,85 @@ static void start_discovery_complete(uint8_t status, uint16_t length,
 	trigger_start_discovery(adapter, IDLE_DISCOV_TIMEOUT * 2);
 }
 
+/*
+ * Merge the filters of all discovery clients into the tightest filter
+ * that does not hide anything any of them asked for. Manufacturer and
+ * pathloss conditions can not be expressed to the kernel and only
+ * disable the respective kernel side filtering.
+ *
+ * Returns NULL if an unfiltered discovery is required.
+ */
+static struct mgmt_cp_start_service_discovery *merge_discovery_filters(
+					struct btd_adapter *adapter,
+					uint8_t type, uint16_t *len)
+{
+	struct mgmt_cp_start_service_discovery *cp;
+	int8_t rssi = INT8_MAX;
+	unsigned int count = 0;
+	bool uuids = true, rssi_set = true;
+	GSList *l;
+
+	if (MGMT_VERSION(mgmt_version, mgmt_revision) < MGMT_VERSION(1, 8))
+		return NULL;
+
+	for (l = adapter->discovery_list; l != NULL; l = g_slist_next(l)) {
+		struct watch_client *client = l->data;
+		struct discovery_filter *filter = client->filter;
+
+		if (!filter)
+			return NULL;
+
+		if (filter->rssi == DISTANCE_VAL_INVALID)
+			rssi_set = false;
+		else
+			rssi = MIN(rssi, filter->rssi);
+
+		if (!filter->uuid_count)
+			uuids = false;
+		else
+			count += filter->uuid_count;
+	}
+
+	if (!uuids)
+		count = 0;
+
+	if (!rssi_set)
+		rssi = HCI_RSSI_INVALID;
+
+	if (rssi == HCI_RSSI_INVALID && !count)
+		return NULL;
+
+	*len = sizeof(*cp) + count * 16;
+	cp = g_malloc0(*len);
+	cp->type = type;
+	cp->rssi = rssi;
+	cp->uuid_count = htobs(count);
+
+	if (!count)
+		return cp;
+
+	/* Duplicates are harmless, the kernel just compares each entry */
+	count = 0;
+	for (l = adapter->discovery_list; l != NULL; l = g_slist_next(l)) {
+		struct watch_client *client = l->data;
+		struct discovery_filter *filter = client->filter;
+
+		memcpy(cp->uuids[count], filter->uuids,
+						filter->uuid_count * 16);
+		count += filter->uuid_count;
+	}
+
+	return cp;
+}
+
 static gboolean start_discovery_timeout(gpointer user_data)
 {
 	struct btd_adapter *adapter = user_data;
+	struct mgmt_cp_start_service_discovery *filter_cp;
 	struct mgmt_cp_start_discovery cp;
+	uint16_t filter_len = 0;
 	uint8_t new_type;
+	bool same_filter;
 
 	DBG("");
 
@@ -1377,12 +1675,20 @@ static gboolean start_discovery_timeout(gpointer user_data)
 	if (adapter->current_settings & MGMT_SETTING_LE)
 		new_type |= (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM);
 
+	filter_cp = merge_discovery_filters(adapter, new_type, &filter_len);
+
+	same_filter = filter_len == adapter->discovery_cp_len &&
+			(!filter_len || !memcmp(filter_cp, adapter->discovery_cp,
+								filter_len));
+
 	if (adapter->discovery_enable == 0x01) {
 		/*
 		 * If there is an already running discovery and it has the
-		 * same type, then just keep it.
+		 * same type and filter, then just keep it.
 		 */
-		if (adapter->discovery_type == new_type) {
+		if (adapter->discovery_type == new_type && same_filter) {
+			g_free(filter_cp);
+
 			if (adapter->discovering)
 				return FALSE;
 
@@ -1406,6 +1712,17 @@ static gboolean start_discovery_timeout(gpointer user_data)
 					NULL, NULL, NULL);
 	}
 
+	g_free(adapter->discovery_cp);
+	adapter->discovery_cp = (uint8_t *) filter_cp;
+	adapter->discovery_cp_len = filter_len;
+
+	if (filter_cp) {
+		mgmt_send(adapter->mgmt, MGMT_OP_START_SERVICE_DISCOVERY,
+				adapter->dev_id, filter_len, filter_cp,
+				start_discovery_complete, adapter, NULL);
+		return FALSE;
+	}
+
 	cp.type = new_type;
 
 	mgmt_send(adapter->mgmt, MGMT_OP_START_DISCOVERY,
@@ -1588,6 +1905,148 @@ static int compare_sender(gconstpointer a, gconstpointer b)
 	return g_strcmp0(client->owner, sender);
 }
 
+static void discovery_filter_free(struct discovery_filter *filter)
+{
+	if (!filter)
+		return;
+
+	g_free(filter->uuids);
+	g_free(filter->companies);
+	g_free(filter);
+}
+
+/* Bluetooth Base UUID 00000000-0000-1000-8000-00805F9B34FB, little endian */
+static const uint8_t base_uuid_le[16] = {
+	0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+	0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static bool filter_has_uuid(const struct discovery_filter *filter,
+						const uint8_t *uuid, uint8_t len)
+{
+	uint8_t uuid128[16];
+	unsigned int i;
+
+	if (len == 16) {
+		memcpy(uuid128, uuid, 16);
+	} else {
+		memcpy(uuid128, base_uuid_le, 16);
+		memcpy(&uuid128[12], uuid, len);
+	}
+
+	for (i = 0; i < filter->uuid_count; i++) {
+		if (!memcmp(filter->uuids[i], uuid128, 16))
+			return true;
+	}
+
+	return false;
+}
+
+static bool filter_has_company(const struct discovery_filter *filter,
+							uint16_t company)
+{
+	unsigned int i;
+
+	for (i = 0; i < filter->company_count; i++) {
+		if (filter->companies[i] == company)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Match a report against a client filter by walking the raw EIR/AD data,
+ * so rejected reports are never parsed into a device object.
+ */
+static bool discovery_filter_match(const struct discovery_filter *filter,
+					int8_t rssi, const uint8_t *data,
+					uint8_t data_len)
+{
+	bool uuid_match = !filter->uuid_count;
+	bool company_match = !filter->company_count;
+	int tx_power = DISTANCE_VAL_INVALID;
+	uint16_t len = 0;
+
+	if (filter->rssi != DISTANCE_VAL_INVALID && rssi < filter->rssi)
+		return false;
+
+	while (data && len + 1 < data_len) {
+		uint8_t field_len = data[len];
+		const uint8_t *field = &data[len + 2];
+		uint8_t type, field_data_len, size = 0;
+
+		if (field_len == 0 || len + field_len + 1 > data_len)
+			break;
+
+		type = data[len + 1];
+		field_data_len = field_len - 1;
+		len += field_len + 1;
+
+		switch (type) {
+		case EIR_UUID16_SOME:
+		case EIR_UUID16_ALL:
+			size = 2;
+			break;
+		case EIR_UUID32_SOME:
+		case EIR_UUID32_ALL:
+			size = 4;
+			break;
+		case EIR_UUID128_SOME:
+		case EIR_UUID128_ALL:
+			size = 16;
+			break;
+		case EIR_TX_POWER:
+			if (field_data_len > 0)
+				tx_power = (int8_t) field[0];
+			break;
+		case EIR_MANUFACTURER_DATA:
+			if (field_data_len >= 2 && !company_match)
+				company_match = filter_has_company(filter,
+							get_le16(field));
+			break;
+		}
+
+		for (; size && !uuid_match && field_data_len >= size;
+				field += size, field_data_len -= size)
+			uuid_match = filter_has_uuid(filter, field, size);
+	}
+
+	if (!uuid_match || !company_match)
+		return false;
+
+	if (filter->pathloss != DISTANCE_VAL_INVALID) {
+		if (tx_power == DISTANCE_VAL_INVALID)
+			return false;
+
+		if (tx_power - rssi > filter->pathloss)
+			return false;
+	}
+
+	return true;
+}
+
+/* A report is wanted if at least one discovery client wants it */
+static bool discovery_filters_match(struct btd_adapter *adapter,
+					int8_t rssi, const uint8_t *data,
+					uint8_t data_len)
+{
+	GSList *l;
+
+	for (l = adapter->discovery_list; l != NULL; l = g_slist_next(l)) {
+		struct watch_client *client = l->data;
+
+		if (!client->filter)
+			return true;
+
+		if (discovery_filter_match(client->filter, rssi, data,
+								data_len))
+			return true;
+	}
+
+	return false;
+}
+
 static void invalidate_rssi(gpointer a)
 {
 	struct btd_device *dev = a;
@@ -1597,8 +2056,7 @@ static void invalidate_rssi(gpointer a)
 
 static void discovery_cleanup(struct btd_adapter *adapter)
 {
-	g_slist_free_full(adapter->discovery_found, invalidate_rssi);
-	adapter->discovery_found = NULL;
+	device_set_clear(&adapter->discovery_found, invalidate_rssi);
 }
 
 static gboolean remove_temp_devices(gpointer user_data)
@@ -1632,6 +2090,7 @@ static void discovery_destroy(void *user_data)
 	adapter->discovery_list = g_slist_remove(adapter->discovery_list,
 								client);
 
+	discovery_filter_free(client->filter);
 	g_free(client->owner);
 	g_free(client);
 
@@ -1731,6 +2190,18 @@ static DBusMessage *start_discovery(DBusConnection *conn,
 						discovery_disconnect, client,
 						discovery_destroy);
 
+	/* Take over a filter set before the discovery was started */
+	list = g_slist_find_custom(adapter->set_filter_list, sender,
+						compare_sender);
+	if (list) {
+		struct watch_client *pending = list->data;
+
+		client->filter = pending->filter;
+		pending->filter = NULL;
+
+		g_dbus_remove_watch(dbus_conn, pending->watch);
+	}
+
 	adapter->discovery_list = g_slist_prepend(adapter->discovery_list,
 								client);
 
@@ -1801,6 +2272,286 @@ static DBusMessage *stop_discovery(DBusConnection *conn,
 	return dbus_message_new_method_return(msg);
 }
 
+static void set_filter_disconnect(DBusConnection *conn, void *user_data)
+{
+	struct watch_client *client = user_data;
+
+	DBG("owner %s", client->owner);
+}
+
+static void set_filter_destroy(void *user_data)
+{
+	struct watch_client *client = user_data;
+	struct btd_adapter *adapter = client->adapter;
+
+	adapter->set_filter_list = g_slist_remove(adapter->set_filter_list,
+								client);
+
+	discovery_filter_free(client->filter);
+	g_free(client->owner);
+	g_free(client);
+}
+
+static bool parse_filter_uuids(DBusMessageIter *value,
+					struct discovery_filter *filter)
+{
+	DBusMessageIter arriter;
+	GArray *uuids;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY)
+		return false;
+
+	uuids = g_array_new(FALSE, FALSE, 16);
+
+	dbus_message_iter_recurse(value, &arriter);
+	while (dbus_message_iter_get_arg_type(&arriter) == DBUS_TYPE_STRING) {
+		const char *str;
+		bt_uuid_t uuid, uuid128;
+		uint8_t le[16];
+		int i;
+
+		dbus_message_iter_get_basic(&arriter, &str);
+
+		if (bt_string_to_uuid(&uuid, str) < 0) {
+			g_array_free(uuids, TRUE);
+			return false;
+		}
+
+		bt_uuid_to_uuid128(&uuid, &uuid128);
+
+		for (i = 0; i < 16; i++)
+			le[i] = uuid128.value.u128.data[15 - i];
+
+		g_array_append_val(uuids, le);
+
+		dbus_message_iter_next(&arriter);
+	}
+
+	filter->uuid_count = uuids->len;
+	filter->uuids = (void *) g_array_free(uuids, FALSE);
+
+	return true;
+}
+
+static bool parse_filter_companies(DBusMessageIter *value,
+					struct discovery_filter *filter)
+{
+	DBusMessageIter arriter;
+	GArray *companies;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY)
+		return false;
+
+	companies = g_array_new(FALSE, FALSE, sizeof(uint16_t));
+
+	dbus_message_iter_recurse(value, &arriter);
+	while (dbus_message_iter_get_arg_type(&arriter) == DBUS_TYPE_UINT16) {
+		uint16_t company;
+
+		dbus_message_iter_get_basic(&arriter, &company);
+		g_array_append_val(companies, company);
+
+		dbus_message_iter_next(&arriter);
+	}
+
+	filter->company_count = companies->len;
+	filter->companies = (void *) g_array_free(companies, FALSE);
+
+	return true;
+}
+
+static bool parse_filter_rssi(DBusMessageIter *value,
+					struct discovery_filter *filter)
+{
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_INT16)
+		return false;
+
+	dbus_message_iter_get_basic(value, &filter->rssi);
+
+	/* -127 dBm <= RSSI <= +20 dBm */
+	if (filter->rssi < -127 || filter->rssi > 20)
+		return false;
+
+	return true;
+}
+
+static bool parse_filter_pathloss(DBusMessageIter *value,
+					struct discovery_filter *filter)
+{
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT16)
+		return false;
+
+	dbus_message_iter_get_basic(value, &filter->pathloss);
+
+	/* Pathloss can not exceed 137 dB (+20 dBm TX, -127 dBm RSSI) */
+	if (filter->pathloss > 137)
+		return false;
+
+	return true;
+}
+
+static bool parse_discovery_filter_entry(const char *key,
+					DBusMessageIter *value,
+					struct discovery_filter *filter)
+{
+	if (!strcmp(key, "UUIDs"))
+		return parse_filter_uuids(value, filter);
+
+	if (!strcmp(key, "RSSI"))
+		return parse_filter_rssi(value, filter);
+
+	if (!strcmp(key, "Pathloss"))
+		return parse_filter_pathloss(value, filter);
+
+	if (!strcmp(key, "ManufacturerIDs"))
+		return parse_filter_companies(value, filter);
+
+	DBG("Unknown key parameter: %s!", key);
+	return false;
+}
+
+/*
+ * Parse the a{sv} argument of SetDiscoveryFilter. An empty dictionary
+ * clears the filter, in which case *filter is set to NULL.
+ */
+static bool parse_discovery_filter_dict(DBusMessage *msg,
+					struct discovery_filter **filter)
+{
+	DBusMessageIter iter, subiter, dictiter, variantiter;
+	struct discovery_filter *f;
+	bool empty = true;
+
+	*filter = NULL;
+
+	dbus_message_iter_init(msg, &iter);
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY ||
+		dbus_message_iter_get_element_type(&iter) !=
+							DBUS_TYPE_DICT_ENTRY)
+		return false;
+
+	f = g_new0(struct discovery_filter, 1);
+	f->rssi = DISTANCE_VAL_INVALID;
+	f->pathloss = DISTANCE_VAL_INVALID;
+
+	dbus_message_iter_recurse(&iter, &subiter);
+	while (dbus_message_iter_get_arg_type(&subiter) ==
+						DBUS_TYPE_DICT_ENTRY) {
+		const char *key;
+
+		dbus_message_iter_recurse(&subiter, &dictiter);
+		dbus_message_iter_get_basic(&dictiter, &key);
+
+		if (!dbus_message_iter_next(&dictiter))
+			goto invalid;
+
+		if (dbus_message_iter_get_arg_type(&dictiter) !=
+							DBUS_TYPE_VARIANT)
+			goto invalid;
+
+		dbus_message_iter_recurse(&dictiter, &variantiter);
+
+		if (!parse_discovery_filter_entry(key, &variantiter, f))
+			goto invalid;
+
+		empty = false;
+
+		dbus_message_iter_next(&subiter);
+	}
+
+	/* RSSI and pathloss are mutually exclusive */
+	if (f->rssi != DISTANCE_VAL_INVALID &&
+				f->pathloss != DISTANCE_VAL_INVALID)
+		goto invalid;
+
+	if (empty) {
+		discovery_filter_free(f);
+		return true;
+	}
+
+	DBG("filter: rssi %d pathloss %u uuids %u manufacturers %u",
+				f->rssi, f->pathloss, f->uuid_count,
+				f->company_count);
+
+	*filter = f;
+
+	return true;
+
+invalid:
+	discovery_filter_free(f);
+	return false;
+}
+
+static DBusMessage *set_discovery_filter(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct btd_adapter *adapter = user_data;
+	const char *sender = dbus_message_get_sender(msg);
+	struct discovery_filter *filter;
+	struct watch_client *client;
+	GSList *list;
+
+	DBG("sender %s", sender);
+
+	if (!(adapter->current_settings & MGMT_SETTING_POWERED))
+		return btd_error_not_ready(msg);
+
+	if (!parse_discovery_filter_dict(msg, &filter))
+		return btd_error_invalid_args(msg);
+
+	/*
+	 * A running discovery picks up the new filter right away, the
+	 * kernel side filter is updated by restarting the discovery.
+	 */
+	list = g_slist_find_custom(adapter->discovery_list, sender,
+						compare_sender);
+	if (list) {
+		client = list->data;
+
+		discovery_filter_free(client->filter);
+		client->filter = filter;
+
+		if (!adapter->discovery_suspended)
+			trigger_start_discovery(adapter, 0);
+
+		return dbus_message_new_method_return(msg);
+	}
+
+	/*
+	 * Otherwise keep the filter until the client starts discovery
+	 * or goes away.
+	 */
+	list = g_slist_find_custom(adapter->set_filter_list, sender,
+						compare_sender);
+	if (list) {
+		client = list->data;
+
+		discovery_filter_free(client->filter);
+		client->filter = filter;
+
+		if (!filter)
+			g_dbus_remove_watch(dbus_conn, client->watch);
+
+		return dbus_message_new_method_return(msg);
+	}
+
+	if (!filter)
+		return dbus_message_new_method_return(msg);
+
+	client = g_new0(struct watch_client, 1);
+
+	client->adapter = adapter;
+	client->owner = g_strdup(sender);
+	client->filter = filter;
+	client->watch = g_dbus_add_disconnect_watch(dbus_conn, sender,
+						set_filter_disconnect, client,
+						set_filter_destroy);
+
+	adapter->set_filter_list = g_slist_prepend(adapter->set_filter_list,
+								client);
+
+	return dbus_message_new_method_return(msg);
+}
+
 static gboolean property_get_address(const GDBusPropertyTable *property,
 					DBusMessageIter *iter, void *user_data)
 {
@@ -2234,13 +2985,37 @@ static gboolean property_get_modalias(const GDBusPropertyTable *property,
 	return TRUE;
 }
 
-static int device_path_cmp(gconstpointer a, gconstpointer b)
+/*
+ * Stored devices are only created on first use, so a path naming one not
+ * created yet is resolved through the address encoded in it.
+ */
+static struct btd_device *find_device_by_path(struct btd_adapter *adapter,
+							const char *path)
 {
-	const struct btd_device *device = a;
-	const char *path = b;
-	const char *dev_path = device_get_path(device);
+	struct btd_device *device;
+	size_t len = strlen(adapter->path);
+	char addr[18];
+	bdaddr_t bdaddr;
 
-	return strcasecmp(dev_path, path);
+	device = g_hash_table_lookup(adapter->devices_path, path);
+	if (device || !g_hash_table_size(adapter->stored_devices))
+		return device;
+
+	if (strncasecmp(path, adapter->path, len) ||
+				strncasecmp(path + len, "/dev_", 5) ||
+				strlen(path + len + 5) != sizeof(addr) - 1)
+		return NULL;
+
+	memcpy(addr, path + len + 5, sizeof(addr));
+	g_strdelimit(addr, "_", ':');
+
+	if (bachk(addr) < 0)
+		return NULL;
+
+	str2ba(addr, &bdaddr);
+	load_stored_address(adapter, &bdaddr);
+
+	return g_hash_table_lookup(adapter->devices_path, path);
 }
 
 static DBusMessage *remove_device(DBusConnection *conn,
@@ -2249,21 +3024,18 @@ static DBusMessage *remove_device(DBusConnection *conn,
 	struct btd_adapter *adapter = user_data;
 	struct btd_device *device;
 	const char *path;
-	GSList *list;
 
 	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path,
 						DBUS_TYPE_INVALID) == FALSE)
 		return btd_error_invalid_args(msg);
 
-	list = g_slist_find_custom(adapter->devices, path, device_path_cmp);
-	if (!list)
+	device = find_device_by_path(adapter, path);
+	if (!device)
 		return btd_error_does_not_exist(msg);
 
 	if (!(adapter->current_settings & MGMT_SETTING_POWERED))
 		return btd_error_not_ready(msg);
 
-	device = list->data;
-
 	btd_device_set_temporary(device, TRUE);
 
 	if (!btd_device_is_connected(device)) {
@@ -2279,6 +3051,9 @@ static DBusMessage *remove_device(DBusConnection *conn,
 static const GDBusMethodTable adapter_methods[] = {
 	{ GDBUS_METHOD("StartDiscovery", NULL, NULL, start_discovery) },
 	{ GDBUS_METHOD("StopDiscovery", NULL, NULL, stop_discovery) },
+	{ GDBUS_METHOD("SetDiscoveryFilter",
+			GDBUS_ARGS({ "properties", "a{sv}" }), NULL,
+			set_discovery_filter) },
 	{ GDBUS_ASYNC_METHOD("RemoveDevice",
 			GDBUS_ARGS({ "device", "o" }), NULL, remove_device) },
 	{ }
@@ -2658,25 +3433,84 @@ static void load_ltks(struct btd_adapter *adapter, GSList *keys)
 		key->enc_size = info->enc_size;
 	}
 
-	adapter->load_ltks_id = mgmt_send(adapter->mgmt,
-					MGMT_OP_LOAD_LONG_TERM_KEYS,
-					adapter->dev_id, cp_size, cp,
-					load_ltks_complete, adapter, NULL);
+	adapter->load_ltks_id = mgmt_send(adapter->mgmt,
+					MGMT_OP_LOAD_LONG_TERM_KEYS,
+					adapter->dev_id, cp_size, cp,
+					load_ltks_complete, adapter, NULL);
+
+	g_free(cp);
+
+	if (adapter->load_ltks_id == 0) {
+		error("Failed to load LTKs for hci%u", adapter->dev_id);
+		return;
+	}
+
+	/*
+	 * This timeout handling is needed since the kernel is stupid
+	 * and forgets to send a command complete response. However in
+	 * case of failures it does send a command status.
+	 */
+	adapter->load_ltks_timeout = g_timeout_add_seconds(2,
+						load_ltks_timeout, adapter);
+}
+
+/*
+ * Kernels without LE Privacy support do not resolve RPAs, so found
+ * devices using one are resolved against the stored IRKs here instead.
+ * The resolver gets every stored IRK and is only consulted once the
+ * kernel turns out not to take them.
+ */
+static void resolver_clear(struct btd_adapter *adapter)
+{
+	GSList *l;
+
+	for (l = adapter->resolver_irks; l; l = g_slist_next(l)) {
+		struct irk_info *irk = l->data;
+
+		bt_crypto_resolver_remove_irk(adapter->resolver, irk->val);
+	}
+
+	g_slist_free_full(adapter->resolver_irks, g_free);
+	adapter->resolver_irks = NULL;
+}
+
+static void resolver_load_irks(struct btd_adapter *adapter, GSList *irks)
+{
+	GSList *l;
+
+	resolver_clear(adapter);
+
+	for (l = irks; l; l = g_slist_next(l)) {
+		struct irk_info *irk = g_memdup(l->data, sizeof(*irk));
+
+		if (!bt_crypto_resolver_add_irk(adapter->resolver, irk->val,
+									irk)) {
+			g_free(irk);
+			continue;
+		}
+
+		adapter->resolver_irks = g_slist_prepend(adapter->resolver_irks,
+									irk);
+	}
+}
+
+static void resolver_remove_device(struct btd_adapter *adapter,
+						const bdaddr_t *bdaddr)
+{
+	GSList *l;
 
-	g_free(cp);
+	for (l = adapter->resolver_irks; l; l = g_slist_next(l)) {
+		struct irk_info *irk = l->data;
 
-	if (adapter->load_ltks_id == 0) {
-		error("Failed to load LTKs for hci%u", adapter->dev_id);
+		if (bacmp(&irk->bdaddr, bdaddr))
+			continue;
+
+		bt_crypto_resolver_remove_irk(adapter->resolver, irk->val);
+		adapter->resolver_irks = g_slist_delete_link(
+						adapter->resolver_irks, l);
+		g_free(irk);
 		return;
 	}
-
-	/*
-	 * This timeout handling is needed since the kernel is stupid
-	 * and forgets to send a command complete response. However in
-	 * case of failures it does send a command status.
-	 */
-	adapter->load_ltks_timeout = g_timeout_add_seconds(2,
-						load_ltks_timeout, adapter);
 }
 
 static void load_irks_complete(uint8_t status, uint16_t length,
@@ -2686,6 +3520,7 @@ static void load_irks_complete(uint8_t status, uint16_t length,
 
 	if (status == MGMT_STATUS_UNKNOWN_COMMAND) {
 		info("Load IRKs failed: Kernel doesn't support LE Privacy");
+		adapter->resolve_rpas = true;
 		return;
 	}
 
@@ -2706,13 +3541,19 @@ static void load_irks(struct btd_adapter *adapter, GSList *irks)
 	unsigned int id;
 	GSList *l;
 
+	resolver_load_irks(adapter, irks);
+
 	/*
 	 * If the controller does not support LE Privacy operation,
 	 * there is no support for loading identity resolving keys
 	 * into the kernel.
 	 */
-	if (!(adapter->supported_settings & MGMT_SETTING_PRIVACY))
+	if (!(adapter->supported_settings & MGMT_SETTING_PRIVACY)) {
+		adapter->resolve_rpas = true;
 		return;
+	}
+
+	adapter->resolve_rpas = false;
 
 	irk_count = g_slist_length(irks);
 
@@ -2835,6 +3676,213 @@ static uint8_t get_le_addr_type(GKeyFile *keyfile)
 	return addr_type;
 }
 
+/*
+ * Devices found in storage are only created, and registered on D-Bus,
+ * when first looked up or in batches of LOAD_BATCH every
+ * LOAD_BATCH_INTERVAL ms, so that adapters with thousands of stored
+ * devices come up quickly and stay responsive while the rest is created.
+ * Their keys are loaded into the kernel up front.
+ */
+struct stored_device {
+	bdaddr_t bdaddr;
+	char addr[18];
+	uint8_t bdaddr_type;
+	bool bredr_bonded;
+	bool le_bonded;
+};
+
+struct load_entry {
+	char addr[18];
+	char *filename;
+	GKeyFile *key_file;
+	bool cached;			/* key_file owned by the storage cache */
+	struct link_key_info *key_info;
+	GSList *ltk_info;
+	struct irk_info *irk_info;
+	struct conn_param *param;
+	uint8_t bdaddr_type;
+};
+
+struct load_job {
+	struct load_entry *entries;
+	unsigned int count;
+	unsigned int next;
+};
+
+static void load_entry_parse(struct load_entry *entry)
+{
+	if (!entry->key_file) {
+		entry->key_file = g_key_file_new();
+		g_key_file_load_from_file(entry->key_file, entry->filename, 0,
+									NULL);
+	}
+
+	entry->key_info = get_key_info(entry->key_file, entry->addr);
+	entry->bdaddr_type = get_le_addr_type(entry->key_file);
+	entry->ltk_info = get_ltk_info(entry->key_file, entry->addr,
+							entry->bdaddr_type);
+	entry->irk_info = get_irk_info(entry->key_file, entry->addr,
+							entry->bdaddr_type);
+	entry->param = get_conn_param(entry->key_file, entry->addr,
+							entry->bdaddr_type);
+}
+
+static void *load_thread(void *user_data)
+{
+	struct load_job *job = user_data;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+		load_entry_parse(&job->entries[i]);
+
+	return NULL;
+}
+
+/* Parses the keyfiles of all entries, spread over a few threads */
+static void load_entries_parse(struct load_entry *entries, unsigned int count)
+{
+	struct load_job job = { entries, count, 0 };
+	pthread_t threads[LOAD_THREADS_MAX];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, n = 0;
+
+	if (count >= LOAD_THREADS_MIN_DEVICES && cpus > 1) {
+		for (i = 0; i < MIN(cpus, LOAD_THREADS_MAX); i++) {
+			if (pthread_create(&threads[n], NULL, load_thread,
+								&job) == 0)
+				n++;
+		}
+	}
+
+	/* The main thread takes its share, or all of it */
+	load_thread(&job);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static struct btd_device *load_stored_device(struct btd_adapter *adapter,
+						struct stored_device *stored)
+{
+	struct btd_device *device;
+	char filename[PATH_MAX];
+	char srcaddr[18];
+	GKeyFile *key_file;
+	GQueue *queue;
+	GSList *list;
+
+	ba2str(&adapter->bdaddr, srcaddr);
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", srcaddr,
+								stored->addr);
+
+	/* Still cached from the startup parse unless evicted since */
+	key_file = storage_keyfile_get(filename);
+
+	queue = g_hash_table_lookup(adapter->devices_addr, &stored->bdaddr);
+	if (queue) {
+		device = g_queue_peek_head(queue);
+		goto device_exist;
+	}
+
+	device = device_create_from_storage(adapter, stored->addr, key_file);
+	if (!device)
+		return NULL;
+
+	btd_device_set_temporary(device, FALSE);
+	adapter->devices = g_slist_append(adapter->devices, device);
+	device_index_add(adapter, device);
+
+	/* TODO: register services from pre-loaded list of primaries */
+
+	list = btd_device_get_uuids(device);
+	if (list)
+		device_probe_profiles(device, list);
+
+device_exist:
+	if (stored->bredr_bonded) {
+		device_set_paired(device, BDADDR_BREDR);
+		device_set_bonded(device, BDADDR_BREDR);
+	}
+
+	if (stored->le_bonded) {
+		device_set_paired(device, stored->bdaddr_type);
+		device_set_bonded(device, stored->bdaddr_type);
+	}
+
+	return device;
+}
+
+/* Creates the stored device with this address if it is still pending */
+static void load_stored_address(struct btd_adapter *adapter,
+						const bdaddr_t *bdaddr)
+{
+	struct stored_device *stored;
+
+	stored = g_hash_table_lookup(adapter->stored_devices, bdaddr);
+	if (!stored)
+		return;
+
+	/* Taken out first as creating the device may look it up again */
+	g_hash_table_steal(adapter->stored_devices, bdaddr);
+
+	load_stored_device(adapter, stored);
+	g_free(stored);
+}
+
+static unsigned int load_stored_batch(struct btd_adapter *adapter,
+							unsigned int max)
+{
+	GHashTableIter iter;
+	gpointer value;
+	unsigned int count = 0;
+
+	while (count < max && g_hash_table_size(adapter->stored_devices)) {
+		struct stored_device *stored;
+
+		g_hash_table_iter_init(&iter, adapter->stored_devices);
+		if (!g_hash_table_iter_next(&iter, NULL, &value))
+			break;
+
+		stored = value;
+		g_hash_table_iter_steal(&iter);
+
+		load_stored_device(adapter, stored);
+		g_free(stored);
+		count++;
+	}
+
+	return count;
+}
+
+static gboolean load_stored_timeout(gpointer user_data)
+{
+	struct btd_adapter *adapter = user_data;
+
+	load_stored_batch(adapter, LOAD_BATCH);
+
+	if (g_hash_table_size(adapter->stored_devices))
+		return TRUE;
+
+	DBG("%s all stored devices created", adapter->path);
+
+	adapter->stored_devices_id = 0;
+
+	return FALSE;
+}
+
+static void load_stored_all(struct btd_adapter *adapter)
+{
+	if (!g_hash_table_size(adapter->stored_devices))
+		return;
+
+	load_stored_batch(adapter, UINT_MAX);
+
+	if (adapter->stored_devices_id) {
+		g_source_remove(adapter->stored_devices_id);
+		adapter->stored_devices_id = 0;
+	}
+}
+
 static void load_devices(struct btd_adapter *adapter)
 {
 	char dirname[PATH_MAX];
@@ -2843,8 +3891,10 @@ static void load_devices(struct btd_adapter *adapter)
 	GSList *ltks = NULL;
 	GSList *irks = NULL;
 	GSList *params = NULL;
+	GArray *entries;
 	DIR *dir;
 	struct dirent *entry;
+	unsigned int i;
 
 	ba2str(&adapter->bdaddr, srcaddr);
 
@@ -2856,15 +3906,10 @@ static void load_devices(struct btd_adapter *adapter)
 		return;
 	}
 
+	entries = g_array_new(FALSE, TRUE, sizeof(struct load_entry));
+
 	while ((entry = readdir(dir)) != NULL) {
-		struct btd_device *device;
-		char filename[PATH_MAX];
-		GKeyFile *key_file;
-		struct link_key_info *key_info;
-		GSList *list, *ltk_info;
-		struct irk_info *irk_info;
-		struct conn_param *param;
-		uint8_t bdaddr_type;
+		struct load_entry load;
 
 		if (entry->d_type == DT_UNKNOWN)
 			entry->d_type = util_get_dt(dirname, entry->d_name);
@@ -2872,66 +3917,57 @@ static void load_devices(struct btd_adapter *adapter)
 		if (entry->d_type != DT_DIR || bachk(entry->d_name) < 0)
 			continue;
 
-		snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", srcaddr,
-				entry->d_name);
+		memset(&load, 0, sizeof(load));
+		snprintf(load.addr, sizeof(load.addr), "%s", entry->d_name);
+		load.filename = g_strdup_printf(STORAGEDIR "/%s/%s/info",
+							srcaddr, entry->d_name);
 
-		key_file = g_key_file_new();
-		g_key_file_load_from_file(key_file, filename, 0, NULL);
+		/* A cached copy may hold changes not yet on disk */
+		load.key_file = storage_keyfile_lookup(load.filename);
+		load.cached = load.key_file != NULL;
 
-		key_info = get_key_info(key_file, entry->d_name);
-		if (key_info)
-			keys = g_slist_append(keys, key_info);
-
-		bdaddr_type = get_le_addr_type(key_file);
+		g_array_append_val(entries, load);
+	}
 
-		ltk_info = get_ltk_info(key_file, entry->d_name, bdaddr_type);
-		ltks = g_slist_concat(ltks, ltk_info);
+	closedir(dir);
 
-		irk_info = get_irk_info(key_file, entry->d_name, bdaddr_type);
-		if (irk_info)
-			irks = g_slist_append(irks, irk_info);
+	load_entries_parse((struct load_entry *) entries->data, entries->len);
 
-		param = get_conn_param(key_file, entry->d_name, bdaddr_type);
-		if (param)
-			params = g_slist_append(params, param);
+	for (i = 0; i < entries->len; i++) {
+		struct load_entry *load = &g_array_index(entries,
+							struct load_entry, i);
+		struct stored_device *stored;
 
-		list = g_slist_find_custom(adapter->devices, entry->d_name,
-							device_address_cmp);
-		if (list) {
-			device = list->data;
-			goto device_exist;
-		}
+		if (!load->cached)
+			storage_keyfile_adopt(load->filename, load->key_file);
 
-		device = device_create_from_storage(adapter, entry->d_name,
-							key_file);
-		if (!device)
-			goto free;
+		if (load->key_info)
+			keys = g_slist_append(keys, load->key_info);
 
-		btd_device_set_temporary(device, FALSE);
-		adapter->devices = g_slist_append(adapter->devices, device);
+		ltks = g_slist_concat(ltks, load->ltk_info);
 
-		/* TODO: register services from pre-loaded list of primaries */
+		if (load->irk_info)
+			irks = g_slist_append(irks, load->irk_info);
 
-		list = btd_device_get_uuids(device);
-		if (list)
-			device_probe_profiles(device, list);
+		if (load->param)
+			params = g_slist_append(params, load->param);
 
-device_exist:
-		if (key_info) {
-			device_set_paired(device, BDADDR_BREDR);
-			device_set_bonded(device, BDADDR_BREDR);
-		}
+		stored = g_new0(struct stored_device, 1);
+		str2ba(load->addr, &stored->bdaddr);
+		memcpy(stored->addr, load->addr, sizeof(stored->addr));
+		stored->bdaddr_type = load->bdaddr_type;
+		stored->bredr_bonded = load->key_info != NULL;
+		stored->le_bonded = load->ltk_info != NULL;
 
-		if (ltk_info) {
-			device_set_paired(device, bdaddr_type);
-			device_set_bonded(device, bdaddr_type);
-		}
+		g_hash_table_replace(adapter->stored_devices, &stored->bdaddr,
+								stored);
 
-free:
-		g_key_file_free(key_file);
+		g_free(load->filename);
 	}
 
-	closedir(dir);
+	DBG("%s %u stored devices", adapter->path, entries->len);
+
+	g_array_free(entries, TRUE);
 
 	load_link_keys(adapter, keys, main_opts.debug_keys);
 	g_slist_free_full(keys, g_free);
@@ -2942,6 +3978,11 @@ free:
 	g_slist_free_full(irks, g_free);
 	load_conn_params(adapter, params);
 	g_slist_free_full(params, g_free);
+
+	if (g_hash_table_size(adapter->stored_devices) &&
+						!adapter->stored_devices_id)
+		adapter->stored_devices_id = g_timeout_add(LOAD_BATCH_INTERVAL,
+						load_stored_timeout, adapter);
 }
 
 int btd_adapter_block_address(struct btd_adapter *adapter,
@@ -3067,12 +4108,8 @@ static void adapter_add_connection(struct btd_adapter *adapter,
 {
 	device_add_connection(device, bdaddr_type);
 
-	if (g_slist_find(adapter->connections, device)) {
+	if (!device_set_append(&adapter->connections, device))
 		error("Device is already marked as connected");
-		return;
-	}
-
-	adapter->connections = g_slist_append(adapter->connections, device);
 }
 
 static void get_connections_complete(uint8_t status, uint16_t length,
@@ -3189,7 +4226,7 @@ int adapter_connect_list_add(struct btd_adapter *adapter,
 	if (kernel_conn_control)
 		return 0;
 
-	if (g_slist_find(adapter->connect_list, device)) {
+	if (device_set_contains(&adapter->connect_list, device)) {
 		DBG("ignoring already added device %s",
 						device_get_path(device));
 		goto done;
@@ -3201,7 +4238,7 @@ int adapter_connect_list_add(struct btd_adapter *adapter,
 		return -ENOTSUP;
 	}
 
-	adapter->connect_list = g_slist_append(adapter->connect_list, device);
+	device_set_append(&adapter->connect_list, device);
 	DBG("%s added to %s's connect_list", device_get_path(device),
 							adapter->system_name);
 
@@ -3228,17 +4265,16 @@ void adapter_connect_list_remove(struct btd_adapter *adapter,
 	if (kernel_conn_control)
 		return;
 
-	if (!g_slist_find(adapter->connect_list, device)) {
+	if (!device_set_remove(&adapter->connect_list, device)) {
 		DBG("device %s is not on the list, ignoring",
 						device_get_path(device));
 		return;
 	}
 
-	adapter->connect_list = g_slist_remove(adapter->connect_list, device);
 	DBG("%s removed from %s's connect_list", device_get_path(device),
 							adapter->system_name);
 
-	if (!adapter->connect_list) {
+	if (device_set_is_empty(&adapter->connect_list)) {
 		stop_passive_scanning(adapter);
 		return;
 	}
@@ -3360,8 +4396,7 @@ static void add_device_complete(uint8_t status, uint16_t length,
 	if (status != MGMT_STATUS_SUCCESS) {
 		error("Failed to add device %s (%u): %s (0x%02x)",
 			addr, rp->addr.type, mgmt_errstr(status), status);
-		adapter->connect_list = g_slist_remove(adapter->connect_list,
-									dev);
+		device_set_remove(&adapter->connect_list, dev);
 		return;
 	}
 
@@ -3379,7 +4414,7 @@ void adapter_auto_connect_add(struct btd_adapter *adapter,
 	if (!kernel_conn_control)
 		return;
 
-	if (g_slist_find(adapter->connect_list, device)) {
+	if (device_set_contains(&adapter->connect_list, device)) {
 		DBG("ignoring already added device %s",
 						device_get_path(device));
 		return;
@@ -3404,7 +4439,7 @@ void adapter_auto_connect_add(struct btd_adapter *adapter,
 	if (id == 0)
 		return;
 
-	adapter->connect_list = g_slist_append(adapter->connect_list, device);
+	device_set_append(&adapter->connect_list, device);
 }
 
 static void remove_device_complete(uint8_t status, uint16_t length,
@@ -3440,7 +4475,7 @@ void adapter_auto_connect_remove(struct btd_adapter *adapter,
 	if (!kernel_conn_control)
 		return;
 
-	if (!g_slist_find(adapter->connect_list, device)) {
+	if (!device_set_contains(&adapter->connect_list, device)) {
 		DBG("ignoring not added device %s", device_get_path(device));
 		return;
 	}
@@ -3463,7 +4498,7 @@ void adapter_auto_connect_remove(struct btd_adapter *adapter,
 	if (id == 0)
 		return;
 
-	adapter->connect_list = g_slist_remove(adapter->connect_list, device);
+	device_set_remove(&adapter->connect_list, device);
 }
 
 static void adapter_start(struct btd_adapter *adapter)
@@ -3569,7 +4604,20 @@ static void adapter_free(gpointer user_data)
 
 	sdp_list_free(adapter->services, NULL);
 
-	g_slist_free(adapter->connections);
+	g_free(adapter->discovery_cp);
+
+	device_set_free(&adapter->connections);
+	device_set_free(&adapter->connect_list);
+	device_set_free(&adapter->discovery_found);
+
+	ad_cache_free(adapter->ad_cache);
+
+	resolver_clear(adapter);
+	bt_crypto_resolver_free(adapter->resolver);
+
+	g_hash_table_destroy(adapter->devices_addr);
+	g_hash_table_destroy(adapter->devices_path);
+	g_hash_table_destroy(adapter->stored_devices);
 
 	g_free(adapter->path);
 	g_free(adapter->name);
@@ -4517,6 +5565,22 @@ static struct btd_adapter *btd_adapter_new(uint16_t index)
 
 	adapter->auths = g_queue_new();
 
+	/* Without the cache every report is simply parsed in full */
+	adapter->ad_cache = ad_cache_new(AD_CACHE_SIZE);
+
+	/* Without the resolver RPAs are only resolved by the kernel */
+	adapter->resolver = bt_crypto_resolver_new();
+
+	device_set_init(&adapter->discovery_found);
+	device_set_init(&adapter->connections);
+	device_set_init(&adapter->connect_list);
+
+	adapter->devices_addr = g_hash_table_new_full(bdaddr_hash, bdaddr_equal,
+						g_free, device_index_free);
+	adapter->devices_path = g_hash_table_new(path_hash, path_equal);
+	adapter->stored_devices = g_hash_table_new_full(bdaddr_hash,
+						bdaddr_equal, NULL, g_free);
+
 	return btd_adapter_ref(adapter);
 }
 
@@ -4538,8 +5602,17 @@ static void adapter_remove(struct btd_adapter *adapter)
 
 	discovery_cleanup(adapter);
 
-	g_slist_free(adapter->connect_list);
-	adapter->connect_list = NULL;
+	device_set_clear(&adapter->connect_list, NULL);
+
+	if (adapter->stored_devices_id) {
+		g_source_remove(adapter->stored_devices_id);
+		adapter->stored_devices_id = 0;
+	}
+
+	g_hash_table_remove_all(adapter->stored_devices);
+
+	g_hash_table_remove_all(adapter->devices_path);
+	g_hash_table_remove_all(adapter->devices_addr);
 
 	for (l = adapter->devices; l; l = l->next)
 		device_remove(l->data, FALSE);
@@ -4653,27 +5726,52 @@ static void confirm_name(struct btd_adapter *adapter, const bdaddr_t *bdaddr,
 						confirm_name_timeout, adapter);
 }
 
-static void adapter_msd_notify(struct btd_adapter *adapter,
-							struct btd_device *dev,
-							GSList *msd_list)
+struct msd_notify_data {
+	struct btd_adapter *adapter;
+	struct btd_device *dev;
+};
+
+static void msd_notify(uint16_t company, const uint8_t *data,
+					uint8_t data_len, void *user_data)
 {
+	struct msd_notify_data *notify = user_data;
 	GSList *cb_l, *cb_next;
-	GSList *msd_l, *msd_next;
 
-	for (cb_l = adapter->msd_callbacks; cb_l != NULL; cb_l = cb_next) {
+	for (cb_l = notify->adapter->msd_callbacks; cb_l != NULL;
+							cb_l = cb_next) {
 		btd_msd_cb_t cb = cb_l->data;
 
 		cb_next = g_slist_next(cb_l);
 
-		for (msd_l = msd_list; msd_l != NULL; msd_l = msd_next) {
-			const struct eir_msd *msd = msd_l->data;
+		cb(notify->adapter, notify->dev, company, data, data_len);
+	}
+}
+
+static void adapter_msd_notify(struct btd_adapter *adapter,
+					struct btd_device *dev,
+					const struct eir_view *eir)
+{
+	struct msd_notify_data notify = {
+		.adapter = adapter,
+		.dev = dev,
+	};
 
-			msd_next = g_slist_next(msd_l);
+	if (!adapter->msd_callbacks)
+		return;
 
-			cb(adapter, dev, msd->company, msd->data,
-								msd->data_len);
-		}
-	}
+	eir_view_foreach_msd(eir, msd_notify, &notify);
+}
+
+static void add_eir_uuid(const bt_uuid_t *uuid, void *user_data)
+{
+	struct btd_device *dev = user_data;
+	bt_uuid_t uuid128;
+	char str[MAX_LEN_UUID_STR];
+
+	bt_uuid_to_uuid128(uuid, &uuid128);
+	bt_uuid_to_string(&uuid128, str, sizeof(str));
+
+	device_add_eir_uuid(dev, str);
 }
 
 static void update_found_devices(struct btd_adapter *adapter,
@@ -4683,12 +5781,47 @@ static void update_found_devices(struct btd_adapter *adapter,
 					const uint8_t *data, uint8_t data_len)
 {
 	struct btd_device *dev;
-	struct eir_data eir_data;
-	bool name_known, discoverable;
+	struct eir_view eir_data;
+	char name[HCI_MAX_NAME_LENGTH + 1];
+	bool has_name, name_known, discoverable, unchanged, filtered;
 	char addr[18];
 
-	memset(&eir_data, 0, sizeof(eir_data));
-	eir_parse(&eir_data, data, data_len);
+	dev = btd_adapter_find_device(adapter, bdaddr, bdaddr_type);
+
+	/*
+	 * Reports no discovery client is interested in are dropped before
+	 * they are parsed or can create a device object. A device in the
+	 * connect list is still kept up to date, so the filters never hold
+	 * back auto-connection, but it is not reported to discovery clients.
+	 * Passive scanning for auto-connection is not subject to them at all.
+	 */
+	filtered = adapter->discovery_list &&
+			!discovery_filters_match(adapter, rssi, data, data_len);
+
+	if (filtered && !(dev && device_set_contains(&adapter->connect_list,
+									dev)))
+		return;
+
+	unchanged = ad_cache_lookup(adapter->ad_cache, bdaddr->b, bdaddr_type,
+						data, data_len, rssi, NULL);
+
+	/*
+	 * Everything derived from an unchanged payload has already been
+	 * applied to the device, only RSSI and last seen need refreshing.
+	 */
+	if (dev && unchanged) {
+		device_update_last_seen(dev, bdaddr_type);
+
+		if (device_is_temporary(dev) && !adapter->discovery_list)
+			return;
+
+		device_set_rssi(dev, rssi);
+		name_known = device_name_known(dev);
+
+		goto found;
+	}
+
+	eir_parse_view(&eir_data, data, data_len);
 
 	if (bdaddr_type == BDADDR_BREDR)
 		discoverable = true;
@@ -4697,24 +5830,20 @@ static void update_found_devices(struct btd_adapter *adapter,
 
 	ba2str(bdaddr, addr);
 
-	dev = btd_adapter_find_device(adapter, bdaddr, bdaddr_type);
 	if (!dev) {
 		/*
 		 * If no client has requested discovery or the device is
 		 * not marked as discoverable, then do not create new
 		 * device objects.
 		 */
-		if (!adapter->discovery_list || !discoverable) {
-			eir_data_free(&eir_data);
+		if (!adapter->discovery_list || !discoverable)
 			return;
-		}
 
 		dev = adapter_create_device(adapter, bdaddr, bdaddr_type);
 	}
 
 	if (!dev) {
 		error("Unable to create object for found device %s", addr);
-		eir_data_free(&eir_data);
 		return;
 	}
 
@@ -4730,17 +5859,17 @@ static void update_found_devices(struct btd_adapter *adapter,
 					!(eir_data.flags & EIR_BREDR_UNSUP))
 		device_set_bredr_support(dev);
 
-	if (eir_data.name != NULL && eir_data.name_complete)
-		device_store_cached_name(dev, eir_data.name);
+	has_name = eir_view_get_name(&eir_data, name, sizeof(name));
+
+	if (has_name && eir_data.name_complete)
+		device_store_cached_name(dev, name);
 
 	/*
 	 * If no client has requested discovery, then only update
 	 * already paired devices (skip temporary ones).
 	 */
-	if (device_is_temporary(dev) && !adapter->discovery_list) {
-		eir_data_free(&eir_data);
+	if (device_is_temporary(dev) && !adapter->discovery_list)
 		return;
-	}
 
 	device_set_legacy(dev, legacy);
 	device_set_rssi(dev, rssi);
@@ -4752,8 +5881,8 @@ static void update_found_devices(struct btd_adapter *adapter,
 	 * known, but still update the name with the known short name. */
 	name_known = device_name_known(dev);
 
-	if (eir_data.name && (eir_data.name_complete || !name_known))
-		btd_device_device_set_name(dev, eir_data.name);
+	if (has_name && (eir_data.name_complete || !name_known))
+		btd_device_device_set_name(dev, name);
 
 	if (eir_data.class != 0)
 		device_set_class(dev, eir_data.class);
@@ -4765,13 +5894,15 @@ static void update_found_devices(struct btd_adapter *adapter,
 							eir_data.did_product,
 							eir_data.did_version);
 
-	device_add_eir_uuids(dev, eir_data.services);
+	eir_view_foreach_uuid(&eir_data, add_eir_uuid, dev);
 
-	if (eir_data.msd_list)
-		adapter_msd_notify(adapter, dev, eir_data.msd_list);
+	adapter_msd_notify(adapter, dev, &eir_data);
 
-	eir_data_free(&eir_data);
+	/* Only now has the payload been applied in full */
+	ad_cache_store(adapter->ad_cache, bdaddr->b, bdaddr_type, data,
+							data_len, rssi, 0);
 
+found:
 	/*
 	 * Only if at least one client has requested discovery, maintain
 	 * list of found devices and name confirming for legacy devices.
@@ -4781,14 +5912,16 @@ static void update_found_devices(struct btd_adapter *adapter,
 	if (!adapter->discovery_list)
 		goto connect_le;
 
-	if (g_slist_find(adapter->discovery_found, dev))
+	if (filtered)
+		return;
+
+	if (device_set_contains(&adapter->discovery_found, dev))
 		return;
 
 	if (confirm)
 		confirm_name(adapter, bdaddr, bdaddr_type, name_known);
 
-	adapter->discovery_found = g_slist_prepend(adapter->discovery_found,
-									dev);
+	device_set_prepend(&adapter->discovery_found, dev);
 
 	return;
 
@@ -4814,7 +5947,7 @@ connect_le:
 	 * attempt to it can be made
 	 */
 	if (bdaddr_type != BDADDR_BREDR && !btd_device_is_connected(dev) &&
-				g_slist_find(adapter->connect_list, dev)) {
+			device_set_contains(&adapter->connect_list, dev)) {
 		adapter->connect_le = dev;
 		stop_passive_scanning(adapter);
 	}
@@ -4825,6 +5958,8 @@ static void device_found_callback(uint16_t index, uint16_t length,
 {
 	const struct mgmt_ev_device_found *ev = param;
 	struct btd_adapter *adapter = user_data;
+	const bdaddr_t *bdaddr;
+	uint8_t bdaddr_type;
 	const uint8_t *eir;
 	uint16_t eir_len;
 	uint32_t flags;
@@ -4862,9 +5997,22 @@ static void device_found_callback(uint16_t index, uint16_t length,
 	confirm_name = (flags & MGMT_DEV_FOUND_CONFIRM_NAME);
 	legacy = (flags & MGMT_DEV_FOUND_LEGACY_PAIRING);
 
-	update_found_devices(adapter, &ev->addr.bdaddr, ev->addr.type,
-					ev->rssi, confirm_name, legacy,
-					eir, eir_len);
+	bdaddr = &ev->addr.bdaddr;
+	bdaddr_type = ev->addr.type;
+
+	if (adapter->resolve_rpas && bdaddr_type == BDADDR_LE_RANDOM) {
+		struct irk_info *irk;
+
+		irk = bt_crypto_resolver_resolve(adapter->resolver,
+								bdaddr->b);
+		if (irk) {
+			bdaddr = &irk->bdaddr;
+			bdaddr_type = irk->bdaddr_type;
+		}
+	}
+
+	update_found_devices(adapter, bdaddr, bdaddr_type, ev->rssi,
+					confirm_name, legacy, eir, eir_len);
 }
 
 struct agent *adapter_get_agent(struct btd_adapter *adapter)
@@ -4878,7 +6026,7 @@ static void adapter_remove_connection(struct btd_adapter *adapter,
 {
 	DBG("");
 
-	if (!g_slist_find(adapter->connections, device)) {
+	if (!device_set_contains(&adapter->connections, device)) {
 		error("No matching connection for device");
 		return;
 	}
@@ -4892,7 +6040,7 @@ static void adapter_remove_connection(struct btd_adapter *adapter,
 	if (btd_device_is_connected(device))
 		return;
 
-	adapter->connections = g_slist_remove(adapter->connections, device);
+	device_set_remove(&adapter->connections, device);
 
 	if (device_is_temporary(device) && !device_is_retrying(device)) {
 		const char *path = device_get_path(device);
@@ -4921,10 +6069,23 @@ static void adapter_stop(struct btd_adapter *adapter)
 		g_dbus_remove_watch(dbus_conn, client->watch);
 	}
 
+	while (adapter->set_filter_list) {
+		struct watch_client *client;
+
+		client = adapter->set_filter_list->data;
+
+		/* Freed and removed from the list by set_filter_destroy */
+		g_dbus_remove_watch(dbus_conn, client->watch);
+	}
+
+	g_free(adapter->discovery_cp);
+	adapter->discovery_cp = NULL;
+	adapter->discovery_cp_len = 0;
+
 	adapter->discovering = false;
 
-	while (adapter->connections) {
-		struct btd_device *device = adapter->connections->data;
+	while (!device_set_is_empty(&adapter->connections)) {
+		struct btd_device *device = adapter->connections.head->data;
 		uint8_t addr_type = btd_device_get_bdaddr_type(device);
 
 		adapter_remove_connection(adapter, device, BDADDR_BREDR);
@@ -5094,7 +6255,7 @@ static int adapter_authorize(struct btd_adapter *adapter, const bdaddr_t *dst,
 		return 0;
 
 	/* Device connected? */
-	if (!g_slist_find(adapter->connections, device))
+	if (!device_set_contains(&adapter->connections, device))
 		error("Authorization request for non-connected device!?");
 
 	auth = g_try_new0(struct service_auth, 1);
@@ -5918,9 +7079,7 @@ static void store_link_key(struct btd_adapter *adapter,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	gsize length = 0;
 	char key_str[33];
-	char *str;
 	int i;
 
 	ba2str(btd_adapter_get_address(adapter), adapter_addr);
@@ -5928,8 +7087,7 @@ static void store_link_key(struct btd_adapter *adapter,
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 								device_addr);
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	for (i = 0; i < 16; i++)
 		sprintf(key_str + (i * 2), "%2.2X", key[i]);
@@ -5939,13 +7097,8 @@ static void store_link_key(struct btd_adapter *adapter,
 	g_key_file_set_integer(key_file, "LinkKey", "Type", type);
 	g_key_file_set_integer(key_file, "LinkKey", "PINLength", pin_length);
 
-	create_file(filename, S_IRUSR | S_IWUSR);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
+	storage_keyfile_sync(filename);
 }
 
 static void new_link_key_callback(uint16_t index, uint16_t length,
@@ -6006,8 +7159,6 @@ static void store_longtermkey(const bdaddr_t *local, const bdaddr_t *peer,
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
 	char key_str[33];
-	gsize length = 0;
-	char *str;
 	int i;
 
 	if (master != 0x00 && master != 0x01) {
@@ -6020,8 +7171,7 @@ static void store_longtermkey(const bdaddr_t *local, const bdaddr_t *peer,
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 								device_addr);
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	/* Old files may contain this so remove it in case it exists */
 	g_key_file_remove_key(key_file, "LongTermKey", "Master", NULL);
@@ -6038,13 +7188,8 @@ static void store_longtermkey(const bdaddr_t *local, const bdaddr_t *peer,
 	g_key_file_set_integer(key_file, group, "EDiv", ediv);
 	g_key_file_set_uint64(key_file, group, "Rand", rand);
 
-	create_file(filename, S_IRUSR | S_IWUSR);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
+	storage_keyfile_sync(filename);
 }
 
 static void new_long_term_key_callback(uint16_t index, uint16_t length,
@@ -6122,8 +7267,6 @@ static void store_csrk(const bdaddr_t *local, const bdaddr_t *peer,
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
 	char key_str[33];
-	gsize length = 0;
-	char *str;
 	int i;
 
 	if (master == 0x00)
@@ -6141,21 +7284,15 @@ static void store_csrk(const bdaddr_t *local, const bdaddr_t *peer,
 	snprintf(filename, sizeof(filename), STORAGEDIR "/%s/%s/info",
 						adapter_addr, device_addr);
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	for (i = 0; i < 16; i++)
 		sprintf(key_str + (i * 2), "%2.2X", key[i]);
 
 	g_key_file_set_string(key_file, group, "Key", key_str);
 
-	create_file(filename, S_IRUSR | S_IWUSR);
-
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
+	storage_keyfile_sync(filename);
 }
 
 static void new_csrk_callback(uint16_t index, uint16_t length,
@@ -6202,9 +7339,7 @@ static void store_irk(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	char *store_data;
 	char str[33];
-	size_t length = 0;
 	int i;
 
 	ba2str(&adapter->bdaddr, adapter_addr);
@@ -6212,21 +7347,15 @@ static void store_irk(struct btd_adapter *adapter, const bdaddr_t *peer,
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 								device_addr);
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	for (i = 0; i < 16; i++)
 		sprintf(str + (i * 2), "%2.2X", key[i]);
 
 	g_key_file_set_string(key_file, "IdentityResolvingKey", "Key", str);
 
-	create_file(filename, S_IRUSR | S_IWUSR);
-
-	store_data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, store_data, length, NULL);
-	g_free(store_data);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
+	storage_keyfile_sync(filename);
 }
 
 static void new_irk_callback(uint16_t index, uint16_t length,
@@ -6268,7 +7397,9 @@ static void new_irk_callback(uint16_t index, uint16_t length,
 		return;
 	}
 
+	device_index_remove(adapter, device);
 	device_update_addr(device, &addr->bdaddr, addr->type);
+	device_index_add(adapter, device);
 
 	if (duplicate)
 		device_merge_duplicate(device, duplicate);
@@ -6292,8 +7423,6 @@ static void store_conn_param(struct btd_adapter *adapter, const bdaddr_t *peer,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	char *store_data;
-	size_t length = 0;
 
 	ba2str(&adapter->bdaddr, adapter_addr);
 	ba2str(peer, device_addr);
@@ -6302,8 +7431,7 @@ static void store_conn_param(struct btd_adapter *adapter, const bdaddr_t *peer,
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 								device_addr);
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	g_key_file_set_integer(key_file, "ConnectionParameters",
 						"MinInterval", min_interval);
@@ -6314,13 +7442,7 @@ static void store_conn_param(struct btd_adapter *adapter, const bdaddr_t *peer,
 	g_key_file_set_integer(key_file, "ConnectionParameters",
 						"Timeout", timeout);
 
-	create_file(filename, S_IRUSR | S_IWUSR);
-
-	store_data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, store_data, length, NULL);
-	g_free(store_data);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
 }
 
 static void new_conn_param(uint16_t index, uint16_t length,
@@ -6483,10 +7605,18 @@ int btd_adapter_read_local_oob_data(struct btd_adapter *adapter)
 	return -EIO;
 }
 
+/*
+ * Walks every device of the adapter, stored ones included. Stored devices
+ * not created yet are all created first, at once, which costs as much as
+ * loading them eagerly at startup; prefer btd_adapter_find_device() when
+ * looking for a particular address.
+ */
 void btd_adapter_for_each_device(struct btd_adapter *adapter,
 			void (*cb)(struct btd_device *device, void *data),
 			void *data)
 {
+	load_stored_all(adapter);
+
 	g_slist_foreach(adapter->devices, (GFunc) cb, data);
 }
 
@@ -6669,9 +7799,10 @@ static void connected_callback(uint16_t index, uint16_t length,
 	const struct mgmt_ev_device_connected *ev = param;
 	struct btd_adapter *adapter = user_data;
 	struct btd_device *device;
-	struct eir_data eir_data;
+	struct eir_view eir_data;
 	uint16_t eir_len;
 	char addr[18];
+	char name[HCI_MAX_NAME_LENGTH + 1];
 	bool name_known;
 
 	if (length < sizeof(*ev)) {
@@ -6696,9 +7827,7 @@ static void connected_callback(uint16_t index, uint16_t length,
 		return;
 	}
 
-	memset(&eir_data, 0, sizeof(eir_data));
-	if (eir_len > 0)
-		eir_parse(&eir_data, ev->eir, eir_len);
+	eir_parse_view(&eir_data, eir_len > 0 ? ev->eir : NULL, eir_len);
 
 	if (eir_data.class != 0)
 		device_set_class(device, eir_data.class);
@@ -6707,15 +7836,13 @@ static void connected_callback(uint16_t index, uint16_t length,
 
 	name_known = device_name_known(device);
 
-	if (eir_data.name && (eir_data.name_complete || !name_known)) {
-		device_store_cached_name(device, eir_data.name);
-		btd_device_device_set_name(device, eir_data.name);
+	if ((eir_data.name_complete || !name_known) &&
+			eir_view_get_name(&eir_data, name, sizeof(name))) {
+		device_store_cached_name(device, name);
+		btd_device_device_set_name(device, name);
 	}
 
-	if (eir_data.msd_list)
-		adapter_msd_notify(adapter, device, eir_data.msd_list);
-
-	eir_data_free(&eir_data);
+	adapter_msd_notify(adapter, device, &eir_data);
 }
 
 static void device_blocked_callback(uint16_t index, uint16_t length,
@@ -6838,16 +7965,13 @@ static void remove_keys(struct btd_adapter *adapter,
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	gsize length = 0;
-	char *str;
 
 	ba2str(btd_adapter_get_address(adapter), adapter_addr);
 	ba2str(device_get_address(device), device_addr);
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 								device_addr);
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	if (type == BDADDR_BREDR) {
 		g_key_file_remove_group(key_file, "LinkKey", NULL);
@@ -6856,13 +7980,11 @@ static void remove_keys(struct btd_adapter *adapter,
 		g_key_file_remove_group(key_file, "LocalSignatureKey", NULL);
 		g_key_file_remove_group(key_file, "RemoteSignatureKey", NULL);
 		g_key_file_remove_group(key_file, "IdentityResolvingKey", NULL);
+		resolver_remove_device(adapter, device_get_address(device));
 	}
 
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
-
-	g_key_file_free(key_file);
+	storage_keyfile_put(filename);
+	storage_keyfile_sync(filename);
 }
 
 static void unpaired_callback(uint16_t index, uint16_t length,
@@ -245,6 +245,38 @@ struct btd_device {
 
 	GIOChannel	*att_io;
 	guint		store_id;
+	char		*cached_name;		/* Name last queued for cache */
+
+	uint32_t	props_dirty;		/* Pending PROP_* changes */
+	guint		props_id;		/* Deferred emission timer */
+	gint64		props_last;		/* Last emission, monotonic us */
+};
+
+/*
+ * Properties that change with every advert during discovery. Their
+ * PropertiesChanged signals are coalesced per device and emitted at most
+ * once per main_opts.prop_interval milliseconds.
+ */
+enum {
+	PROP_RSSI		= 1 << 0,
+	PROP_NAME		= 1 << 1,
+	PROP_ALIAS		= 1 << 2,
+	PROP_CLASS		= 1 << 3,
+	PROP_ICON		= 1 << 4,
+	PROP_APPEARANCE		= 1 << 5,
+	PROP_UUIDS		= 1 << 6,
+	PROP_LEGACY_PAIRING	= 1 << 7,
+};
+
+static const char * const coalesced_props[] = {
+	"RSSI",
+	"Name",
+	"Alias",
+	"Class",
+	"Icon",
+	"Appearance",
+	"UUIDs",
+	"LegacyPairing",
 };
 
 static const uint16_t uuid_list[] = {
@@ -255,6 +287,8 @@ static const uint16_t uuid_list[] = {
 };
 
 static int device_browse_gatt(struct btd_device *device, DBusMessage *msg);
+static char *load_cached_name(struct btd_device *device, const char *local,
+				const char *peer);
 static int device_browse_sdp(struct btd_device *device, DBusMessage *msg);
 
 static struct bearer_state *get_state(struct btd_device *dev,
@@ -266,6 +300,52 @@ static struct bearer_state *get_state(struct btd_device *dev,
 		return &dev->le_state;
 }
 
+static void flush_properties(struct btd_device *device)
+{
+	unsigned int i;
+
+	/* gdbus merges these into one PropertiesChanged signal */
+	for (i = 0; i < G_N_ELEMENTS(coalesced_props); i++) {
+		if (device->props_dirty & (1 << i))
+			g_dbus_emit_property_changed(dbus_conn, device->path,
+					DEVICE_INTERFACE, coalesced_props[i]);
+	}
+
+	device->props_dirty = 0;
+	device->props_last = g_get_monotonic_time();
+}
+
+static gboolean flush_properties_timeout(gpointer user_data)
+{
+	struct btd_device *device = user_data;
+
+	device->props_id = 0;
+
+	flush_properties(device);
+
+	return FALSE;
+}
+
+static void emit_property_changed(struct btd_device *device, uint32_t prop)
+{
+	gint64 elapsed;
+
+	device->props_dirty |= prop;
+
+	if (device->props_id)
+		return;
+
+	elapsed = (g_get_monotonic_time() - device->props_last) / 1000;
+
+	if (!main_opts.prop_interval || elapsed >= main_opts.prop_interval) {
+		flush_properties(device);
+		return;
+	}
+
+	device->props_id = g_timeout_add(main_opts.prop_interval - elapsed,
+					flush_properties_timeout, device);
+}
+
 static GSList *find_service_with_profile(GSList *list, struct btd_profile *p)
 {
 	GSList *l;
@@ -342,10 +422,8 @@ static gboolean store_device_info_cb(gpointer user_data)
 	char filename[PATH_MAX];
 	char adapter_addr[18];
 	char device_addr[18];
-	char *str;
 	char class[9];
 	char **uuids = NULL;
-	gsize length = 0;
 
 	device->store_id = 0;
 
@@ -354,8 +432,7 @@ static gboolean store_device_info_cb(gpointer user_data)
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/info", adapter_addr,
 			device_addr);
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 
 	g_key_file_set_string(key_file, "General", "Name", device->name);
 
@@ -413,13 +490,8 @@ static gboolean store_device_info_cb(gpointer user_data)
 		g_key_file_remove_group(key_file, "DeviceID", NULL);
 	}
 
-	create_file(filename, S_IRUSR | S_IWUSR);
+	storage_keyfile_put(filename);
 
-	str = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, str, length, NULL);
-	g_free(str);
-
-	g_key_file_free(key_file);
 	g_free(uuids);
 
 	return FALSE;
@@ -453,13 +525,15 @@ static void store_device_info(struct btd_device *device)
 	device->store_id = g_idle_add(store_device_info_cb, device);
 }
 
+/*
+ * Names arrive with every advert, so they only reach storage when they
+ * differ from the one already stored; the write itself is deferred to
+ * the storage layer.
+ */
 void device_store_cached_name(struct btd_device *dev, const char *name)
 {
 	char filename[PATH_MAX];
 	char s_addr[18], d_addr[18];
-	GKeyFile *key_file;
-	char *data;
-	gsize length = 0;
 
 	if (device_address_is_private(dev)) {
 		warn("Can't store name for private addressed device %s",
@@ -469,18 +543,22 @@ void device_store_cached_name(struct btd_device *dev, const char *name)
 
 	ba2str(btd_adapter_get_address(dev->adapter), s_addr);
 	ba2str(&dev->bdaddr, d_addr);
-	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", s_addr, d_addr);
-	create_file(filename, S_IRUSR | S_IWUSR);
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
-	g_key_file_set_string(key_file, "General", "Name", name);
+	/* Read the stored name once so a restart does not rewrite it */
+	if (!dev->cached_name)
+		dev->cached_name = load_cached_name(dev, s_addr, d_addr);
 
-	data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, data, length, NULL);
-	g_free(data);
+	if (dev->cached_name && !strcmp(dev->cached_name, name))
+		return;
+
+	g_free(dev->cached_name);
+	dev->cached_name = g_strdup(name);
 
-	g_key_file_free(key_file);
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", s_addr, d_addr);
+
+	g_key_file_set_string(storage_keyfile_get(filename), "General", "Name",
+									name);
+	storage_keyfile_put(filename);
 }
 
 static void browse_request_free(struct browse_req *req)
@@ -600,6 +678,9 @@ static void device_free(gpointer user_data)
 	if (device->discov_timer)
 		g_source_remove(device->discov_timer);
 
+	if (device->props_id)
+		g_source_remove(device->props_id);
+
 	if (device->connect)
 		dbus_message_unref(device->connect);
 
@@ -620,6 +701,7 @@ static void device_free(gpointer user_data)
 
 	g_free(device->path);
 	g_free(device->alias);
+	g_free(device->cached_name);
 	free(device->modalias);
 	g_free(device);
 }
@@ -1357,25 +1439,17 @@ done:
 	dev->connect = NULL;
 }
 
-void device_add_eir_uuids(struct btd_device *dev, GSList *uuids)
+void device_add_eir_uuid(struct btd_device *dev, const char *uuid)
 {
-	GSList *l;
-	bool added = false;
-
 	if (dev->bredr_state.svc_resolved || dev->le_state.svc_resolved)
 		return;
 
-	for (l = uuids; l != NULL; l = l->next) {
-		const char *str = l->data;
-		if (g_slist_find_custom(dev->eir_uuids, str, bt_uuid_strcmp))
-			continue;
-		added = true;
-		dev->eir_uuids = g_slist_append(dev->eir_uuids, g_strdup(str));
-	}
+	if (g_slist_find_custom(dev->eir_uuids, uuid, bt_uuid_strcmp))
+		return;
 
-	if (added)
-		g_dbus_emit_property_changed(dbus_conn, dev->path,
-						DEVICE_INTERFACE, "UUIDs");
+	dev->eir_uuids = g_slist_append(dev->eir_uuids, g_strdup(uuid));
+
+	emit_property_changed(dev, PROP_UUIDS);
 }
 
 static struct btd_service *find_connectable_service(struct btd_device *dev,
@@ -1676,9 +1750,8 @@ static void store_services(struct btd_device *device)
 	uuid_t uuid;
 	char *prim_uuid;
 	GKeyFile *key_file;
+	char **groups, **group;
 	GSList *l;
-	char *data;
-	gsize length = 0;
 
 	if (device_address_is_private(device)) {
 		warn("Can't store services for private addressed device %s",
@@ -1696,7 +1769,19 @@ static void store_services(struct btd_device *device)
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/attributes", src_addr,
 								dst_addr);
-	key_file = g_key_file_new();
+
+	/* Nothing to store leaves the previous services in place */
+	if (!device->primaries) {
+		free(prim_uuid);
+		return;
+	}
+
+	key_file = storage_keyfile_get(filename);
+
+	groups = g_key_file_get_groups(key_file, NULL);
+	for (group = groups; *group; group++)
+		g_key_file_remove_group(key_file, *group, NULL);
+	g_strfreev(groups);
 
 	for (l = device->primaries; l; l = l->next) {
 		struct gatt_primary *primary = l->data;
@@ -1730,15 +1815,9 @@ static void store_services(struct btd_device *device)
 					primary->range.end);
 	}
 
-	data = g_key_file_to_data(key_file, &length, NULL);
-	if (length > 0) {
-		create_file(filename, S_IRUSR | S_IWUSR);
-		g_file_set_contents(filename, data, length, NULL);
-	}
+	storage_keyfile_put(filename);
 
 	free(prim_uuid);
-	g_free(data);
-	g_key_file_free(key_file);
 }
 
 static void browse_request_complete(struct browse_req *req, uint8_t bdaddr_type,
@@ -2253,10 +2332,7 @@ static char *load_cached_name(struct btd_device *device, const char *local,
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
 
-	key_file = g_key_file_new();
-
-	if (!g_key_file_load_from_file(key_file, filename, 0, NULL))
-		goto failed;
+	key_file = storage_keyfile_get(filename);
 
 	str = g_key_file_get_string(key_file, "General", "Name", NULL);
 	if (str) {
@@ -2265,9 +2341,6 @@ static char *load_cached_name(struct btd_device *device, const char *local,
 			str[HCI_MAX_NAME_LENGTH] = '\0';
 	}
 
-failed:
-	g_key_file_free(key_file);
-
 	return str;
 }
 
@@ -2421,8 +2494,7 @@ static void load_att_info(struct btd_device *device, const char *local,
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s/attributes", local,
 			peer);
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 	groups = g_key_file_get_groups(key_file, NULL);
 
 	for (handle = groups; *handle; handle++) {
@@ -2487,7 +2559,6 @@ static void load_att_info(struct btd_device *device, const char *local,
 	}
 
 	g_strfreev(groups);
-	g_key_file_free(key_file);
 	free(prim_uuid);
 }
 
@@ -2951,14 +3022,10 @@ void btd_device_device_set_name(struct btd_device *device, const char *name)
 
 	store_device_info(device);
 
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-						DEVICE_INTERFACE, "Name");
-
 	if (device->alias != NULL)
-		return;
-
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-						DEVICE_INTERFACE, "Alias");
+		emit_property_changed(device, PROP_NAME);
+	else
+		emit_property_changed(device, PROP_NAME | PROP_ALIAS);
 }
 
 void device_get_name(struct btd_device *device, char *name, size_t len)
@@ -2985,10 +3052,7 @@ void device_set_class(struct btd_device *device, uint32_t class)
 
 	store_device_info(device);
 
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-						DEVICE_INTERFACE, "Class");
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-						DEVICE_INTERFACE, "Icon");
+	emit_property_changed(device, PROP_CLASS | PROP_ICON);
 }
 
 void device_update_addr(struct btd_device *device, const bdaddr_t *bdaddr,
@@ -3137,8 +3201,6 @@ static void device_remove_stored(struct btd_device *device)
 	char device_addr[18];
 	char filename[PATH_MAX];
 	GKeyFile *key_file;
-	char *data;
-	gsize length = 0;
 
 	if (device->bredr_state.bonded) {
 		device->bredr_state.bonded = false;
@@ -3163,23 +3225,15 @@ static void device_remove_stored(struct btd_device *device)
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/%s", adapter_addr,
 			device_addr);
+	storage_keyfile_remove(filename);
 	delete_folder_tree(filename);
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", adapter_addr,
 			device_addr);
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
-	g_key_file_remove_group(key_file, "ServiceRecords", NULL);
-
-	data = g_key_file_to_data(key_file, &length, NULL);
-	if (length > 0) {
-		create_file(filename, S_IRUSR | S_IWUSR);
-		g_file_set_contents(filename, data, length, NULL);
-	}
-
-	g_free(data);
-	g_key_file_free(key_file);
+	key_file = storage_keyfile_get(filename);
+	if (g_key_file_remove_group(key_file, "ServiceRecords", NULL))
+		storage_keyfile_put(filename);
 }
 
 void device_remove(struct btd_device *device, gboolean remove_stored)
@@ -3523,8 +3577,6 @@ static void update_bredr_services(struct browse_req *req, sdp_list_t *recs)
 	char att_file[PATH_MAX];
 	GKeyFile *sdp_key_file = NULL;
 	GKeyFile *att_key_file = NULL;
-	char *data;
-	gsize length = 0;
 
 	ba2str(btd_adapter_get_address(device->adapter), srcaddr);
 	ba2str(&device->bdaddr, dstaddr);
@@ -3533,14 +3585,12 @@ static void update_bredr_services(struct browse_req *req, sdp_list_t *recs)
 		snprintf(sdp_file, PATH_MAX, STORAGEDIR "/%s/cache/%s",
 							srcaddr, dstaddr);
 
-		sdp_key_file = g_key_file_new();
-		g_key_file_load_from_file(sdp_key_file, sdp_file, 0, NULL);
+		sdp_key_file = storage_keyfile_get(sdp_file);
 
 		snprintf(att_file, PATH_MAX, STORAGEDIR "/%s/%s/attributes",
 							srcaddr, dstaddr);
 
-		att_key_file = g_key_file_new();
-		g_key_file_load_from_file(att_key_file, att_file, 0, NULL);
+		att_key_file = storage_keyfile_get(att_file);
 	}
 
 	for (seq = recs; seq; seq = seq->next) {
@@ -3602,27 +3652,11 @@ next:
 		sdp_list_free(svcclass, free);
 	}
 
-	if (sdp_key_file) {
-		data = g_key_file_to_data(sdp_key_file, &length, NULL);
-		if (length > 0) {
-			create_file(sdp_file, S_IRUSR | S_IWUSR);
-			g_file_set_contents(sdp_file, data, length, NULL);
-		}
-
-		g_free(data);
-		g_key_file_free(sdp_key_file);
-	}
-
-	if (att_key_file) {
-		data = g_key_file_to_data(att_key_file, &length, NULL);
-		if (length > 0) {
-			create_file(att_file, S_IRUSR | S_IWUSR);
-			g_file_set_contents(att_file, data, length, NULL);
-		}
+	if (sdp_key_file)
+		storage_keyfile_put(sdp_file);
 
-		g_free(data);
-		g_key_file_free(att_key_file);
-	}
+	if (att_key_file)
+		storage_keyfile_put(att_file);
 }
 
 static int primary_cmp(gconstpointer a, gconstpointer b)
@@ -4395,8 +4429,7 @@ void device_set_legacy(struct btd_device *device, bool legacy)
 
 	device->legacy = legacy;
 
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-					DEVICE_INTERFACE, "LegacyPairing");
+	emit_property_changed(device, PROP_LEGACY_PAIRING);
 }
 
 void device_set_rssi(struct btd_device *device, int8_t rssi)
@@ -4428,8 +4461,7 @@ void device_set_rssi(struct btd_device *device, int8_t rssi)
 		device->rssi = rssi;
 	}
 
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-						DEVICE_INTERFACE, "RSSI");
+	emit_property_changed(device, PROP_RSSI);
 }
 
 static gboolean start_discovery(gpointer user_data)
@@ -5108,8 +5140,7 @@ static sdp_list_t *read_device_records(struct btd_device *device)
 
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	key_file = storage_keyfile_get(filename);
 	keys = g_key_file_get_keys(key_file, "ServiceRecords", NULL, NULL);
 
 	for (handle = keys; handle && *handle; handle++) {
@@ -5124,7 +5155,6 @@ static sdp_list_t *read_device_records(struct btd_device *device)
 	}
 
 	g_strfreev(keys);
-	g_key_file_free(key_file);
 
 	return recs;
 }
@@ -5191,12 +5221,10 @@ void device_set_appearance(struct btd_device *device, uint16_t value)
 	if (device->appearance == value)
 		return;
 
-	g_dbus_emit_property_changed(dbus_conn, device->path,
-					DEVICE_INTERFACE, "Appearance");
-
 	if (icon)
-		g_dbus_emit_property_changed(dbus_conn, device->path,
-						DEVICE_INTERFACE, "Icon");
+		emit_property_changed(device, PROP_APPEARANCE | PROP_ICON);
+	else
+		emit_property_changed(device, PROP_APPEARANCE);
 
 	device->appearance = value;
 	store_device_info(device);
@@ -31,12 +31,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <glib.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/sdp.h>
 
+#include "lib/uuid.h"
 #include "src/shared/util.h"
 #include "uuid-helper.h"
 #include "eir.h"
@@ -268,6 +270,212 @@ void eir_parse(struct eir_data *eir, const uint8_t *eir_data, uint8_t eir_len)
 	}
 }
 
+static void view_add_field(struct eir_view *view, uint8_t type,
+					const uint8_t *data, uint8_t len)
+{
+	struct eir_field *field = &view->fields[view->num_fields++];
+
+	field->type = type;
+	field->offset = data - view->data;
+	field->len = len;
+}
+
+void eir_parse_view(struct eir_view *view, const uint8_t *eir_data,
+							uint8_t eir_len)
+{
+	uint16_t len = 0;
+
+	/* The fields are only read up to num_fields */
+	memset(view, 0, offsetof(struct eir_view, fields));
+	view->data = eir_data;
+	view->tx_power = 127;
+
+	/* No EIR data to parse */
+	if (eir_data == NULL)
+		return;
+
+	while (len < eir_len - 1) {
+		uint8_t field_len = eir_data[0];
+		const uint8_t *data;
+		uint8_t data_len;
+
+		/* Check for the end of EIR */
+		if (field_len == 0)
+			break;
+
+		len += field_len + 1;
+
+		/* Do not continue EIR Data parsing if got incorrect length */
+		if (len > eir_len)
+			break;
+
+		data = &eir_data[2];
+		data_len = field_len - 1;
+
+		switch (eir_data[1]) {
+		case EIR_UUID16_SOME:
+		case EIR_UUID16_ALL:
+		case EIR_UUID32_SOME:
+		case EIR_UUID32_ALL:
+		case EIR_UUID128_SOME:
+		case EIR_UUID128_ALL:
+			view_add_field(view, eir_data[1], data, data_len);
+			break;
+
+		case EIR_FLAGS:
+			if (data_len > 0)
+				view->flags = *data;
+			break;
+
+		case EIR_NAME_SHORT:
+		case EIR_NAME_COMPLETE:
+			/* Some vendors put a NUL byte terminator into
+			 * the name */
+			while (data_len > 0 && data[data_len - 1] == '\0')
+				data_len--;
+
+			view->name = data;
+			view->name_len = data_len;
+			view->name_complete = eir_data[1] == EIR_NAME_COMPLETE;
+			break;
+
+		case EIR_TX_POWER:
+			if (data_len < 1)
+				break;
+			view->tx_power = (int8_t) data[0];
+			break;
+
+		case EIR_CLASS_OF_DEV:
+			if (data_len < 3)
+				break;
+			view->class = data[0] | (data[1] << 8) |
+							(data[2] << 16);
+			break;
+
+		case EIR_GAP_APPEARANCE:
+			if (data_len < 2)
+				break;
+			view->appearance = get_le16(data);
+			break;
+
+		case EIR_SSP_HASH:
+			if (data_len < 16)
+				break;
+			view->hash = data;
+			break;
+
+		case EIR_SSP_RANDOMIZER:
+			if (data_len < 16)
+				break;
+			view->randomizer = data;
+			break;
+
+		case EIR_DEVICE_ID:
+			if (data_len < 8)
+				break;
+
+			view->did_source = data[0] | (data[1] << 8);
+			view->did_vendor = data[2] | (data[3] << 8);
+			view->did_product = data[4] | (data[5] << 8);
+			view->did_version = data[6] | (data[7] << 8);
+			break;
+
+		case EIR_MANUFACTURER_DATA:
+			if (data_len < 2 || data_len > 2 + EIR_MSD_MAX_LEN)
+				break;
+			view_add_field(view, eir_data[1], data, data_len);
+			break;
+		}
+
+		eir_data += field_len + 1;
+	}
+}
+
+bool eir_view_get_name(const struct eir_view *view, char *name, size_t size)
+{
+	size_t len;
+	size_t i;
+
+	if (!view->name || !size)
+		return false;
+
+	len = MIN(view->name_len, size - 1);
+	memcpy(name, view->name, len);
+	name[len] = '\0';
+
+	if (g_utf8_validate(name, len, NULL))
+		return true;
+
+	/* Assume ASCII, and replace all non-ASCII with spaces */
+	for (i = 0; name[i] != '\0'; i++) {
+		if (!isascii(name[i]))
+			name[i] = ' ';
+	}
+
+	/* Remove leading and trailing whitespace characters */
+	g_strstrip(name);
+
+	return true;
+}
+
+void eir_view_foreach_uuid(const struct eir_view *view, eir_uuid_func_t func,
+							void *user_data)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < view->num_fields; i++) {
+		const struct eir_field *field = &view->fields[i];
+		const uint8_t *data = view->data + field->offset;
+		uint8_t len = field->len;
+		bt_uuid_t uuid;
+		uint128_t u128;
+
+		switch (field->type) {
+		case EIR_UUID16_SOME:
+		case EIR_UUID16_ALL:
+			for (; len >= 2; len -= 2, data += 2) {
+				bt_uuid16_create(&uuid, get_le16(data));
+				func(&uuid, user_data);
+			}
+			break;
+
+		case EIR_UUID32_SOME:
+		case EIR_UUID32_ALL:
+			for (; len >= 4; len -= 4, data += 4) {
+				bt_uuid32_create(&uuid, get_le32(data));
+				func(&uuid, user_data);
+			}
+			break;
+
+		case EIR_UUID128_SOME:
+		case EIR_UUID128_ALL:
+			for (; len >= 16; len -= 16, data += 16) {
+				for (k = 0; k < 16; k++)
+					u128.data[k] = data[16 - k - 1];
+				bt_uuid128_create(&uuid, u128);
+				func(&uuid, user_data);
+			}
+			break;
+		}
+	}
+}
+
+void eir_view_foreach_msd(const struct eir_view *view, eir_msd_func_t func,
+							void *user_data)
+{
+	unsigned int i;
+
+	for (i = 0; i < view->num_fields; i++) {
+		const struct eir_field *field = &view->fields[i];
+		const uint8_t *data = view->data + field->offset;
+
+		if (field->type != EIR_MANUFACTURER_DATA)
+			continue;
+
+		func(get_le16(data), data + 2, field->len - 2, user_data);
+	}
+}
+
 int eir_parse_oob(struct eir_data *eir, uint8_t *eir_data, uint16_t eir_len)
 {
 
@@ -74,8 +74,55 @@ struct eir_data {
 	GSList *msd_list;
 };
 
+/*
+ * Each field takes at least its length and type bytes, so the at most
+ * 255 bytes a view is parsed from never hold more fields than this.
+ */
+#define EIR_VIEW_MAX_FIELDS         127
+
+struct eir_field {
+	uint8_t type;
+	uint8_t offset;			/* Of the field data in the buffer */
+	uint8_t len;
+};
+
+/*
+ * Parsed EIR/AD data that borrows from the buffer it was parsed from.
+ * Nothing is allocated, so the view must not outlive that buffer.
+ */
+struct eir_view {
+	const uint8_t *data;
+	unsigned int flags;
+	const uint8_t *name;
+	uint8_t name_len;
+	bool name_complete;
+	uint32_t class;
+	uint16_t appearance;
+	int8_t tx_power;
+	const uint8_t *hash;
+	const uint8_t *randomizer;
+	uint16_t did_vendor;
+	uint16_t did_product;
+	uint16_t did_version;
+	uint16_t did_source;
+	unsigned int num_fields;
+	/* UUID and manufacturer data fields, only num_fields are set */
+	struct eir_field fields[EIR_VIEW_MAX_FIELDS];
+};
+
+typedef void (*eir_uuid_func_t) (const bt_uuid_t *uuid, void *user_data);
+typedef void (*eir_msd_func_t) (uint16_t company, const uint8_t *data,
+					uint8_t data_len, void *user_data);
+
 void eir_data_free(struct eir_data *eir);
 void eir_parse(struct eir_data *eir, const uint8_t *eir_data, uint8_t eir_len);
+void eir_parse_view(struct eir_view *view, const uint8_t *eir_data,
+							uint8_t eir_len);
+bool eir_view_get_name(const struct eir_view *view, char *name, size_t size);
+void eir_view_foreach_uuid(const struct eir_view *view, eir_uuid_func_t func,
+							void *user_data);
+void eir_view_foreach_msd(const struct eir_view *view, eir_msd_func_t func,
+							void *user_data);
 int eir_parse_oob(struct eir_data *eir, uint8_t *eir_data, uint16_t eir_len);
 int eir_create_oob(const bdaddr_t *addr, const char *name, uint32_t cod,
 			const uint8_t *hash, const uint8_t *randomizer,
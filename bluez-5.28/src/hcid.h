@@ -38,6 +38,7 @@ struct main_opts {
 	gboolean	reverse_sdp;
 	gboolean	name_resolv;
 	gboolean	debug_keys;
+	uint32_t	prop_interval;	/* ms between device property signals */
 
 	uint16_t	did_source;
 	uint16_t	did_vendor;
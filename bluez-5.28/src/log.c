@@ -28,9 +28,12 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <glib.h>
 
+#include "src/shared/trace.h"
 #include "log.h"
 
 void info(const char *format, ...)
@@ -81,6 +84,7 @@ extern struct btd_debug_desc __start___debug[];
 extern struct btd_debug_desc __stop___debug[];
 
 static char **enabled = NULL;
+static char *trace_path = NULL;
 
 static gboolean is_enabled(struct btd_debug_desc *desc)
 {
@@ -136,8 +140,40 @@ void __btd_log_init(const char *debug, int detach)
 	syslog(LOG_INFO, "Bluetooth daemon %s", VERSION);
 }
 
+void __btd_trace_init(const char *path)
+{
+	g_free(trace_path);
+	trace_path = g_strdup(path);
+
+	trace_enable(trace_path != NULL);
+}
+
+void __btd_trace_dump(void)
+{
+	int fd;
+
+	if (trace_path == NULL)
+		return;
+
+	fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		error("Unable to open trace file %s", trace_path);
+		return;
+	}
+
+	if (!trace_dump(fd))
+		error("Unable to write trace file %s", trace_path);
+
+	close(fd);
+}
+
 void __btd_log_cleanup(void)
 {
+	__btd_trace_dump();
+
+	g_free(trace_path);
+	trace_path = NULL;
+
 	closelog();
 
 	g_strfreev(enabled);
@@ -31,6 +31,9 @@ void __btd_log_init(const char *debug, int detach);
 void __btd_log_cleanup(void);
 void __btd_toggle_debug(void);
 
+void __btd_trace_init(const char *path);
+void __btd_trace_dump(void);
+
 struct btd_debug_desc {
 	const char *file;
 #define BTD_DEBUG_FLAG_DEFAULT (0)
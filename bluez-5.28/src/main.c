@@ -57,11 +57,14 @@
 #include "profile.h"
 #include "gatt.h"
 #include "systemd.h"
+#include "storage.h"
+#include "src/shared/crypto.h"
 
 #define BLUEZ_NAME "org.bluez"
 
 #define DEFAULT_PAIRABLE_TIMEOUT       0 /* disabled */
 #define DEFAULT_DISCOVERABLE_TIMEOUT 180 /* 3 minutes */
+#define DEFAULT_PROPERTY_INTERVAL      0 /* disabled */
 
 #define SHUTDOWN_GRACE_SECONDS 10
 
@@ -80,6 +83,8 @@ static const char * const supported_options[] = {
 	"NameResolving",
 	"DebugKeys",
 	"ControllerMode",
+	"DevicePropertyInterval",
+	"CryptoBackend",
 };
 
 GKeyFile *btd_get_main_conf(void)
@@ -202,6 +207,18 @@ static int get_mode(const char *str)
 	return BT_MODE_DUAL;
 }
 
+static enum bt_crypto_backend get_crypto_backend(const char *str)
+{
+	if (strcmp(str, "internal") == 0)
+		return BT_CRYPTO_BACKEND_INTERNAL;
+	else if (strcmp(str, "af_alg") == 0)
+		return BT_CRYPTO_BACKEND_AF_ALG;
+
+	error("Unknown crypto backend \"%s\"", str);
+
+	return BT_CRYPTO_BACKEND_INTERNAL;
+}
+
 static void parse_config(GKeyFile *config)
 {
 	GError *err = NULL;
@@ -298,6 +315,16 @@ static void parse_config(GKeyFile *config)
 	else
 		main_opts.debug_keys = boolean;
 
+	val = g_key_file_get_integer(config, "General",
+						"DevicePropertyInterval", &err);
+	if (err) {
+		DBG("%s", err->message);
+		g_clear_error(&err);
+	} else if (val >= 0) {
+		DBG("prop_interval=%d", val);
+		main_opts.prop_interval = val;
+	}
+
 	str = g_key_file_get_string(config, "General", "ControllerMode", &err);
 	if (err) {
 		g_clear_error(&err);
@@ -306,6 +333,15 @@ static void parse_config(GKeyFile *config)
 		main_opts.mode = get_mode(str);
 		g_free(str);
 	}
+
+	str = g_key_file_get_string(config, "General", "CryptoBackend", &err);
+	if (err) {
+		g_clear_error(&err);
+	} else {
+		DBG("CryptoBackend=%s", str);
+		bt_crypto_set_default_backend(get_crypto_backend(str));
+		g_free(str);
+	}
 }
 
 static void init_defaults(void)
@@ -321,6 +357,7 @@ static void init_defaults(void)
 	main_opts.reverse_sdp = TRUE;
 	main_opts.name_resolv = TRUE;
 	main_opts.debug_keys = FALSE;
+	main_opts.prop_interval = DEFAULT_PROPERTY_INTERVAL;
 
 	if (sscanf(VERSION, "%hhu.%hhu", &major, &minor) != 2)
 		return;
@@ -642,6 +679,8 @@ int main(int argc, char *argv[])
 
 	adapter_cleanup();
 
+	storage_cleanup();
+
 	gatt_cleanup();
 
 	rfkill_exit();
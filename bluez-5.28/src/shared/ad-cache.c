@@ -0,0 +1,267 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/shared/util.h"
+#include "src/shared/ad-cache.h"
+
+/*
+ * Open addressing table of the last advertising payload seen from every
+ * address. Entries are looked up by address and type; the payload is only
+ * represented by its 64-bit hash. Probing is bounded, a full probe window
+ * evicts its least recently seen entry, so the table never grows and a
+ * lookup touches at most AD_CACHE_PROBE consecutive entries.
+ */
+#define AD_CACHE_PROBE		8
+
+struct ad_cache_entry {
+	uint64_t hash;
+	uint32_t last_seen;
+	uint8_t bdaddr[6];
+	uint8_t bdaddr_type;
+	int8_t rssi;
+	uint8_t verdict;
+	bool valid;
+} __attribute__ ((aligned(8)));
+
+struct ad_cache {
+	struct ad_cache_entry *entries;
+	unsigned int mask;
+	uint32_t clock;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static inline uint64_t mix64(uint64_t val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdull;
+	val ^= val >> 33;
+	val *= 0xc4ceb9fe1a85ec53ull;
+	val ^= val >> 33;
+
+	return val;
+}
+
+uint64_t ad_cache_hash(const uint8_t *data, size_t len)
+{
+	uint64_t hash = len * 0x9e3779b97f4a7c15ull;
+	uint64_t tail = 0;
+	size_t i;
+
+	for (; len >= 8; data += 8, len -= 8)
+		hash = mix64(hash ^ get_le64(data));
+
+	for (i = 0; i < len; i++)
+		tail |= (uint64_t) data[i] << (i * 8);
+
+	return mix64(hash ^ tail ^ ((uint64_t) len << 56));
+}
+
+static unsigned int addr_slot(struct ad_cache *cache, const uint8_t *bdaddr,
+							uint8_t bdaddr_type)
+{
+	uint64_t key = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		key |= (uint64_t) bdaddr[i] << (i * 8);
+
+	key |= (uint64_t) bdaddr_type << 48;
+
+	return mix64(key) & cache->mask;
+}
+
+static bool entry_match(const struct ad_cache_entry *entry,
+				const uint8_t *bdaddr, uint8_t bdaddr_type)
+{
+	return entry->valid && entry->bdaddr_type == bdaddr_type &&
+				!memcmp(entry->bdaddr, bdaddr, 6);
+}
+
+struct ad_cache *ad_cache_new(unsigned int size)
+{
+	struct ad_cache *cache;
+	unsigned int real_size = AD_CACHE_PROBE;
+
+	while (real_size < size)
+		real_size <<= 1;
+
+	cache = new0(struct ad_cache, 1);
+	if (!cache)
+		return NULL;
+
+	cache->entries = new0(struct ad_cache_entry, real_size);
+	if (!cache->entries) {
+		free(cache);
+		return NULL;
+	}
+
+	cache->mask = real_size - 1;
+
+	return cache;
+}
+
+void ad_cache_free(struct ad_cache *cache)
+{
+	if (!cache)
+		return;
+
+	free(cache->entries);
+	free(cache);
+}
+
+/*
+ * Checks the payload against the one last stored for an address. Returns
+ * true when it is unchanged, in which case RSSI and last seen have been
+ * refreshed, verdict (if given) is what was stored with the payload and
+ * the caller can skip parsing it again.
+ */
+bool ad_cache_lookup(struct ad_cache *cache, const uint8_t *bdaddr,
+				uint8_t bdaddr_type, const uint8_t *data,
+				size_t len, int8_t rssi, uint8_t *verdict)
+{
+	struct ad_cache_entry *entry;
+	unsigned int slot, i;
+
+	if (!cache)
+		return false;
+
+	slot = addr_slot(cache, bdaddr, bdaddr_type);
+	cache->clock++;
+
+	for (i = 0; i < AD_CACHE_PROBE; i++) {
+		entry = &cache->entries[(slot + i) & cache->mask];
+
+		if (!entry_match(entry, bdaddr, bdaddr_type))
+			continue;
+
+		if (entry->hash != ad_cache_hash(data, len))
+			break;
+
+		entry->last_seen = cache->clock;
+		entry->rssi = rssi;
+		cache->hits++;
+
+		if (verdict)
+			*verdict = entry->verdict;
+
+		return true;
+	}
+
+	cache->misses++;
+
+	return false;
+}
+
+/*
+ * Records the payload last seen from an address. Only call this once
+ * everything derived from the payload has been applied, a later lookup
+ * of the same payload tells the caller it can skip it. The verdict is
+ * whatever the caller concluded from the payload, the cache only keeps it.
+ */
+void ad_cache_store(struct ad_cache *cache, const uint8_t *bdaddr,
+				uint8_t bdaddr_type, const uint8_t *data,
+				size_t len, int8_t rssi, uint8_t verdict)
+{
+	struct ad_cache_entry *entry, *victim = NULL;
+	unsigned int slot, i;
+
+	if (!cache)
+		return;
+
+	slot = addr_slot(cache, bdaddr, bdaddr_type);
+
+	for (i = 0; i < AD_CACHE_PROBE; i++) {
+		entry = &cache->entries[(slot + i) & cache->mask];
+
+		if (entry_match(entry, bdaddr, bdaddr_type)) {
+			victim = entry;
+			break;
+		}
+
+		if (!entry->valid) {
+			if (!victim || victim->valid)
+				victim = entry;
+			continue;
+		}
+
+		if (!victim || (victim->valid &&
+				cache->clock - entry->last_seen >
+				cache->clock - victim->last_seen))
+			victim = entry;
+	}
+
+	memcpy(victim->bdaddr, bdaddr, 6);
+	victim->bdaddr_type = bdaddr_type;
+	victim->hash = ad_cache_hash(data, len);
+	victim->rssi = rssi;
+	victim->verdict = verdict;
+	victim->last_seen = cache->clock;
+	victim->valid = true;
+}
+
+void ad_cache_remove(struct ad_cache *cache, const uint8_t *bdaddr,
+							uint8_t bdaddr_type)
+{
+	struct ad_cache_entry *entry;
+	unsigned int slot, i;
+
+	if (!cache)
+		return;
+
+	slot = addr_slot(cache, bdaddr, bdaddr_type);
+
+	for (i = 0; i < AD_CACHE_PROBE; i++) {
+		entry = &cache->entries[(slot + i) & cache->mask];
+
+		if (entry_match(entry, bdaddr, bdaddr_type)) {
+			entry->valid = false;
+			return;
+		}
+	}
+}
+
+void ad_cache_clear(struct ad_cache *cache)
+{
+	if (!cache)
+		return;
+
+	memset(cache->entries, 0, (cache->mask + 1) * sizeof(*cache->entries));
+}
+
+void ad_cache_get_stats(struct ad_cache *cache, uint64_t *hits,
+							uint64_t *misses)
+{
+	if (hits)
+		*hits = cache ? cache->hits : 0;
+
+	if (misses)
+		*misses = cache ? cache->misses : 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ad_cache;
+
+struct ad_cache *ad_cache_new(unsigned int size);
+void ad_cache_free(struct ad_cache *cache);
+
+uint64_t ad_cache_hash(const uint8_t *data, size_t len);
+
+bool ad_cache_lookup(struct ad_cache *cache, const uint8_t *bdaddr,
+				uint8_t bdaddr_type, const uint8_t *data,
+				size_t len, int8_t rssi, uint8_t *verdict);
+void ad_cache_store(struct ad_cache *cache, const uint8_t *bdaddr,
+				uint8_t bdaddr_type, const uint8_t *data,
+				size_t len, int8_t rssi, uint8_t verdict);
+void ad_cache_remove(struct ad_cache *cache, const uint8_t *bdaddr,
+							uint8_t bdaddr_type);
+void ad_cache_clear(struct ad_cache *cache);
+
+void ad_cache_get_stats(struct ad_cache *cache, uint64_t *hits,
+							uint64_t *misses);
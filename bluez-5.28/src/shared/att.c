@@ -33,6 +33,8 @@
 #include "src/shared/queue.h"
 #include "src/shared/util.h"
 #include "src/shared/timeout.h"
+#include "src/shared/trace.h"
+#include "src/shared/metrics.h"
 #include "lib/uuid.h"
 #include "src/shared/att.h"
 
@@ -53,6 +55,41 @@
 
 struct att_send_op;
 
+enum {
+	ATT_METRIC_PDUS_SENT,
+	ATT_METRIC_PDUS_RECEIVED,
+	ATT_METRIC_BYTES_SENT,
+	ATT_METRIC_BYTES_RECEIVED,
+	ATT_METRIC_TIMEOUTS,
+	ATT_METRIC_NOTIFICATIONS,
+	ATT_METRIC_QUEUE_DEPTH,
+};
+
+static const char * const att_queue_names[] = {
+	"request", "indication", "write"
+};
+
+static const struct metrics_desc att_metrics_desc[] = {
+	{ "pdus_sent_total", "ATT PDUs sent", METRICS_COUNTER,
+							"opcode", 256 },
+	{ "pdus_received_total", "ATT PDUs received", METRICS_COUNTER,
+							"opcode", 256 },
+	{ "bytes_sent_total", "ATT bytes sent", METRICS_COUNTER },
+	{ "bytes_received_total", "ATT bytes received", METRICS_COUNTER },
+	{ "request_timeouts_total", "ATT transactions timed out",
+							METRICS_COUNTER },
+	{ "notifications_total", "Notifications and indications received",
+							METRICS_COUNTER },
+	{ "queue_depth", "ATT PDUs waiting to be sent", METRICS_GAUGE,
+					"queue", 3, att_queue_names },
+};
+
+static const struct metrics_family att_metrics = {
+	.subsystem = "att",
+	.desc = att_metrics_desc,
+	.num_desc = sizeof(att_metrics_desc) / sizeof(att_metrics_desc[0]),
+};
+
 struct bt_att {
 	int ref_count;
 	int fd;
@@ -83,6 +120,8 @@ struct bt_att {
 	bt_att_debug_func_t debug_callback;
 	bt_att_destroy_func_t debug_destroy;
 	void *debug_data;
+
+	struct metrics *metrics;
 };
 
 enum att_op_type {
@@ -330,6 +369,16 @@ static struct att_send_op *create_att_send_op(uint8_t opcode, const void *pdu,
 	return op;
 }
 
+static void update_queue_depth(struct bt_att *att)
+{
+	metrics_set(att->metrics, ATT_METRIC_QUEUE_DEPTH, 0,
+					queue_length(att->req_queue));
+	metrics_set(att->metrics, ATT_METRIC_QUEUE_DEPTH, 1,
+					queue_length(att->ind_queue));
+	metrics_set(att->metrics, ATT_METRIC_QUEUE_DEPTH, 2,
+					queue_length(att->write_queue));
+}
+
 static struct att_send_op *pick_next_send_op(struct bt_att *att)
 {
 	struct att_send_op *op;
@@ -385,6 +434,8 @@ static bool timeout_cb(void *user_data)
 	util_debug(att->debug_callback, att->debug_data,
 				"Operation timed out: 0x%02x", op->opcode);
 
+	metrics_inc(att->metrics, ATT_METRIC_TIMEOUTS);
+
 	if (att->timeout_callback)
 		att->timeout_callback(op->id, op->opcode, att->timeout_data);
 
@@ -435,6 +486,12 @@ static bool can_write_data(struct io *io, void *user_data)
 		return true;
 	}
 
+	trace_point(TRACE_ATT_SEND, op->opcode, ret, att->fd);
+
+	metrics_add(att->metrics, ATT_METRIC_PDUS_SENT, op->opcode, 1);
+	metrics_add(att->metrics, ATT_METRIC_BYTES_SENT, 0, ret);
+	update_queue_depth(att);
+
 	util_debug(att->debug_callback, att->debug_data,
 					"ATT op 0x%02x", op->opcode);
 
@@ -685,6 +742,10 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	memset(&data, 0, sizeof(data));
 	data.opcode = opcode;
 
+	if (opcode == BT_ATT_OP_HANDLE_VAL_NOT ||
+					opcode == BT_ATT_OP_HANDLE_VAL_IND)
+		metrics_inc(att->metrics, ATT_METRIC_NOTIFICATIONS);
+
 	if (pdu_len > 0) {
 		data.pdu = pdu;
 		data.pdu_len = pdu_len;
@@ -713,6 +774,14 @@ static bool can_read_data(struct io *io, void *user_data)
 	if (bytes_read < 0)
 		return false;
 
+	trace_point(TRACE_ATT_RECV, bytes_read ? att->buf[0] : 0, bytes_read,
+								att->fd);
+
+	metrics_add(att->metrics, ATT_METRIC_BYTES_RECEIVED, 0, bytes_read);
+	if (bytes_read)
+		metrics_add(att->metrics, ATT_METRIC_PDUS_RECEIVED,
+							att->buf[0], 1);
+
 	util_hexdump('>', att->buf, bytes_read,
 					att->debug_callback, att->debug_data);
 
@@ -796,6 +865,8 @@ static void bt_att_free(struct bt_att *att)
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
+	metrics_free(att->metrics);
+
 	free(att->buf);
 
 	free(att);
@@ -849,6 +920,9 @@ struct bt_att *bt_att_new(int fd)
 	if (!io_set_disconnect_handler(att->io, disconnect_cb, att, NULL))
 		goto fail;
 
+	/* Counters are optional, an object without them just skips them */
+	att->metrics = metrics_new(&att_metrics);
+
 	return bt_att_ref(att);
 
 fail:
@@ -905,6 +979,15 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 	return true;
 }
 
+bool bt_att_is_connected(struct bt_att *att)
+{
+	if (!att)
+		return false;
+
+	/* The io is dropped before queued operations are cancelled */
+	return att->io != NULL;
+}
+
 uint16_t bt_att_get_mtu(struct bt_att *att)
 {
 	if (!att)
@@ -1044,6 +1127,7 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 		return 0;
 	}
 
+	update_queue_depth(att);
 	wakeup_writer(att);
 
 	return op->id;
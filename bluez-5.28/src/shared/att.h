@@ -48,6 +48,8 @@ typedef void (*bt_att_disconnect_func_t)(int err, void *user_data);
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy);
 
+bool bt_att_is_connected(struct bt_att *att);
+
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 
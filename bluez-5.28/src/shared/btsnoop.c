@@ -29,9 +29,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <linux/falloc.h>
 
 #include "src/shared/btsnoop.h"
 
@@ -64,6 +73,76 @@ struct pklg_pkt {
 } __attribute__ ((packed));
 #define PKLG_PKT_SIZE (sizeof(struct pklg_pkt))
 
+/*
+ * Single producer, single consumer byte ring used by the buffered writer.
+ * Only whole packet records are published, so every range between tail and
+ * head can be handed to writev() as is.
+ */
+struct btsnoop_buffer {
+	uint8_t *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	uint32_t drops;
+	int event_fd;
+	bool waiting;
+	bool running;
+	bool threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+};
+
+#define BTSNOOP_BUFFER_MIN_SIZE	(64 * 1024)
+
+/*
+ * The writer thread is only woken up once the ring is half full, anything
+ * less is written out after at most BTSNOOP_BUFFER_FLUSH milliseconds.
+ */
+#define BTSNOOP_BUFFER_FLUSH	100
+
+/*
+ * Rotation state, owned by whoever drains the buffer. The next file is
+ * created and pre-allocated ahead of time so switching is just an fd swap.
+ */
+struct btsnoop_rotate {
+	char *path;
+	size_t max_size;
+	unsigned int max_time;
+	unsigned int max_files;
+	unsigned int seq;
+	size_t written;
+	bool full;
+	struct timespec start;
+	int next_fd;
+};
+
+/*
+ * Sparse index of a mapped capture, one entry every BTSNOOP_INDEX_STRIDE
+ * packets. Timestamps are kept in the raw on-disk representation.
+ */
+struct btsnoop_index {
+	uint64_t ts;
+	uint64_t offset;
+};
+
+#define BTSNOOP_INDEX_STRIDE	1024
+
+struct btsnoop_index_hdr {
+	uint8_t		id[8];
+	uint32_t	version;
+	uint32_t	stride;
+	uint64_t	file_size;
+	uint64_t	file_mtime;
+	uint64_t	count;
+} __attribute__ ((packed));
+
+#define BTSNOOP_INDEX_VERSION	2
+
+static const uint8_t btsnoop_index_id[] = { 0x62, 0x74, 0x73, 0x69,
+					    0x64, 0x78, 0x00, 0x00 };
+
+#define BTSNOOP_TS_OFFSET	0x00E03AB44A676000ll
+
 struct btsnoop {
 	int ref_count;
 	int fd;
@@ -72,6 +151,16 @@ struct btsnoop {
 	uint16_t index;
 	bool aborted;
 	bool pklg_format;
+	struct btsnoop_buffer *buffer;
+	struct btsnoop_rotate *rotate;
+	const uint8_t *map;
+	size_t map_size;
+	uint64_t map_mtime;
+	size_t map_offset;
+	struct btsnoop_index *idx;
+	size_t idx_count;
+	uint32_t filter_opcodes;
+	int filter_handle;
 };
 
 struct btsnoop *btsnoop_open(const char *path, unsigned long flags)
@@ -119,6 +208,30 @@ struct btsnoop *btsnoop_open(const char *path, unsigned long flags)
 		lseek(btsnoop->fd, 0, SEEK_SET);
 	}
 
+	btsnoop->filter_handle = -1;
+
+	/* Only BTSnoop files are mapped, Packet Logger keeps using read() */
+	if ((btsnoop->flags & BTSNOOP_FLAG_MMAP) && !btsnoop->pklg_format) {
+		struct stat st;
+		void *map;
+
+		if (fstat(btsnoop->fd, &st) < 0)
+			goto failed;
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+							btsnoop->fd, 0);
+		if (map == MAP_FAILED)
+			goto failed;
+
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+		btsnoop->map = map;
+		btsnoop->map_size = st.st_size;
+		btsnoop->map_mtime = (uint64_t) st.st_mtim.tv_sec *
+					1000000000ull + st.st_mtim.tv_nsec;
+		btsnoop->map_offset = BTSNOOP_HDR_SIZE;
+	}
+
 	return btsnoop_ref(btsnoop);
 
 failed:
@@ -128,18 +241,39 @@ failed:
 	return NULL;
 }
 
-struct btsnoop *btsnoop_create(const char *path, uint32_t type)
+static int create_file(const char *path, uint32_t type)
 {
-	struct btsnoop *btsnoop;
 	struct btsnoop_hdr hdr;
 	ssize_t written;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0)
+		return -1;
+
+	memcpy(hdr.id, btsnoop_id, sizeof(btsnoop_id));
+	hdr.version = htobe32(btsnoop_version);
+	hdr.type = htobe32(type);
+
+	written = write(fd, &hdr, BTSNOOP_HDR_SIZE);
+	if (written < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct btsnoop *btsnoop_create(const char *path, uint32_t type)
+{
+	struct btsnoop *btsnoop;
 
 	btsnoop = calloc(1, sizeof(*btsnoop));
 	if (!btsnoop)
 		return NULL;
 
-	btsnoop->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
-					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	btsnoop->fd = create_file(path, type);
 	if (btsnoop->fd < 0) {
 		free(btsnoop);
 		return NULL;
@@ -148,18 +282,488 @@ struct btsnoop *btsnoop_create(const char *path, uint32_t type)
 	btsnoop->type = type;
 	btsnoop->index = 0xffff;
 
-	memcpy(hdr.id, btsnoop_id, sizeof(btsnoop_id));
-	hdr.version = htobe32(btsnoop_version);
-	hdr.type = htobe32(btsnoop->type);
+	return btsnoop_ref(btsnoop);
+}
 
-	written = write(btsnoop->fd, &hdr, BTSNOOP_HDR_SIZE);
-	if (written < 0) {
-		close(btsnoop->fd);
-		free(btsnoop);
+static inline size_t align_power2(size_t u)
+{
+	size_t size = 1;
+
+	while (size < u)
+		size <<= 1;
+
+	return size;
+}
+
+static int rotate_create(struct btsnoop *btsnoop, unsigned int seq)
+{
+	struct btsnoop_rotate *rotate = btsnoop->rotate;
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.%u", rotate->path, seq);
+
+	fd = create_file(path, btsnoop->type);
+	if (fd < 0)
+		return -1;
+
+	/* Best effort, not every file system supports it */
+	if (rotate->max_size)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, rotate->max_size);
+
+	return fd;
+}
+
+static void rotate_close(int fd)
+{
+	off_t offset;
+
+	/* Give back whatever the pre-allocation reserved past the data */
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset > 0 && ftruncate(fd, offset) < 0) {
+		close(fd);
+		return;
+	}
+
+	close(fd);
+}
+
+static void rotate_remove(struct btsnoop *btsnoop, unsigned int seq)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s.%u", btsnoop->rotate->path, seq);
+	unlink(path);
+}
+
+static bool rotate_due(struct btsnoop_rotate *rotate)
+{
+	struct timespec now;
+
+	if (rotate->full)
+		return true;
+
+	/* Do not keep producing empty files on an idle capture */
+	if (!rotate->max_time || rotate->written == BTSNOOP_HDR_SIZE)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec - rotate->start.tv_sec >= rotate->max_time;
+}
+
+/* Called with the buffer lock held, between whole batches of records */
+static void rotate_check(struct btsnoop *btsnoop)
+{
+	struct btsnoop_rotate *rotate = btsnoop->rotate;
+
+	if (!rotate_due(rotate))
+		return;
+
+	if (rotate->next_fd < 0) {
+		rotate->next_fd = rotate_create(btsnoop, rotate->seq + 1);
+		if (rotate->next_fd < 0)
+			return;
+	}
+
+	rotate_close(btsnoop->fd);
+
+	btsnoop->fd = rotate->next_fd;
+	rotate->seq++;
+	rotate->written = BTSNOOP_HDR_SIZE;
+	rotate->full = false;
+	clock_gettime(CLOCK_MONOTONIC, &rotate->start);
+
+	if (rotate->max_files && rotate->seq >= rotate->max_files)
+		rotate_remove(btsnoop, rotate->seq - rotate->max_files);
+
+	rotate->next_fd = rotate_create(btsnoop, rotate->seq + 1);
+}
+
+static void rotate_free(struct btsnoop *btsnoop)
+{
+	struct btsnoop_rotate *rotate = btsnoop->rotate;
+
+	if (!rotate)
+		return;
+
+	if (rotate->next_fd >= 0) {
+		close(rotate->next_fd);
+		rotate_remove(btsnoop, rotate->seq + 1);
+	}
+
+	if (btsnoop->fd >= 0) {
+		rotate_close(btsnoop->fd);
+		btsnoop->fd = -1;
+	}
+
+	free(rotate->path);
+	free(rotate);
+
+	btsnoop->rotate = NULL;
+}
+
+static void buffer_peek(struct btsnoop_buffer *buffer, size_t pos,
+						void *data, size_t len)
+{
+	size_t offset = pos & (buffer->size - 1);
+	size_t end = buffer->size - offset;
+
+	if (len <= end) {
+		memcpy(data, buffer->buf + offset, len);
+		return;
+	}
+
+	memcpy(data, buffer->buf + offset, end);
+	memcpy((uint8_t *) data + end, buffer->buf, len - end);
+}
+
+/*
+ * How much of the len bytes at tail still fit the current file, cut at a
+ * record boundary. An empty file takes at least one record, however large.
+ */
+static size_t rotate_fit(struct btsnoop *btsnoop, size_t tail, size_t len)
+{
+	struct btsnoop_rotate *rotate = btsnoop->rotate;
+	struct btsnoop_pkt pkt;
+	size_t fit = 0, rec;
+
+	if (!rotate->max_size || rotate->written + len <= rotate->max_size)
+		return len;
+
+	while (fit < len) {
+		buffer_peek(btsnoop->buffer, tail + fit, &pkt,
+							BTSNOOP_PKT_SIZE);
+		rec = BTSNOOP_PKT_SIZE + be32toh(pkt.len);
+
+		if (rotate->written + fit + rec > rotate->max_size &&
+				(fit || rotate->written > BTSNOOP_HDR_SIZE)) {
+			rotate->full = true;
+			break;
+		}
+
+		fit += rec;
+	}
+
+	return fit;
+}
+
+static size_t buffer_drain(struct btsnoop *btsnoop)
+{
+	struct btsnoop_buffer *buffer = btsnoop->buffer;
+	struct iovec iov[2];
+	size_t head, tail, len, offset;
+	ssize_t written;
+	int iovcnt;
+
+	pthread_mutex_lock(&buffer->lock);
+
+	tail = buffer->tail;
+	head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+	len = head - tail;
+	if (!len) {
+		if (btsnoop->rotate)
+			rotate_check(btsnoop);
+
+		pthread_mutex_unlock(&buffer->lock);
+		return 0;
+	}
+
+	if (btsnoop->rotate) {
+		len = rotate_fit(btsnoop, tail, len);
+
+		/* The current file is full, continue in the next one */
+		if (!len) {
+			rotate_check(btsnoop);
+			len = rotate_fit(btsnoop, tail, head - tail);
+		}
+
+		if (!len) {
+			pthread_mutex_unlock(&buffer->lock);
+			return 0;
+		}
+	}
+
+	offset = tail & (buffer->size - 1);
+
+	iov[0].iov_base = buffer->buf + offset;
+	iov[0].iov_len = buffer->size - offset;
+	if (iov[0].iov_len >= len) {
+		iov[0].iov_len = len;
+		iovcnt = 1;
+	} else {
+		iov[1].iov_base = buffer->buf;
+		iov[1].iov_len = len - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	while (iovcnt) {
+		written = writev(btsnoop->fd, iov, iovcnt);
+		if (written <= 0)
+			break;
+
+		/* Short write, skip what already went out */
+		while (iovcnt && (size_t) written >= iov[0].iov_len) {
+			written -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov[0].iov_base = (uint8_t *) iov[0].iov_base + written;
+			iov[0].iov_len -= written;
+		}
+	}
+
+	/*
+	 * On a write error the data is discarded anyway, a stalled capture
+	 * file must not end up stalling the producer.
+	 */
+	__atomic_store_n(&buffer->tail, tail + len, __ATOMIC_RELEASE);
+
+	if (btsnoop->rotate) {
+		btsnoop->rotate->written += len;
+		rotate_check(btsnoop);
+	}
+
+	pthread_mutex_unlock(&buffer->lock);
+
+	return len;
+}
+
+static void *buffer_thread(void *user_data)
+{
+	struct btsnoop *btsnoop = user_data;
+	struct btsnoop_buffer *buffer = btsnoop->buffer;
+	struct pollfd pfd;
+	uint64_t val;
+
+	pfd.fd = buffer->event_fd;
+	pfd.events = POLLIN;
+
+	/*
+	 * The timeout also runs time based rotation on an idle capture.
+	 * Draining on every packet would cost the producer a wakeup each.
+	 */
+	while (__atomic_load_n(&buffer->running, __ATOMIC_ACQUIRE)) {
+		buffer_drain(btsnoop);
+
+		__atomic_store_n(&buffer->waiting, true, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&buffer->head, __ATOMIC_SEQ_CST) -
+					buffer->tail < buffer->size / 2 &&
+				__atomic_load_n(&buffer->running,
+							__ATOMIC_SEQ_CST)) {
+			if (poll(&pfd, 1, BTSNOOP_BUFFER_FLUSH) > 0 &&
+					read(buffer->event_fd, &val,
+							sizeof(val)) < 0)
+				usleep(1000);
+		}
+
+		__atomic_store_n(&buffer->waiting, false, __ATOMIC_RELAXED);
+	}
+
+	buffer_drain(btsnoop);
+
+	return NULL;
+}
+
+static void buffer_wakeup(struct btsnoop_buffer *buffer)
+{
+	uint64_t val = 1;
+
+	if (write(buffer->event_fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+static void buffer_free(struct btsnoop *btsnoop)
+{
+	struct btsnoop_buffer *buffer = btsnoop->buffer;
+
+	if (!buffer)
+		return;
+
+	if (buffer->threaded) {
+		__atomic_store_n(&buffer->running, false, __ATOMIC_SEQ_CST);
+		buffer_wakeup(buffer);
+		pthread_join(buffer->thread, NULL);
+	}
+
+	buffer_drain(btsnoop);
+
+	close(buffer->event_fd);
+	pthread_mutex_destroy(&buffer->lock);
+	free(buffer->buf);
+	free(buffer);
+
+	btsnoop->buffer = NULL;
+}
+
+bool btsnoop_set_buffered(struct btsnoop *btsnoop, size_t size, bool thread)
+{
+	struct btsnoop_buffer *buffer;
+
+	if (!btsnoop || btsnoop->buffer)
+		return false;
+
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return false;
+
+	if (size < BTSNOOP_BUFFER_MIN_SIZE)
+		size = BTSNOOP_BUFFER_MIN_SIZE;
+
+	buffer->size = align_power2(size);
+
+	buffer->buf = malloc(buffer->size);
+	if (!buffer->buf)
+		goto failed;
+
+	buffer->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (buffer->event_fd < 0)
+		goto failed;
+
+	pthread_mutex_init(&buffer->lock, NULL);
+
+	btsnoop->buffer = buffer;
+
+	if (!thread)
+		return true;
+
+	buffer->threaded = true;
+	buffer->running = true;
+
+	if (pthread_create(&buffer->thread, NULL, buffer_thread, btsnoop)) {
+		buffer->threaded = false;
+		buffer_free(btsnoop);
+		return false;
+	}
+
+	return true;
+
+failed:
+	free(buffer->buf);
+	free(buffer);
+
+	return false;
+}
+
+struct btsnoop *btsnoop_create_rotating(const char *path, uint32_t type,
+					size_t max_size, unsigned int max_time,
+					unsigned int max_files)
+{
+	struct btsnoop *btsnoop;
+	struct btsnoop_rotate *rotate;
+
+	if (!path || (!max_size && !max_time))
 		return NULL;
+
+	btsnoop = calloc(1, sizeof(*btsnoop));
+	if (!btsnoop)
+		return NULL;
+
+	rotate = calloc(1, sizeof(*rotate));
+	if (!rotate)
+		goto failed;
+
+	rotate->path = strdup(path);
+	if (!rotate->path) {
+		free(rotate);
+		goto failed;
 	}
 
+	rotate->max_size = max_size;
+	rotate->max_time = max_time;
+	rotate->max_files = max_files;
+	rotate->written = BTSNOOP_HDR_SIZE;
+	rotate->next_fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &rotate->start);
+
+	btsnoop->type = type;
+	btsnoop->index = 0xffff;
+	btsnoop->rotate = rotate;
+
+	btsnoop->fd = rotate_create(btsnoop, 0);
+	if (btsnoop->fd < 0)
+		goto failed;
+
+	rotate->next_fd = rotate_create(btsnoop, 1);
+
+	/* Rotation happens on the writer thread, never on the packet path */
+	if (!btsnoop_set_buffered(btsnoop, 0, true))
+		goto failed;
+
 	return btsnoop_ref(btsnoop);
+
+failed:
+	rotate_free(btsnoop);
+	free(btsnoop);
+
+	return NULL;
+}
+
+bool btsnoop_flush(struct btsnoop *btsnoop)
+{
+	if (!btsnoop || !btsnoop->buffer)
+		return false;
+
+	while (buffer_drain(btsnoop));
+
+	return true;
+}
+
+uint32_t btsnoop_get_drops(struct btsnoop *btsnoop)
+{
+	if (!btsnoop || !btsnoop->buffer)
+		return 0;
+
+	return __atomic_load_n(&btsnoop->buffer->drops, __ATOMIC_RELAXED);
+}
+
+static void buffer_copy(struct btsnoop_buffer *buffer, size_t pos,
+					const void *data, size_t len)
+{
+	size_t offset = pos & (buffer->size - 1);
+	size_t end = buffer->size - offset;
+
+	if (len <= end) {
+		memcpy(buffer->buf + offset, data, len);
+		return;
+	}
+
+	memcpy(buffer->buf + offset, data, end);
+	memcpy(buffer->buf, (const uint8_t *) data + end, len - end);
+}
+
+static bool buffer_write(struct btsnoop *btsnoop, struct btsnoop_pkt *pkt,
+					const void *data, uint16_t size)
+{
+	struct btsnoop_buffer *buffer = btsnoop->buffer;
+	size_t head, tail, len = BTSNOOP_PKT_SIZE + size;
+
+	head = buffer->head;
+	tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+
+	if (buffer->size - (head - tail) < len) {
+		__atomic_fetch_add(&buffer->drops, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	pkt->drops = htobe32(__atomic_load_n(&buffer->drops,
+							__ATOMIC_RELAXED));
+
+	buffer_copy(buffer, head, pkt, BTSNOOP_PKT_SIZE);
+	if (data && size > 0)
+		buffer_copy(buffer, head + BTSNOOP_PKT_SIZE, data, size);
+
+	__atomic_store_n(&buffer->head, head + len, __ATOMIC_SEQ_CST);
+
+	/* Only pay for the wakeup when a sleeping writer has work to do */
+	if (head + len - tail >= buffer->size / 2 &&
+			__atomic_load_n(&buffer->waiting, __ATOMIC_SEQ_CST))
+		buffer_wakeup(buffer);
+
+	return true;
 }
 
 struct btsnoop *btsnoop_ref(struct btsnoop *btsnoop)
@@ -180,6 +784,14 @@ void btsnoop_unref(struct btsnoop *btsnoop)
 	if (__sync_sub_and_fetch(&btsnoop->ref_count, 1))
 		return;
 
+	buffer_free(btsnoop);
+	rotate_free(btsnoop);
+
+	if (btsnoop->map)
+		munmap((void *) btsnoop->map, btsnoop->map_size);
+
+	free(btsnoop->idx);
+
 	if (btsnoop->fd >= 0)
 		close(btsnoop->fd);
 
@@ -212,6 +824,9 @@ bool btsnoop_write(struct btsnoop *btsnoop, struct timeval *tv,
 	pkt.drops = htobe32(0);
 	pkt.ts    = htobe64(ts + 0x00E03AB44A676000ll);
 
+	if (btsnoop->buffer)
+		return buffer_write(btsnoop, &pkt, data, size);
+
 	written = write(btsnoop->fd, &pkt, BTSNOOP_PKT_SIZE);
 	if (written < 0)
 		return false;
@@ -405,6 +1020,16 @@ bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 	if (btsnoop->pklg_format)
 		return pklg_read_hci(btsnoop, tv, index, opcode, data, size);
 
+	if (btsnoop->map) {
+		const void *ptr;
+
+		if (!btsnoop_next_hci(btsnoop, tv, index, opcode, &ptr, size))
+			return false;
+
+		memcpy(data, ptr, *size);
+		return true;
+	}
+
 	len = read(btsnoop->fd, &pkt, BTSNOOP_PKT_SIZE);
 	if (len == 0)
 		return false;
@@ -465,6 +1090,365 @@ bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 	return true;
 }
 
+/*
+ * Decode the packet record at offset of a mapped capture. Returns the offset
+ * of the following record, or 0 if the record is truncated or invalid.
+ */
+static size_t map_parse(struct btsnoop *btsnoop, size_t offset,
+				uint64_t *ts, uint16_t *index, uint16_t *opcode,
+				const uint8_t **data, uint16_t *size)
+{
+	const struct btsnoop_pkt *pkt;
+	uint32_t len, flags;
+
+	if (btsnoop->map_size - offset < BTSNOOP_PKT_SIZE)
+		return 0;
+
+	pkt = (const void *) (btsnoop->map + offset);
+
+	len = be32toh(pkt->len);
+	if (len > BTSNOOP_MAX_PACKET_SIZE ||
+			btsnoop->map_size - offset - BTSNOOP_PKT_SIZE < len)
+		return 0;
+
+	flags = be32toh(pkt->flags);
+
+	*ts = be64toh(pkt->ts);
+	*data = pkt->data;
+	*size = len;
+
+	switch (btsnoop->type) {
+	case BTSNOOP_TYPE_HCI:
+		*index = 0;
+		*opcode = get_opcode_from_flags(0xff, flags);
+		break;
+
+	case BTSNOOP_TYPE_UART:
+		if (!len)
+			return 0;
+
+		*index = 0;
+		*opcode = get_opcode_from_flags(pkt->data[0], flags);
+		*data = pkt->data + 1;
+		*size = len - 1;
+		break;
+
+	case BTSNOOP_TYPE_MONITOR:
+		*index = flags >> 16;
+		*opcode = flags & 0xffff;
+		break;
+
+	default:
+		return 0;
+	}
+
+	return offset + BTSNOOP_PKT_SIZE + len;
+}
+
+static bool map_filter(struct btsnoop *btsnoop, uint16_t opcode,
+					const uint8_t *data, uint16_t size)
+{
+	if (btsnoop->filter_opcodes) {
+		if (opcode > 31 || !(btsnoop->filter_opcodes & (1U << opcode)))
+			return false;
+	}
+
+	if (btsnoop->filter_handle < 0)
+		return true;
+
+	/* Handle filtering only narrows down ACL and SCO traffic */
+	switch (opcode) {
+	case BTSNOOP_OPCODE_ACL_TX_PKT:
+	case BTSNOOP_OPCODE_ACL_RX_PKT:
+	case BTSNOOP_OPCODE_SCO_TX_PKT:
+	case BTSNOOP_OPCODE_SCO_RX_PKT:
+		if (size < 2)
+			return false;
+
+		return ((data[0] | (data[1] << 8)) & 0x0fff) ==
+						btsnoop->filter_handle;
+	}
+
+	return true;
+}
+
+bool btsnoop_next_hci(struct btsnoop *btsnoop, struct timeval *tv,
+					uint16_t *index, uint16_t *opcode,
+					const void **data, uint16_t *size)
+{
+	const uint8_t *ptr;
+	uint64_t ts;
+	size_t next;
+
+	if (!btsnoop || !btsnoop->map || btsnoop->aborted)
+		return false;
+
+	while (btsnoop->map_offset < btsnoop->map_size) {
+		next = map_parse(btsnoop, btsnoop->map_offset, &ts, index,
+							opcode, &ptr, size);
+		if (!next) {
+			btsnoop->aborted = true;
+			return false;
+		}
+
+		btsnoop->map_offset = next;
+
+		if (!map_filter(btsnoop, *opcode, ptr, *size))
+			continue;
+
+		ts -= BTSNOOP_TS_OFFSET;
+		tv->tv_sec = (ts / 1000000ll) + 946684800ll;
+		tv->tv_usec = ts % 1000000ll;
+		*data = ptr;
+
+		return true;
+	}
+
+	return false;
+}
+
+bool btsnoop_set_filter(struct btsnoop *btsnoop, uint32_t opcodes,
+								int handle)
+{
+	if (!btsnoop || !btsnoop->map)
+		return false;
+
+	btsnoop->filter_opcodes = opcodes;
+	btsnoop->filter_handle = handle < 0 ? -1 : (handle & 0x0fff);
+
+	return true;
+}
+
+static bool index_add(struct btsnoop *btsnoop, uint64_t ts, size_t offset)
+{
+	struct btsnoop_index *idx;
+	size_t count = btsnoop->idx_count;
+
+	/* Grow in powers of two */
+	if (!(count & (count - 1))) {
+		idx = realloc(btsnoop->idx, (count ? count * 2 : 1) *
+								sizeof(*idx));
+		if (!idx)
+			return false;
+
+		btsnoop->idx = idx;
+	}
+
+	btsnoop->idx[count].ts = ts;
+	btsnoop->idx[count].offset = offset;
+	btsnoop->idx_count++;
+
+	return true;
+}
+
+static bool index_build(struct btsnoop *btsnoop)
+{
+	size_t offset = BTSNOOP_HDR_SIZE, next;
+	const uint8_t *data;
+	uint16_t index, opcode, size;
+	uint64_t ts, count = 0;
+
+	free(btsnoop->idx);
+	btsnoop->idx = NULL;
+	btsnoop->idx_count = 0;
+
+	while (offset < btsnoop->map_size) {
+		next = map_parse(btsnoop, offset, &ts, &index, &opcode,
+							&data, &size);
+		if (!next)
+			break;
+
+		if (!(count++ % BTSNOOP_INDEX_STRIDE) &&
+					!index_add(btsnoop, ts, offset))
+			return false;
+
+		offset = next;
+	}
+
+	return true;
+}
+
+bool btsnoop_seek(struct btsnoop *btsnoop, const struct timeval *tv)
+{
+	const uint8_t *data;
+	uint16_t index, opcode, size;
+	uint64_t target, ts;
+	size_t lo, hi, mid, offset, next;
+
+	if (!btsnoop || !btsnoop->map || !tv)
+		return false;
+
+	if (!btsnoop->idx && !index_build(btsnoop))
+		return false;
+
+	target = (tv->tv_sec - 946684800ll) * 1000000ll + tv->tv_usec +
+							BTSNOOP_TS_OFFSET;
+
+	/* Last index entry not later than the target */
+	lo = 0;
+	hi = btsnoop->idx_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (btsnoop->idx[mid].ts <= target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	offset = lo ? btsnoop->idx[lo - 1].offset : BTSNOOP_HDR_SIZE;
+
+	/* At most one stride of headers to walk from there */
+	while (offset < btsnoop->map_size) {
+		next = map_parse(btsnoop, offset, &ts, &index, &opcode,
+							&data, &size);
+		if (!next || ts >= target)
+			break;
+
+		offset = next;
+	}
+
+	btsnoop->map_offset = offset;
+	btsnoop->aborted = false;
+
+	return true;
+}
+
+bool btsnoop_save_index(struct btsnoop *btsnoop, const char *path)
+{
+	struct btsnoop_index_hdr hdr;
+	ssize_t len;
+	size_t size;
+	int fd;
+
+	if (!btsnoop || !btsnoop->map)
+		return false;
+
+	if (!btsnoop->idx && !index_build(btsnoop))
+		return false;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0)
+		return false;
+
+	memcpy(hdr.id, btsnoop_index_id, sizeof(btsnoop_index_id));
+	hdr.version = htole32(BTSNOOP_INDEX_VERSION);
+	hdr.stride = htole32(BTSNOOP_INDEX_STRIDE);
+	hdr.file_size = htole64(btsnoop->map_size);
+	hdr.file_mtime = htole64(btsnoop->map_mtime);
+	hdr.count = htole64(btsnoop->idx_count);
+
+	len = write(fd, &hdr, sizeof(hdr));
+	if (len != sizeof(hdr))
+		goto failed;
+
+	/* Entries are stored in host order, the index is a local cache */
+	size = btsnoop->idx_count * sizeof(*btsnoop->idx);
+	len = write(fd, btsnoop->idx, size);
+	if (len < 0 || (size_t) len != size)
+		goto failed;
+
+	close(fd);
+
+	return true;
+
+failed:
+	close(fd);
+	unlink(path);
+
+	return false;
+}
+
+/*
+ * Check that every entry of a loaded index points at a packet record of
+ * the mapped capture carrying the recorded timestamp.
+ */
+static bool index_verify(struct btsnoop *btsnoop,
+				const struct btsnoop_index *idx, uint64_t count)
+{
+	const uint8_t *data;
+	uint16_t index, opcode, size;
+	uint64_t i, ts, last = 0;
+
+	for (i = 0; i < count; i++) {
+		if (idx[i].offset < BTSNOOP_HDR_SIZE ||
+					idx[i].offset >= btsnoop->map_size)
+			return false;
+
+		if (i && idx[i].offset <= last)
+			return false;
+
+		if (!map_parse(btsnoop, idx[i].offset, &ts, &index, &opcode,
+							&data, &size))
+			return false;
+
+		if (ts != idx[i].ts)
+			return false;
+
+		last = idx[i].offset;
+	}
+
+	return true;
+}
+
+bool btsnoop_load_index(struct btsnoop *btsnoop, const char *path)
+{
+	struct btsnoop_index_hdr hdr;
+	struct btsnoop_index *idx;
+	uint64_t count;
+	ssize_t len;
+	size_t size;
+	int fd;
+
+	if (!btsnoop || !btsnoop->map)
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	len = read(fd, &hdr, sizeof(hdr));
+	if (len != sizeof(hdr))
+		goto failed;
+
+	/* A stale index for a grown or replaced capture is useless */
+	if (memcmp(hdr.id, btsnoop_index_id, sizeof(btsnoop_index_id)) ||
+				le32toh(hdr.version) != BTSNOOP_INDEX_VERSION ||
+				le32toh(hdr.stride) != BTSNOOP_INDEX_STRIDE ||
+				le64toh(hdr.file_size) != btsnoop->map_size ||
+				le64toh(hdr.file_mtime) != btsnoop->map_mtime)
+		goto failed;
+
+	count = le64toh(hdr.count);
+	if (count > btsnoop->map_size / BTSNOOP_PKT_SIZE)
+		goto failed;
+
+	size = count * sizeof(*idx);
+	idx = malloc(size ? size : 1);
+	if (!idx)
+		goto failed;
+
+	len = read(fd, idx, size);
+	if (len < 0 || (size_t) len != size ||
+				!index_verify(btsnoop, idx, count)) {
+		free(idx);
+		goto failed;
+	}
+
+	close(fd);
+
+	free(btsnoop->idx);
+	btsnoop->idx = idx;
+	btsnoop->idx_count = count;
+
+	return true;
+
+failed:
+	close(fd);
+
+	return false;
+}
+
 bool btsnoop_read_phy(struct btsnoop *btsnoop, struct timeval *tv,
 			uint16_t *frequency, void *data, uint16_t *size)
 {
@@ -34,6 +34,7 @@
 #define BTSNOOP_TYPE_SIMULATOR		2002
 
 #define BTSNOOP_FLAG_PKLG_SUPPORT	(1 << 0)
+#define BTSNOOP_FLAG_MMAP		(1 << 1)
 
 #define BTSNOOP_OPCODE_NEW_INDEX	0
 #define BTSNOOP_OPCODE_DEL_INDEX	1
@@ -57,12 +58,19 @@ struct btsnoop;
 
 struct btsnoop *btsnoop_open(const char *path, unsigned long flags);
 struct btsnoop *btsnoop_create(const char *path, uint32_t type);
+struct btsnoop *btsnoop_create_rotating(const char *path, uint32_t type,
+					size_t max_size, unsigned int max_time,
+					unsigned int max_files);
 
 struct btsnoop *btsnoop_ref(struct btsnoop *btsnoop);
 void btsnoop_unref(struct btsnoop *btsnoop);
 
 uint32_t btsnoop_get_type(struct btsnoop *btsnoop);
 
+bool btsnoop_set_buffered(struct btsnoop *btsnoop, size_t size, bool thread);
+bool btsnoop_flush(struct btsnoop *btsnoop);
+uint32_t btsnoop_get_drops(struct btsnoop *btsnoop);
+
 bool btsnoop_write(struct btsnoop *btsnoop, struct timeval *tv,
 			uint32_t flags, const void *data, uint16_t size);
 bool btsnoop_write_hci(struct btsnoop *btsnoop, struct timeval *tv,
@@ -74,5 +82,13 @@ bool btsnoop_write_phy(struct btsnoop *btsnoop, struct timeval *tv,
 bool btsnoop_read_hci(struct btsnoop *btsnoop, struct timeval *tv,
 					uint16_t *index, uint16_t *opcode,
 					void *data, uint16_t *size);
+bool btsnoop_next_hci(struct btsnoop *btsnoop, struct timeval *tv,
+					uint16_t *index, uint16_t *opcode,
+					const void **data, uint16_t *size);
+bool btsnoop_set_filter(struct btsnoop *btsnoop, uint32_t opcodes,
+								int handle);
+bool btsnoop_seek(struct btsnoop *btsnoop, const struct timeval *tv);
+bool btsnoop_save_index(struct btsnoop *btsnoop, const char *path);
+bool btsnoop_load_index(struct btsnoop *btsnoop, const char *path);
 bool btsnoop_read_phy(struct btsnoop *btsnoop, struct timeval *tv,
 			uint16_t *frequency, void *data, uint16_t *size);
@@ -27,9 +27,20 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 
+/*
+ * The AES-NI code is built with a target attribute and only used when
+ * the CPU reports support at runtime, so no -maes is needed.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#define AESNI_TARGET	__attribute__((target("aes,sse2")))
+#endif
+
 #include "src/shared/util.h"
 #include "src/shared/crypto.h"
 
@@ -74,6 +85,7 @@ struct bt_crypto {
 	int ecb_aes;
 	int urandom;
 	int cmac_aes;
+	enum bt_crypto_backend backend;
 };
 
 static int urandom_setup(void)
@@ -131,6 +143,22 @@ static int cmac_aes_setup(void)
 	return fd;
 }
 
+static inline bool aes_hw(void)
+{
+#ifdef HAVE_AESNI
+	return __builtin_cpu_supports("aes");
+#else
+	return false;
+#endif
+}
+
+static enum bt_crypto_backend default_backend = BT_CRYPTO_BACKEND_INTERNAL;
+
+void bt_crypto_set_default_backend(enum bt_crypto_backend backend)
+{
+	default_backend = backend;
+}
+
 struct bt_crypto *bt_crypto_new(void)
 {
 	struct bt_crypto *crypto;
@@ -139,30 +167,55 @@ struct bt_crypto *bt_crypto_new(void)
 	if (!crypto)
 		return NULL;
 
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
-		free(crypto);
-		return NULL;
-	}
-
 	crypto->urandom = urandom_setup();
 	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
 
-	crypto->cmac_aes = cmac_aes_setup();
-	if (crypto->cmac_aes < 0) {
-		close(crypto->urandom);
-		close(crypto->ecb_aes);
-		free(crypto);
-		return NULL;
-	}
+	crypto->ecb_aes = -1;
+	crypto->cmac_aes = -1;
+	crypto->backend = BT_CRYPTO_BACKEND_INTERNAL;
+
+	/*
+	 * The AF_ALG sockets are only opened when the kernel backend is
+	 * asked for. Without kernel crypto support the in-process code
+	 * is used instead.
+	 */
+	if (default_backend != BT_CRYPTO_BACKEND_INTERNAL)
+		bt_crypto_set_backend(crypto, default_backend);
 
 	return bt_crypto_ref(crypto);
 }
 
+bool bt_crypto_set_backend(struct bt_crypto *crypto,
+					enum bt_crypto_backend backend)
+{
+	if (!crypto)
+		return false;
+
+	switch (backend) {
+	case BT_CRYPTO_BACKEND_INTERNAL:
+		break;
+	case BT_CRYPTO_BACKEND_AF_ALG:
+		if (crypto->ecb_aes < 0)
+			crypto->ecb_aes = ecb_aes_setup();
+
+		if (crypto->cmac_aes < 0)
+			crypto->cmac_aes = cmac_aes_setup();
+
+		if (crypto->ecb_aes < 0 || crypto->cmac_aes < 0)
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	crypto->backend = backend;
+
+	return true;
+}
+
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
 {
 	if (!crypto)
@@ -182,8 +235,12 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 		return;
 
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
+
+	if (crypto->ecb_aes >= 0)
+		close(crypto->ecb_aes);
+
+	if (crypto->cmac_aes >= 0)
+		close(crypto->cmac_aes);
 
 	free(crypto);
 }
@@ -259,12 +316,339 @@ static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 		dst[len - 1 - i] = src[i];
 }
 
+/*
+ * In-process AES-128 encryption (FIPS-197)
+ *
+ * Used where the per block round trip through AF_ALG dominates, like
+ * matching one resolvable private address against many IRKs. Keys and
+ * blocks use the FIPS-197 byte order, i.e. the same order as passed to
+ * the ecb(aes) socket.
+ *
+ * Keys are secret, so the portable code must not index memory with key
+ * dependent values: S-box lookups read the whole table and the GF(2^8)
+ * arithmetic has no branches. AES-NI is used instead when available.
+ */
+#define AES_ROUNDS	10
+#define AES_KEY_SCHED	(16 * (AES_ROUNDS + 1))
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline uint8_t aes_sub(uint8_t x)
+{
+	uint8_t val = 0;
+	unsigned int i;
+
+	for (i = 0; i < 256; i++) {
+		/* All ones if i equals x, zero otherwise */
+		uint8_t mask = ((i ^ x) - 1) >> 8;
+
+		val |= aes_sbox[i] & mask;
+	}
+
+	return val;
+}
+
+static inline uint8_t aes_xtime(uint8_t x)
+{
+	return (x << 1) ^ (0x1b & -(x >> 7));
+}
+
+static void aes_key_expand(const uint8_t key[16], uint8_t sched[AES_KEY_SCHED])
+{
+	uint8_t rcon = 0x01;
+	int i;
+
+	memcpy(sched, key, 16);
+
+	for (i = 16; i < AES_KEY_SCHED; i += 4) {
+		uint8_t t[4];
+
+		memcpy(t, &sched[i - 4], 4);
+
+		if (i % 16 == 0) {
+			uint8_t tmp = t[0];
+
+			t[0] = aes_sub(t[1]) ^ rcon;
+			t[1] = aes_sub(t[2]);
+			t[2] = aes_sub(t[3]);
+			t[3] = aes_sub(tmp);
+
+			rcon = aes_xtime(rcon);
+		}
+
+		sched[i + 0] = sched[i - 16] ^ t[0];
+		sched[i + 1] = sched[i - 15] ^ t[1];
+		sched[i + 2] = sched[i - 14] ^ t[2];
+		sched[i + 3] = sched[i - 13] ^ t[3];
+	}
+}
+
+#ifdef HAVE_AESNI
+static AESNI_TARGET void aes_encrypt_ni(const uint8_t sched[AES_KEY_SCHED],
+					const uint8_t in[16], uint8_t out[16])
+{
+	const __m128i *rk = (const __m128i *) sched;
+	__m128i b;
+	int i;
+
+	b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+						_mm_loadu_si128(&rk[0]));
+
+	for (i = 1; i < AES_ROUNDS; i++)
+		b = _mm_aesenc_si128(b, _mm_loadu_si128(&rk[i]));
+
+	b = _mm_aesenclast_si128(b, _mm_loadu_si128(&rk[AES_ROUNDS]));
+
+	_mm_storeu_si128((__m128i *) out, b);
+}
+
+/* Interleave four keys to keep the AES unit pipeline busy */
+static AESNI_TARGET void aes_encrypt_multi_ni(
+					const uint8_t (*sched)[AES_KEY_SCHED],
+					unsigned int count, const uint8_t in[16],
+					uint8_t (*out)[16])
+{
+	__m128i p = _mm_loadu_si128((const __m128i *) in);
+	unsigned int n;
+
+	for (n = 0; n + 4 <= count; n += 4) {
+		const __m128i *k0 = (const __m128i *) sched[n];
+		const __m128i *k1 = (const __m128i *) sched[n + 1];
+		const __m128i *k2 = (const __m128i *) sched[n + 2];
+		const __m128i *k3 = (const __m128i *) sched[n + 3];
+		__m128i b0, b1, b2, b3;
+		int i;
+
+		b0 = _mm_xor_si128(p, _mm_loadu_si128(&k0[0]));
+		b1 = _mm_xor_si128(p, _mm_loadu_si128(&k1[0]));
+		b2 = _mm_xor_si128(p, _mm_loadu_si128(&k2[0]));
+		b3 = _mm_xor_si128(p, _mm_loadu_si128(&k3[0]));
+
+		for (i = 1; i < AES_ROUNDS; i++) {
+			b0 = _mm_aesenc_si128(b0, _mm_loadu_si128(&k0[i]));
+			b1 = _mm_aesenc_si128(b1, _mm_loadu_si128(&k1[i]));
+			b2 = _mm_aesenc_si128(b2, _mm_loadu_si128(&k2[i]));
+			b3 = _mm_aesenc_si128(b3, _mm_loadu_si128(&k3[i]));
+		}
+
+		b0 = _mm_aesenclast_si128(b0, _mm_loadu_si128(&k0[i]));
+		b1 = _mm_aesenclast_si128(b1, _mm_loadu_si128(&k1[i]));
+		b2 = _mm_aesenclast_si128(b2, _mm_loadu_si128(&k2[i]));
+		b3 = _mm_aesenclast_si128(b3, _mm_loadu_si128(&k3[i]));
+
+		_mm_storeu_si128((__m128i *) out[n], b0);
+		_mm_storeu_si128((__m128i *) out[n + 1], b1);
+		_mm_storeu_si128((__m128i *) out[n + 2], b2);
+		_mm_storeu_si128((__m128i *) out[n + 3], b3);
+	}
+
+	for (; n < count; n++)
+		aes_encrypt_ni(sched[n], in, out[n]);
+}
+#endif
+
+static void aes_encrypt_sw(const uint8_t sched[AES_KEY_SCHED],
+				const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t s[16], t[16];
+	int round, c, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ sched[i];
+
+	for (round = 1; round <= AES_ROUNDS; round++) {
+		/* SubBytes and ShiftRows, the state is stored column-wise */
+		for (c = 0; c < 4; c++)
+			for (i = 0; i < 4; i++)
+				t[c * 4 + i] = aes_sub(s[((c + i) % 4) * 4 + i]);
+
+		/* MixColumns, skipped in the final round */
+		if (round < AES_ROUNDS) {
+			for (c = 0; c < 4; c++) {
+				uint8_t *col = &t[c * 4];
+				uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+				uint8_t first = col[0];
+
+				col[0] ^= all ^ aes_xtime(col[0] ^ col[1]);
+				col[1] ^= all ^ aes_xtime(col[1] ^ col[2]);
+				col[2] ^= all ^ aes_xtime(col[2] ^ col[3]);
+				col[3] ^= all ^ aes_xtime(col[3] ^ first);
+			}
+		}
+
+		for (i = 0; i < 16; i++)
+			s[i] = t[i] ^ sched[round * 16 + i];
+	}
+
+	memcpy(out, s, 16);
+}
+
+static void aes_encrypt(const uint8_t sched[AES_KEY_SCHED],
+				const uint8_t in[16], uint8_t out[16])
+{
+#ifdef HAVE_AESNI
+	if (aes_hw()) {
+		aes_encrypt_ni(sched, in, out);
+		return;
+	}
+#endif
+
+	aes_encrypt_sw(sched, in, out);
+}
+
+/* Encrypt the same block under several keys */
+static void aes_encrypt_multi(const uint8_t (*sched)[AES_KEY_SCHED],
+					unsigned int count, const uint8_t in[16],
+					uint8_t (*out)[16])
+{
+	unsigned int n;
+
+#ifdef HAVE_AESNI
+	if (aes_hw()) {
+		aes_encrypt_multi_ni(sched, count, in, out);
+		return;
+	}
+#endif
+
+	for (n = 0; n < count; n++)
+		aes_encrypt_sw(sched[n], in, out[n]);
+}
+
+/* Doubling in GF(2^128) used for the CMAC subkeys (RFC 4493) */
+static void cmac_subkey(const uint8_t in[16], uint8_t out[16])
+{
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+
+	/* Reduce without branching on the secret most significant bit */
+	out[15] = (in[15] << 1) ^ (0x87 & -(in[0] >> 7));
+}
+
+static void cmac_internal(const uint8_t key[16], const uint8_t *msg,
+					size_t msg_len, uint8_t out[16])
+{
+	uint8_t sched[AES_KEY_SCHED];
+	uint8_t x[16], k1[16], k2[16];
+	size_t i;
+
+	aes_key_expand(key, sched);
+
+	/* L = AES-128(K, 0), K1 = L << 1, K2 = K1 << 1 */
+	memset(x, 0, 16);
+	aes_encrypt(sched, x, x);
+	cmac_subkey(x, k1);
+	cmac_subkey(k1, k2);
+
+	memset(x, 0, 16);
+
+	/* All complete blocks but the last one */
+	for (; msg_len > 16; msg += 16, msg_len -= 16) {
+		for (i = 0; i < 16; i++)
+			x[i] ^= msg[i];
+
+		aes_encrypt(sched, x, x);
+	}
+
+	/* Last block, padded with 10...0 if incomplete */
+	for (i = 0; i < msg_len; i++)
+		x[i] ^= msg[i];
+
+	if (msg_len == 16) {
+		for (i = 0; i < 16; i++)
+			x[i] ^= k1[i];
+	} else {
+		x[msg_len] ^= 0x80;
+
+		for (i = 0; i < 16; i++)
+			x[i] ^= k2[i];
+	}
+
+	aes_encrypt(sched, x, out);
+}
+
+static bool cmac_af_alg(struct bt_crypto *crypto, const uint8_t key[16],
+					const uint8_t *msg, size_t msg_len,
+					uint8_t out[16])
+{
+	ssize_t len;
+	int fd;
+
+	fd = alg_new(crypto->cmac_aes, key, 16);
+	if (fd < 0)
+		return false;
+
+	len = send(fd, msg, msg_len, 0);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
+
+	len = read(fd, out, 16);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+/*
+ * AES-CMAC of msg with the selected backend. Key, message and result
+ * are most significant octet first.
+ */
+static bool cmac(struct bt_crypto *crypto, const uint8_t key[16],
+					const uint8_t *msg, size_t msg_len,
+					uint8_t out[16])
+{
+	if (crypto->backend == BT_CRYPTO_BACKEND_AF_ALG)
+		return cmac_af_alg(crypto, key, msg, msg_len, out);
+
+	cmac_internal(key, msg, msg_len, out);
+
+	return true;
+}
+
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12])
 {
-	int fd;
-	int len;
 	uint8_t tmp[16], out[16];
 	uint16_t msg_len = m_len + sizeof(uint32_t);
 	uint8_t msg[msg_len];
@@ -282,26 +666,11 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
 	/* Swap msg before signing */
 	swap_buf(msg, msg_s, msg_len);
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!cmac(crypto, tmp, msg_s, msg_len, out))
 		return false;
-	}
-
-	close(fd);
 
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
@@ -344,6 +713,18 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
+	if (crypto->backend == BT_CRYPTO_BACKEND_INTERNAL) {
+		uint8_t sched[AES_KEY_SCHED];
+
+		aes_key_expand(tmp, sched);
+
+		swap_buf(plaintext, in, 16);
+		aes_encrypt(sched, in, out);
+		swap_buf(out, encrypted, 16);
+
+		return true;
+	}
+
 	fd = alg_new(crypto->ecb_aes, tmp, 16);
 	if (fd < 0)
 		return false;
@@ -397,29 +778,258 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
  * taking the least significant 24 bits of the output of e as the result
  * of ah.
  */
+static inline void ah_plaintext(const uint8_t r[3], uint8_t in[16])
+{
+	/* r' = padding || r, most significant octet first */
+	memset(in, 0, 13);
+	swap_buf(r, in + 13, 3);
+}
+
+static inline void ah_hash(const uint8_t out[16], uint8_t hash[3])
+{
+	/* ah(k, r) = e(k, r') mod 2^24 */
+	swap_buf(out + 13, hash, 3);
+}
+
 bool bt_crypto_ah(struct bt_crypto *crypto, const uint8_t k[16],
 					const uint8_t r[3], uint8_t hash[3])
 {
-	uint8_t rp[16];
-	uint8_t encrypted[16];
+	uint8_t key[16], sched[AES_KEY_SCHED];
+	uint8_t in[16], out[16];
 
 	if (!crypto)
 		return false;
 
-	/* r' = padding || r */
-	memcpy(rp, r, 3);
-	memset(rp + 3, 0, 13);
+	if (crypto->backend == BT_CRYPTO_BACKEND_AF_ALG) {
+		uint8_t rp[16], encrypted[16];
+
+		/* r' = padding || r */
+		memcpy(rp, r, 3);
+		memset(rp + 3, 0, 13);
+
+		if (!bt_crypto_e(crypto, k, rp, encrypted))
+			return false;
+
+		memcpy(hash, encrypted, 3);
+
+		return true;
+	}
+
+	swap_buf(k, key, 16);
+	aes_key_expand(key, sched);
+
+	ah_plaintext(r, in);
+	aes_encrypt(sched, in, out);
+	ah_hash(out, hash);
+
+	return true;
+}
+
+/*
+ * Resolvable private address resolver
+ *
+ * Keeps the expanded key schedules of all IRKs next to each other, so
+ * resolving an address is one batched pass of in-process AES over all
+ * of them. Recent results, including addresses that did not resolve,
+ * are remembered in a small direct mapped cache since a device keeps
+ * its RPA for several minutes while advertising many times a second.
+ */
+#define RESOLVER_CACHE_SIZE	256
+#define RESOLVER_BATCH		16
 
-	/* e(k, r') */
-	if (!bt_crypto_e(crypto, k, rp, encrypted))
+struct resolver_irk {
+	uint8_t val[16];
+	void *user_data;
+};
+
+struct resolver_cache_entry {
+	uint8_t rpa[6];
+	bool valid;
+	int index;		/* -1 if the address did not resolve */
+	unsigned int add_gen;
+	unsigned int remove_gen;
+};
+
+struct bt_crypto_resolver {
+	uint8_t (*sched)[AES_KEY_SCHED];
+	struct resolver_irk *irks;
+	unsigned int count;
+	unsigned int size;
+	unsigned int add_gen;		/* invalidates negative entries */
+	unsigned int remove_gen;	/* invalidates all entries */
+	struct resolver_cache_entry cache[RESOLVER_CACHE_SIZE];
+};
+
+struct bt_crypto_resolver *bt_crypto_resolver_new(void)
+{
+	return new0(struct bt_crypto_resolver, 1);
+}
+
+void bt_crypto_resolver_free(struct bt_crypto_resolver *resolver)
+{
+	if (!resolver)
+		return;
+
+	free(resolver->sched);
+	free(resolver->irks);
+	free(resolver);
+}
+
+static int resolver_find_irk(struct bt_crypto_resolver *resolver,
+							const uint8_t irk[16])
+{
+	unsigned int i;
+
+	for (i = 0; i < resolver->count; i++) {
+		if (!memcmp(resolver->irks[i].val, irk, 16))
+			return i;
+	}
+
+	return -1;
+}
+
+bool bt_crypto_resolver_add_irk(struct bt_crypto_resolver *resolver,
+					const uint8_t irk[16], void *user_data)
+{
+	uint8_t key[16];
+	int index;
+
+	if (!resolver)
 		return false;
 
-	/* ah(k, r) = e(k, r') mod 2^24 */
-	memcpy(hash, encrypted, 3);
+	index = resolver_find_irk(resolver, irk);
+	if (index >= 0) {
+		resolver->irks[index].user_data = user_data;
+		return true;
+	}
+
+	if (resolver->count == resolver->size) {
+		unsigned int size = resolver->size ? resolver->size * 2 : 16;
+		void *sched, *irks;
+
+		sched = realloc(resolver->sched, size * AES_KEY_SCHED);
+		if (!sched)
+			return false;
+
+		resolver->sched = sched;
+
+		irks = realloc(resolver->irks, size * sizeof(*resolver->irks));
+		if (!irks)
+			return false;
+
+		resolver->irks = irks;
+		resolver->size = size;
+	}
+
+	/* The most significant octet of the key corresponds to irk[15] */
+	swap_buf(irk, key, 16);
+	aes_key_expand(key, resolver->sched[resolver->count]);
+
+	memcpy(resolver->irks[resolver->count].val, irk, 16);
+	resolver->irks[resolver->count].user_data = user_data;
+	resolver->count++;
+
+	/* Addresses that did not resolve so far might do now */
+	resolver->add_gen++;
 
 	return true;
 }
 
+bool bt_crypto_resolver_remove_irk(struct bt_crypto_resolver *resolver,
+							const uint8_t irk[16])
+{
+	unsigned int last;
+	int index;
+
+	if (!resolver)
+		return false;
+
+	index = resolver_find_irk(resolver, irk);
+	if (index < 0)
+		return false;
+
+	/* Move the last IRK into the hole, cached indexes become stale */
+	last = --resolver->count;
+	if ((unsigned int) index != last) {
+		memcpy(resolver->sched[index], resolver->sched[last],
+							AES_KEY_SCHED);
+		resolver->irks[index] = resolver->irks[last];
+	}
+
+	resolver->remove_gen++;
+
+	return true;
+}
+
+static struct resolver_cache_entry *resolver_cache_entry(
+					struct bt_crypto_resolver *resolver,
+					const uint8_t rpa[6])
+{
+	/* The hash part of an RPA is already uniformly distributed */
+	return &resolver->cache[rpa[0] % RESOLVER_CACHE_SIZE];
+}
+
+static int resolver_lookup(struct bt_crypto_resolver *resolver,
+							const uint8_t rpa[6])
+{
+	uint8_t out[RESOLVER_BATCH][16];
+	uint8_t in[16], hash[3];
+	unsigned int i, n;
+
+	ah_plaintext(rpa + 3, in);
+
+	for (i = 0; i < resolver->count; i += RESOLVER_BATCH) {
+		unsigned int batch = resolver->count - i;
+
+		if (batch > RESOLVER_BATCH)
+			batch = RESOLVER_BATCH;
+
+		aes_encrypt_multi(&resolver->sched[i], batch, in, out);
+
+		for (n = 0; n < batch; n++) {
+			ah_hash(out[n], hash);
+
+			if (!memcmp(hash, rpa, 3))
+				return i + n;
+		}
+	}
+
+	return -1;
+}
+
+void *bt_crypto_resolver_resolve(struct bt_crypto_resolver *resolver,
+							const uint8_t rpa[6])
+{
+	struct resolver_cache_entry *entry;
+
+	if (!resolver)
+		return NULL;
+
+	/* Only resolvable private addresses, two top bits are 0b01 */
+	if ((rpa[5] & 0xc0) != 0x40)
+		return NULL;
+
+	entry = resolver_cache_entry(resolver, rpa);
+
+	if (entry->valid && !memcmp(entry->rpa, rpa, 6) &&
+				entry->remove_gen == resolver->remove_gen &&
+				(entry->index >= 0 ||
+				entry->add_gen == resolver->add_gen))
+		goto done;
+
+	memcpy(entry->rpa, rpa, 6);
+	entry->valid = true;
+	entry->index = resolver_lookup(resolver, rpa);
+	entry->add_gen = resolver->add_gen;
+	entry->remove_gen = resolver->remove_gen;
+
+done:
+	if (entry->index < 0)
+		return NULL;
+
+	return resolver->irks[entry->index].user_data;
+}
+
 typedef struct {
 	uint64_t a, b;
 } u128;
@@ -568,34 +1178,18 @@ static bool aes_cmac(struct bt_crypto *crypto, uint8_t key[16], uint8_t *msg,
 					size_t msg_len, uint8_t res[16])
 {
 	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
 	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
-		return false;
-
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!cmac(crypto, key_msb, msg_msb, msg_len, out))
 		return false;
-	}
 
 	swap_buf(out, res, 16);
 
-	close(fd);
-
 	return true;
 }
 
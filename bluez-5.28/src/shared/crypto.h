@@ -26,7 +26,16 @@
 
 struct bt_crypto;
 
+enum bt_crypto_backend {
+	BT_CRYPTO_BACKEND_INTERNAL,	/* in-process AES */
+	BT_CRYPTO_BACKEND_AF_ALG,	/* kernel crypto API sockets */
+};
+
+void bt_crypto_set_default_backend(enum bt_crypto_backend backend);
+
 struct bt_crypto *bt_crypto_new(void);
+bool bt_crypto_set_backend(struct bt_crypto *crypto,
+					enum bt_crypto_backend backend);
 
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto);
 void bt_crypto_unref(struct bt_crypto *crypto);
@@ -38,6 +47,18 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16]);
 bool bt_crypto_ah(struct bt_crypto *crypto, const uint8_t k[16],
 					const uint8_t r[3], uint8_t hash[3]);
+
+struct bt_crypto_resolver;
+
+struct bt_crypto_resolver *bt_crypto_resolver_new(void);
+void bt_crypto_resolver_free(struct bt_crypto_resolver *resolver);
+bool bt_crypto_resolver_add_irk(struct bt_crypto_resolver *resolver,
+					const uint8_t irk[16], void *user_data);
+bool bt_crypto_resolver_remove_irk(struct bt_crypto_resolver *resolver,
+							const uint8_t irk[16]);
+void *bt_crypto_resolver_resolve(struct bt_crypto_resolver *resolver,
+							const uint8_t rpa[6]);
+
 bool bt_crypto_c1(struct bt_crypto *crypto, const uint8_t k[16],
 			const uint8_t r[16], const uint8_t pres[7],
 			const uint8_t preq[7], uint8_t iat,
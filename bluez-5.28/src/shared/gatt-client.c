@@ -27,6 +27,7 @@
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
 #include "src/shared/gatt-db.h"
+#include "src/shared/metrics.h"
 #include "src/shared/gatt-client.h"
 
 #include <assert.h>
@@ -45,6 +46,35 @@
 #define GATT_SVC_UUID	0x1801
 #define SVC_CHNGD_UUID	0x2a05
 
+enum {
+	GATT_CLIENT_METRIC_READS,
+	GATT_CLIENT_METRIC_WRITES,
+	GATT_CLIENT_METRIC_NOTIFICATIONS,
+	GATT_CLIENT_METRIC_PENDING,
+};
+
+static const char * const notification_names[] = {
+	"notification", "indication"
+};
+
+static const struct metrics_desc gatt_client_metrics_desc[] = {
+	{ "reads_total", "Characteristic and descriptor reads",
+							METRICS_COUNTER },
+	{ "writes_total", "Characteristic and descriptor writes",
+							METRICS_COUNTER },
+	{ "notifications_total", "Value notifications and indications",
+			METRICS_COUNTER, "type", 2, notification_names },
+	{ "pending_requests", "GATT procedures in progress",
+							METRICS_GAUGE },
+};
+
+static const struct metrics_family gatt_client_metrics = {
+	.subsystem = "gatt_client",
+	.desc = gatt_client_metrics_desc,
+	.num_desc = sizeof(gatt_client_metrics_desc) /
+					sizeof(gatt_client_metrics_desc[0]),
+};
+
 struct bt_gatt_client {
 	struct bt_att *att;
 	int ref_count;
@@ -97,6 +127,8 @@ struct bt_gatt_client {
 	 */
 	struct queue *pending_requests;
 	unsigned int next_request_id;
+
+	struct metrics *metrics;
 };
 
 struct request {
@@ -129,6 +161,8 @@ static struct request *request_create(struct bt_gatt_client *client)
 		client->next_request_id = 1;
 
 	queue_push_tail(client->pending_requests, req);
+	metrics_set(client->metrics, GATT_CLIENT_METRIC_PENDING, 0,
+				queue_length(client->pending_requests));
 	req->client = client;
 	req->id = client->next_request_id++;
 
@@ -145,8 +179,11 @@ static void request_unref(void *data)
 	if (req->destroy)
 		req->destroy(req->data);
 
-	if (!req->removed)
+	if (!req->removed) {
 		queue_remove(req->client->pending_requests, req);
+		metrics_set(req->client->metrics, GATT_CLIENT_METRIC_PENDING,
+				0, queue_length(req->client->pending_requests));
+	}
 
 	free(req);
 }
@@ -1462,6 +1499,9 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 
 	bt_gatt_client_ref(client);
 
+	metrics_add(client->metrics, GATT_CLIENT_METRIC_NOTIFICATIONS,
+				opcode == BT_ATT_OP_HANDLE_VAL_IND, 1);
+
 	memset(&pdu_data, 0, sizeof(pdu_data));
 	pdu_data.pdu = pdu;
 	pdu_data.length = length;
@@ -1500,6 +1540,8 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
 	queue_destroy(client->pending_requests, request_unref);
 
+	metrics_free(client->metrics);
+
 	free(client);
 }
 
@@ -1574,6 +1616,8 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 	if (!gatt_client_init(client, mtu))
 		goto fail;
 
+	client->metrics = metrics_new(&gatt_client_metrics);
+
 	return bt_gatt_client_ref(client);
 
 fail:
@@ -1811,6 +1855,8 @@ unsigned int bt_gatt_client_read_value(struct bt_gatt_client *client,
 	if (!client)
 		return 0;
 
+	metrics_inc(client->metrics, GATT_CLIENT_METRIC_READS);
+
 	op = new0(struct read_op, 1);
 	if (!op)
 		return 0;
@@ -1887,6 +1933,8 @@ unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 	if (num_handles < 2)
 		return 0;
 
+	metrics_inc(client->metrics, GATT_CLIENT_METRIC_READS);
+
 	if (num_handles * 2 > bt_att_get_mtu(client->att) - 1)
 		return 0;
 
@@ -2098,6 +2146,8 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	if (!client)
 		return 0;
 
+	metrics_inc(client->metrics, GATT_CLIENT_METRIC_READS);
+
 	op = new0(struct read_long_op, 1);
 	if (!op)
 		return 0;
@@ -2157,6 +2207,8 @@ unsigned int bt_gatt_client_write_without_response(
 	if (signed_write)
 		return 0;
 
+	metrics_inc(client->metrics, GATT_CLIENT_METRIC_WRITES);
+
 	req = request_create(client);
 	if (!req)
 		return 0;
@@ -2227,6 +2279,8 @@ unsigned int bt_gatt_client_write_value(struct bt_gatt_client *client,
 	if (!client)
 		return 0;
 
+	metrics_inc(client->metrics, GATT_CLIENT_METRIC_WRITES);
+
 	op = new0(struct write_op, 1);
 	if (!op)
 		return 0;
@@ -2486,6 +2540,8 @@ unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
 	if (!client)
 		return 0;
 
+	metrics_inc(client->metrics, GATT_CLIENT_METRIC_WRITES);
+
 	if ((size_t)(length + offset) > UINT16_MAX)
 		return 0;
 
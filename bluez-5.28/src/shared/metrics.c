@@ -0,0 +1,499 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "src/shared/io.h"
+#include "src/shared/queue.h"
+#include "src/shared/util.h"
+#include "src/shared/metrics.h"
+
+/*
+ * Every object owns its values and updates them with relaxed atomics, so
+ * the hot path neither locks nor shares cache lines with other objects.
+ * Values are only summed up per family when somebody asks for them; the
+ * registry lock protects object creation, destruction and that walk.
+ */
+struct metrics_registry {
+	const struct metrics_family *family;
+	unsigned int *offsets;
+	unsigned int slots;
+	uint64_t *retired;		/* Counters of freed objects */
+	struct queue *objects;
+};
+
+struct metrics {
+	struct metrics_registry *registry;
+	uint64_t *values;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct queue *registries = NULL;
+static struct io *listen_io = NULL;
+static char *listen_path = NULL;
+static struct queue *clients = NULL;
+
+struct metrics_client {
+	struct io *io;
+	char *str;
+	size_t len;
+	size_t offset;
+};
+
+static bool match_family(const void *a, const void *b)
+{
+	const struct metrics_registry *registry = a;
+
+	return registry->family == b;
+}
+
+static struct metrics_registry *registry_get(
+					const struct metrics_family *family)
+{
+	struct metrics_registry *registry;
+	unsigned int i;
+
+	if (!registries) {
+		registries = queue_new();
+		if (!registries)
+			return NULL;
+	}
+
+	registry = queue_find(registries, match_family, family);
+	if (registry)
+		return registry;
+
+	registry = new0(struct metrics_registry, 1);
+	if (!registry)
+		return NULL;
+
+	registry->family = family;
+
+	registry->offsets = new0(unsigned int, family->num_desc);
+	if (!registry->offsets)
+		goto failed;
+
+	for (i = 0; i < family->num_desc; i++) {
+		registry->offsets[i] = registry->slots;
+		registry->slots += family->desc[i].labels ? : 1;
+	}
+
+	registry->retired = new0(uint64_t, registry->slots);
+	if (!registry->retired)
+		goto failed;
+
+	registry->objects = queue_new();
+	if (!registry->objects)
+		goto failed;
+
+	if (!queue_push_tail(registries, registry)) {
+		queue_destroy(registry->objects, NULL);
+		goto failed;
+	}
+
+	return registry;
+
+failed:
+	free(registry->retired);
+	free(registry->offsets);
+	free(registry);
+
+	return NULL;
+}
+
+struct metrics *metrics_new(const struct metrics_family *family)
+{
+	struct metrics *metrics;
+
+	if (!family)
+		return NULL;
+
+	metrics = new0(struct metrics, 1);
+	if (!metrics)
+		return NULL;
+
+	pthread_mutex_lock(&registry_lock);
+
+	metrics->registry = registry_get(family);
+	if (!metrics->registry)
+		goto failed;
+
+	metrics->values = new0(uint64_t, metrics->registry->slots);
+	if (!metrics->values)
+		goto failed;
+
+	if (!queue_push_tail(metrics->registry->objects, metrics)) {
+		free(metrics->values);
+		goto failed;
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	return metrics;
+
+failed:
+	pthread_mutex_unlock(&registry_lock);
+	free(metrics);
+
+	return NULL;
+}
+
+void metrics_free(struct metrics *metrics)
+{
+	struct metrics_registry *registry;
+	const struct metrics_desc *desc;
+	unsigned int i, j, slot;
+
+	if (!metrics)
+		return;
+
+	registry = metrics->registry;
+
+	pthread_mutex_lock(&registry_lock);
+
+	queue_remove(registry->objects, metrics);
+
+	/* Counters stay monotonic across object lifetimes, gauges do not */
+	for (i = 0; i < registry->family->num_desc; i++) {
+		desc = &registry->family->desc[i];
+		if (desc->type != METRICS_COUNTER)
+			continue;
+
+		slot = registry->offsets[i];
+		for (j = 0; j < (desc->labels ? : 1); j++)
+			registry->retired[slot + j] += metrics->values[slot + j];
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	free(metrics->values);
+	free(metrics);
+}
+
+static uint64_t *metrics_slot(struct metrics *metrics, unsigned int id,
+							unsigned int label)
+{
+	const struct metrics_family *family = metrics->registry->family;
+	unsigned int labels;
+
+	if (id >= family->num_desc)
+		return NULL;
+
+	labels = family->desc[id].labels ? : 1;
+	if (label >= labels)
+		return NULL;
+
+	return &metrics->values[metrics->registry->offsets[id] + label];
+}
+
+void metrics_add(struct metrics *metrics, unsigned int id,
+					unsigned int label, uint64_t val)
+{
+	uint64_t *slot;
+
+	if (!metrics)
+		return;
+
+	slot = metrics_slot(metrics, id, label);
+	if (slot)
+		__atomic_fetch_add(slot, val, __ATOMIC_RELAXED);
+}
+
+void metrics_set(struct metrics *metrics, unsigned int id,
+					unsigned int label, uint64_t val)
+{
+	uint64_t *slot;
+
+	if (!metrics)
+		return;
+
+	slot = metrics_slot(metrics, id, label);
+	if (slot)
+		__atomic_store_n(slot, val, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct sum_data {
+	unsigned int slot;
+	uint64_t value;
+};
+
+static void sum_object(void *data, void *user_data)
+{
+	struct metrics *metrics = data;
+	struct sum_data *sum = user_data;
+
+	sum->value += __atomic_load_n(&metrics->values[sum->slot],
+							__ATOMIC_RELAXED);
+}
+
+static void format_desc(FILE *fp, struct metrics_registry *registry,
+							unsigned int id)
+{
+	const struct metrics_desc *desc = &registry->family->desc[id];
+	struct sum_data sum;
+	unsigned int i;
+
+	fprintf(fp, "# HELP bluez_%s_%s %s\n", registry->family->subsystem,
+						desc->name, desc->help);
+	fprintf(fp, "# TYPE bluez_%s_%s %s\n", registry->family->subsystem,
+						desc->name,
+			desc->type == METRICS_COUNTER ? "counter" : "gauge");
+
+	for (i = 0; i < (desc->labels ? : 1); i++) {
+		sum.slot = registry->offsets[id] + i;
+		sum.value = registry->retired[sum.slot];
+		queue_foreach(registry->objects, sum_object, &sum);
+
+		if (!desc->labels) {
+			fprintf(fp, "bluez_%s_%s %llu\n",
+					registry->family->subsystem,
+					desc->name,
+					(unsigned long long) sum.value);
+			continue;
+		}
+
+		/* Sparse label spaces such as opcodes only list what occurred */
+		if (!sum.value && !desc->label_names)
+			continue;
+
+		if (desc->label_names)
+			fprintf(fp, "bluez_%s_%s{%s=\"%s\"} %llu\n",
+					registry->family->subsystem,
+					desc->name, desc->label,
+					desc->label_names[i],
+					(unsigned long long) sum.value);
+		else
+			fprintf(fp, "bluez_%s_%s{%s=\"0x%02x\"} %llu\n",
+					registry->family->subsystem,
+					desc->name, desc->label, i,
+					(unsigned long long) sum.value);
+	}
+}
+
+static void format_registry(void *data, void *user_data)
+{
+	struct metrics_registry *registry = data;
+	unsigned int i;
+
+	for (i = 0; i < registry->family->num_desc; i++)
+		format_desc(user_data, registry, i);
+}
+
+char *metrics_format(void)
+{
+	char *str = NULL;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&str, &len);
+	if (!fp)
+		return NULL;
+
+	pthread_mutex_lock(&registry_lock);
+	queue_foreach(registries, format_registry, fp);
+	pthread_mutex_unlock(&registry_lock);
+
+	if (fclose(fp)) {
+		free(str);
+		return NULL;
+	}
+
+	return str;
+}
+
+/*
+ * A client is owned by the clients queue alone. Its write watch has no
+ * destroy callback, so whoever takes it off the queue frees it.
+ */
+static void client_free(struct metrics_client *client)
+{
+	queue_remove(clients, client);
+	io_destroy(client->io);
+	free(client->str);
+	free(client);
+}
+
+static bool client_write_cb(struct io *io, void *user_data)
+{
+	struct metrics_client *client = user_data;
+	ssize_t written;
+
+	while (client->offset < client->len) {
+		written = send(io_get_fd(io), client->str + client->offset,
+					client->len - client->offset,
+					MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Wait for the scraper to drain the socket */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			break;
+		}
+
+		client->offset += written;
+	}
+
+	/* Removing the watch from within its callback is safe */
+	client_free(client);
+
+	return false;
+}
+
+static bool listen_cb(struct io *io, void *user_data)
+{
+	struct metrics_client *client;
+	int fd;
+
+	fd = accept4(io_get_fd(io), NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return true;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(fd);
+		return true;
+	}
+
+	client->str = metrics_format();
+	client->io = io_new(fd);
+	if (!client->str || !client->io) {
+		if (client->io)
+			io_destroy(client->io);
+		close(fd);
+		free(client->str);
+		free(client);
+		return true;
+	}
+
+	io_set_close_on_destroy(client->io, true);
+	client->len = strlen(client->str);
+
+	/*
+	 * The snapshot is written as the socket takes it, a scraper that
+	 * reads slowly never holds up the caller's main loop.
+	 */
+	queue_push_tail(clients, client);
+
+	if (!io_set_write_handler(client->io, client_write_cb, client, NULL))
+		client_free(client);
+
+	return true;
+}
+
+bool metrics_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!path || listen_io || strlen(path) >= sizeof(addr.sun_path))
+		return false;
+
+	fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return false;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto failed;
+
+	if (listen(fd, 5) < 0)
+		goto failed;
+
+	listen_io = io_new(fd);
+	if (!listen_io)
+		goto failed;
+
+	clients = queue_new();
+
+	io_set_close_on_destroy(listen_io, true);
+
+	if (!io_set_read_handler(listen_io, listen_cb, NULL, NULL)) {
+		io_destroy(listen_io);
+		listen_io = NULL;
+		queue_destroy(clients, NULL);
+		clients = NULL;
+		unlink(path);
+		return false;
+	}
+
+	listen_path = strdup(path);
+
+	return true;
+
+failed:
+	close(fd);
+
+	return false;
+}
+
+void metrics_shutdown(void)
+{
+	struct metrics_client *client;
+
+	if (!listen_io)
+		return;
+
+	io_destroy(listen_io);
+	listen_io = NULL;
+
+	while ((client = queue_pop_head(clients)))
+		client_free(client);
+
+	queue_destroy(clients, NULL);
+	clients = NULL;
+
+	if (listen_path) {
+		unlink(listen_path);
+		free(listen_path);
+		listen_path = NULL;
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum metrics_type {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+};
+
+struct metrics_desc {
+	const char *name;
+	const char *help;
+	enum metrics_type type;
+	const char *label;		/* Label name of per-label values */
+	unsigned int labels;		/* Number of label values, 0 if none */
+	const char * const *label_names;	/* Optional label values */
+};
+
+struct metrics_family {
+	const char *subsystem;
+	const struct metrics_desc *desc;
+	unsigned int num_desc;
+};
+
+struct metrics;
+
+struct metrics *metrics_new(const struct metrics_family *family);
+void metrics_free(struct metrics *metrics);
+
+void metrics_add(struct metrics *metrics, unsigned int id,
+					unsigned int label, uint64_t val);
+void metrics_set(struct metrics *metrics, unsigned int id,
+					unsigned int label, uint64_t val);
+
+#define metrics_inc(metrics, id) metrics_add((metrics), (id), 0, 1)
+
+uint64_t metrics_now_us(void);
+
+char *metrics_format(void);
+
+bool metrics_listen(const char *path);
+void metrics_shutdown(void);
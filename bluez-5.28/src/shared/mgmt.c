@@ -37,8 +37,37 @@
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
 #include "src/shared/util.h"
+#include "src/shared/metrics.h"
 #include "src/shared/mgmt.h"
 
+enum {
+	MGMT_METRIC_COMMANDS_SENT,
+	MGMT_METRIC_EVENTS_RECEIVED,
+	MGMT_METRIC_COMMANDS_COMPLETED,
+	MGMT_METRIC_COMMAND_LATENCY,
+	MGMT_METRIC_PENDING,
+};
+
+static const struct metrics_desc mgmt_metrics_desc[] = {
+	{ "commands_sent_total", "Management commands sent",
+					METRICS_COUNTER, "opcode", 256 },
+	{ "events_received_total", "Management events received",
+					METRICS_COUNTER, "event", 256 },
+	{ "commands_completed_total", "Management commands completed",
+							METRICS_COUNTER },
+	{ "command_latency_us_total",
+			"Time from sending to completion of commands",
+							METRICS_COUNTER },
+	{ "pending_commands", "Management commands awaiting completion",
+							METRICS_GAUGE },
+};
+
+static const struct metrics_family mgmt_metrics = {
+	.subsystem = "mgmt",
+	.desc = mgmt_metrics_desc,
+	.num_desc = sizeof(mgmt_metrics_desc) / sizeof(mgmt_metrics_desc[0]),
+};
+
 struct mgmt {
 	int ref_count;
 	int fd;
@@ -56,6 +85,7 @@ struct mgmt {
 	mgmt_debug_func_t debug_callback;
 	mgmt_destroy_func_t debug_destroy;
 	void *debug_data;
+	struct metrics *metrics;
 };
 
 struct mgmt_request {
@@ -64,6 +94,7 @@ struct mgmt_request {
 	uint16_t index;
 	void *buf;
 	uint16_t len;
+	uint64_t sent_us;
 	mgmt_request_func_t callback;
 	mgmt_destroy_func_t destroy;
 	void *user_data;
@@ -164,7 +195,13 @@ static bool send_request(struct mgmt *mgmt, struct mgmt_request *request)
 	util_hexdump('<', request->buf, ret, mgmt->debug_callback,
 							mgmt->debug_data);
 
+	request->sent_us = metrics_now_us();
+	metrics_add(mgmt->metrics, MGMT_METRIC_COMMANDS_SENT,
+						request->opcode & 0xff, 1);
+
 	queue_push_tail(mgmt->pending_list, request);
+	metrics_set(mgmt->metrics, MGMT_METRIC_PENDING, 0,
+					queue_length(mgmt->pending_list));
 
 	return true;
 }
@@ -238,6 +275,12 @@ static void request_complete(struct mgmt *mgmt, uint8_t status,
 	request = queue_remove_if(mgmt->pending_list,
 					match_request_opcode_index, &match);
 	if (request) {
+		metrics_inc(mgmt->metrics, MGMT_METRIC_COMMANDS_COMPLETED);
+		metrics_add(mgmt->metrics, MGMT_METRIC_COMMAND_LATENCY, 0,
+					metrics_now_us() - request->sent_us);
+		metrics_set(mgmt->metrics, MGMT_METRIC_PENDING, 0,
+					queue_length(mgmt->pending_list));
+
 		if (request->callback)
 			request->callback(status, length, param,
 							request->user_data);
@@ -309,6 +352,9 @@ static bool can_read_data(struct io *io, void *user_data)
 
 	mgmt_ref(mgmt);
 
+	metrics_add(mgmt->metrics, MGMT_METRIC_EVENTS_RECEIVED,
+							event & 0xff, 1);
+
 	switch (event) {
 	case MGMT_EV_CMD_COMPLETE:
 		cc = mgmt->buf + MGMT_HDR_SIZE;
@@ -424,6 +470,8 @@ struct mgmt *mgmt_new(int fd)
 
 	mgmt->writer_active = false;
 
+	mgmt->metrics = metrics_new(&mgmt_metrics);
+
 	return mgmt_ref(mgmt);
 }
 
@@ -501,6 +549,8 @@ void mgmt_unref(struct mgmt *mgmt)
 	free(mgmt->buf);
 	mgmt->buf = NULL;
 
+	metrics_free(mgmt->metrics);
+
 	queue_destroy(mgmt->notify_list, NULL);
 	queue_destroy(mgmt->pending_list, NULL);
 	free(mgmt);
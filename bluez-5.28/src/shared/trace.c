@@ -0,0 +1,322 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "src/shared/util.h"
+#include "src/shared/trace.h"
+
+/*
+ * Every thread records into a ring of its own, so recording needs neither
+ * locks nor atomic read-modify-write operations. Rings are only linked
+ * into the global list, never removed, which keeps the records of threads
+ * that already exited available to trace_dump().
+ */
+#define TRACE_RING_SIZE		4096	/* records, power of two */
+
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	uint64_t head;
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+struct trace_hdr {
+	uint8_t		id[8];
+	uint32_t	version;
+	uint32_t	record_size;
+	uint64_t	count;
+} __attribute__ ((packed));
+
+static const uint8_t trace_id[] = { 0x62, 0x74, 0x74, 0x72,
+				    0x61, 0x63, 0x65, 0x00 };
+
+bool trace_enabled = false;
+
+static struct trace_ring *trace_rings = NULL;
+static __thread struct trace_ring *trace_ring = NULL;
+
+void trace_enable(bool enable)
+{
+	__atomic_store_n(&trace_enabled, enable, __ATOMIC_RELAXED);
+}
+
+static struct trace_ring *ring_get(void)
+{
+	struct trace_ring *ring;
+
+	if (trace_ring)
+		return trace_ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring,
+						true, __ATOMIC_RELEASE,
+						__ATOMIC_RELAXED));
+
+	trace_ring = ring;
+
+	return ring;
+}
+
+void trace_record(uint16_t event, uint16_t arg0, uint64_t arg1,
+							uint64_t arg2)
+{
+	struct trace_ring *ring;
+	struct trace_record *rec;
+	struct timespec ts;
+
+	ring = ring_get();
+	if (!ring)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+	rec->ts = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	rec->tid = ring->tid;
+	rec->event = event;
+	rec->arg0 = arg0;
+	rec->arg1 = arg1;
+	rec->arg2 = arg2;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t trace_bdaddr(const uint8_t *bdaddr)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = 5; i >= 0; i--)
+		val = (val << 8) | bdaddr[i];
+
+	return val;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	ssize_t written;
+
+	while (len) {
+		written = write(fd, ptr, len);
+		if (written <= 0)
+			return false;
+
+		ptr += written;
+		len -= written;
+	}
+
+	return true;
+}
+
+static size_t ring_snapshot(struct trace_ring *ring,
+						struct trace_record *out)
+{
+	uint64_t start, end, seq, valid;
+	size_t count = 0;
+
+	end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+	for (seq = start; seq < end; seq++)
+		out[count++] = ring->records[seq & (TRACE_RING_SIZE - 1)];
+
+	/* Drop whatever the owner overwrote while it was being copied */
+	valid = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (valid >= TRACE_RING_SIZE && valid - TRACE_RING_SIZE >= start) {
+		size_t skip = valid - TRACE_RING_SIZE - start + 1;
+
+		if (skip >= count)
+			return 0;
+
+		memmove(out, out + skip, (count - skip) * sizeof(*out));
+		count -= skip;
+	}
+
+	return count;
+}
+
+bool trace_dump(int fd)
+{
+	struct trace_ring *ring;
+	struct trace_record *records;
+	struct trace_hdr hdr;
+	size_t count = 0, rings = 0;
+	bool result;
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring;
+							ring = ring->next)
+		rings++;
+
+	records = malloc((rings ? rings : 1) * TRACE_RING_SIZE *
+							sizeof(*records));
+	if (!records)
+		return false;
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+					ring && rings--; ring = ring->next)
+		count += ring_snapshot(ring, records + count);
+
+	memcpy(hdr.id, trace_id, sizeof(trace_id));
+	hdr.version = 1;
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.count = count;
+
+	result = write_all(fd, &hdr, sizeof(hdr)) &&
+			write_all(fd, records, count * sizeof(*records));
+
+	free(records);
+
+	return result;
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct trace_record *ra = a, *rb = b;
+
+	if (ra->ts == rb->ts)
+		return 0;
+
+	return ra->ts < rb->ts ? -1 : 1;
+}
+
+static const char *event_str(uint16_t event)
+{
+	switch (event) {
+	case TRACE_SCAN_REPORT:
+		return "scan-report";
+	case TRACE_CONNECT_START:
+		return "connect-start";
+	case TRACE_CONNECT_DONE:
+		return "connect-done";
+	case TRACE_ATT_SEND:
+		return "att-send";
+	case TRACE_ATT_RECV:
+		return "att-recv";
+	case TRACE_WRITE_ACK:
+		return "write-ack";
+	}
+
+	return "unknown";
+}
+
+static void bdaddr_str(uint64_t val, char *str)
+{
+	sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
+			(unsigned int) (val >> 40) & 0xff,
+			(unsigned int) (val >> 32) & 0xff,
+			(unsigned int) (val >> 24) & 0xff,
+			(unsigned int) (val >> 16) & 0xff,
+			(unsigned int) (val >> 8) & 0xff,
+			(unsigned int) val & 0xff);
+}
+
+static void decode_record(const struct trace_record *rec, uint64_t base,
+				trace_decode_func_t function, void *user_data)
+{
+	uint64_t ts = rec->ts - base;
+	char addr[18];
+
+	switch (rec->event) {
+	case TRACE_SCAN_REPORT:
+	case TRACE_CONNECT_START:
+	case TRACE_CONNECT_DONE:
+		bdaddr_str(rec->arg1, addr);
+		util_debug(function, user_data,
+				"%llu.%06llu %u %s %s 0x%4.4x %lld",
+				(unsigned long long) ts / 1000000000ull,
+				(unsigned long long) ts / 1000 % 1000000,
+				rec->tid, event_str(rec->event), addr,
+				rec->arg0, (long long) rec->arg2);
+		break;
+	default:
+		util_debug(function, user_data,
+				"%llu.%06llu %u %s 0x%4.4x %llu %llu",
+				(unsigned long long) ts / 1000000000ull,
+				(unsigned long long) ts / 1000 % 1000000,
+				rec->tid, event_str(rec->event), rec->arg0,
+				(unsigned long long) rec->arg1,
+				(unsigned long long) rec->arg2);
+		break;
+	}
+}
+
+bool trace_decode(int fd, trace_decode_func_t function, void *user_data)
+{
+	struct trace_record *records;
+	struct trace_hdr hdr;
+	size_t size;
+	ssize_t len;
+	uint64_t i;
+
+	len = read(fd, &hdr, sizeof(hdr));
+	if (len != sizeof(hdr))
+		return false;
+
+	if (memcmp(hdr.id, trace_id, sizeof(trace_id)) || hdr.version != 1 ||
+			hdr.record_size != sizeof(struct trace_record))
+		return false;
+
+	if (!hdr.count)
+		return true;
+
+	if (hdr.count > SIZE_MAX / sizeof(*records))
+		return false;
+
+	size = hdr.count * sizeof(*records);
+	records = malloc(size);
+	if (!records)
+		return false;
+
+	len = read(fd, records, size);
+	if (len < 0 || (size_t) len != size) {
+		free(records);
+		return false;
+	}
+
+	/* Rings are dumped one after the other, merge them by time */
+	qsort(records, hdr.count, sizeof(*records), record_cmp);
+
+	for (i = 0; i < hdr.count; i++)
+		decode_record(&records[i], records[0].ts, function, user_data);
+
+	free(records);
+
+	return true;
+}
@@ -0,0 +1,64 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_SCAN_REPORT	0x0001
+#define TRACE_CONNECT_START	0x0002
+#define TRACE_CONNECT_DONE	0x0003
+#define TRACE_ATT_SEND		0x0004
+#define TRACE_ATT_RECV		0x0005
+#define TRACE_WRITE_ACK		0x0006
+
+struct trace_record {
+	uint64_t ts;		/* CLOCK_MONOTONIC nanoseconds */
+	uint32_t tid;
+	uint16_t event;
+	uint16_t arg0;
+	uint64_t arg1;
+	uint64_t arg2;
+} __attribute__ ((packed));
+
+typedef void (*trace_decode_func_t)(const char *str, void *user_data);
+
+extern bool trace_enabled;
+
+void trace_enable(bool enable);
+
+void trace_record(uint16_t event, uint16_t arg0, uint64_t arg1,
+							uint64_t arg2);
+
+/*
+ * Tracepoints cost a single well predicted branch while tracing is off,
+ * so they can stay in hot paths.
+ */
+#define trace_point(event, arg0, arg1, arg2) do { \
+	if (__builtin_expect(trace_enabled, 0)) \
+		trace_record((event), (arg0), (arg1), (arg2)); \
+} while (0)
+
+uint64_t trace_bdaddr(const uint8_t *bdaddr);
+
+bool trace_dump(int fd);
+bool trace_decode(int fd, trace_decode_func_t function, void *user_data);
@@ -32,6 +32,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
 #include <time.h>
 #include <sys/file.h>
 #include <sys/stat.h>
@@ -43,6 +49,7 @@
 #include <bluetooth/sdp_lib.h>
 
 #include "lib/uuid.h"
+#include "log.h"
 #include "textfile.h"
 #include "uuid-helper.h"
 #include "storage.h"
@@ -50,6 +57,9 @@
 /* When all services should trust a remote device */
 #define GLOBAL_TRUST "[all]"
 
+/* Longest time a changed keyfile waits before it is written back */
+#define FLUSH_DELAY	500	/* milliseconds */
+
 struct match {
 	GSList *keys;
 	char *pattern;
@@ -196,3 +206,543 @@ sdp_record_t *find_record_in_list(sdp_list_t *recs, const char *uuid)
 	}
 	return NULL;
 }
+
+/*
+ * Write-behind keyfile storage
+ *
+ * Parsed keyfiles are cached per path and modified in place by their
+ * users. Changed files are serialised on the main loop once FLUSH_DELAY
+ * has passed since they were first dirtied, so bursts of updates to the
+ * same file collapse into one write, and the writes themselves happen on
+ * a worker thread. Jobs are written in the order they were queued, so the
+ * last queued contents of a file always win. A sync writes the file on
+ * the main loop instead and has the worker skip its older queued copies.
+ * Files that are clean and have been written are dropped from the cache
+ * on the next pass, so it only holds what is in use and is read back from
+ * disk otherwise.
+ */
+
+struct keyfile_entry {
+	char *filename;
+	GKeyFile *key_file;
+	bool dirty;			/* Changed since the last write */
+	uint64_t ticket;		/* Last write queued for the file */
+};
+
+struct write_job {
+	char *filename;
+	char *data;
+	gsize length;
+	bool sync;
+	bool skip;			/* Superseded by a later sync */
+	struct write_job *next;
+};
+
+static GHashTable *keyfiles = NULL;	/* filename -> keyfile_entry */
+static guint flush_id = 0;
+
+static pthread_t writer;
+static bool writer_running = false;
+static bool writer_exit = false;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct write_job *job_head = NULL;
+static struct write_job *job_tail = NULL;
+static const char *job_writing = NULL;	/* Filename the worker is on */
+static uint64_t jobs_queued = 0;
+static uint64_t jobs_done = 0;
+
+/* Main loop time spent serialising files and waiting on sync barriers */
+static uint64_t stall_total_us = 0;
+static uint64_t stall_max_us = 0;
+static uint64_t puts_total = 0;
+static uint64_t writes_total = 0;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void account_stall(uint64_t start)
+{
+	uint64_t stall = now_us() - start;
+
+	stall_total_us += stall;
+	if (stall > stall_max_us)
+		stall_max_us = stall;
+}
+
+static void sync_path(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	fsync(fd);
+	close(fd);
+}
+
+static void write_job(struct write_job *job)
+{
+	GError *gerr = NULL;
+	char dirname_buf[PATH_MAX];
+
+	__sync_fetch_and_add(&writes_total, 1);
+
+	create_file(job->filename, S_IRUSR | S_IWUSR);
+
+	if (!g_file_set_contents(job->filename, job->data, job->length,
+								&gerr)) {
+		error("Unable to write %s: %s", job->filename, gerr->message);
+		g_error_free(gerr);
+		return;
+	}
+
+	if (!job->sync)
+		return;
+
+	/* Make both the new contents and the rename durable */
+	sync_path(job->filename);
+
+	snprintf(dirname_buf, sizeof(dirname_buf), "%s", job->filename);
+	sync_path(dirname(dirname_buf));
+}
+
+static void *writer_thread(void *user_data)
+{
+	struct write_job *job;
+
+	pthread_mutex_lock(&writer_lock);
+
+	while (1) {
+		while (!job_head && !writer_exit)
+			pthread_cond_wait(&writer_cond, &writer_lock);
+
+		job = job_head;
+		if (!job)
+			break;
+
+		job_head = job->next;
+		if (!job_head)
+			job_tail = NULL;
+
+		if (!job->skip) {
+			job_writing = job->filename;
+			pthread_mutex_unlock(&writer_lock);
+
+			write_job(job);
+
+			pthread_mutex_lock(&writer_lock);
+			job_writing = NULL;
+		}
+
+		jobs_done++;
+		pthread_cond_broadcast(&done_cond);
+
+		g_free(job->filename);
+		g_free(job->data);
+		g_free(job);
+	}
+
+	pthread_mutex_unlock(&writer_lock);
+
+	return NULL;
+}
+
+/* Returns the ticket to wait for to know the job has been written */
+static uint64_t queue_job(const char *filename, char *data, gsize length)
+{
+	struct write_job *job;
+	uint64_t ticket;
+
+	job = g_new0(struct write_job, 1);
+	job->filename = g_strdup(filename);
+	job->data = data;
+	job->length = length;
+
+	pthread_mutex_lock(&writer_lock);
+
+	if (!writer_running) {
+		writer_exit = false;
+		if (pthread_create(&writer, NULL, writer_thread, NULL) == 0)
+			writer_running = true;
+	}
+
+	if (!writer_running) {
+		/* No worker, write it inline rather than lose it */
+		pthread_mutex_unlock(&writer_lock);
+		write_job(job);
+		g_free(job->filename);
+		g_free(job->data);
+		g_free(job);
+		return 0;
+	}
+
+	if (job_tail)
+		job_tail->next = job;
+	else
+		job_head = job;
+	job_tail = job;
+
+	ticket = ++jobs_queued;
+
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+
+	return ticket;
+}
+
+static void wait_for_job(uint64_t ticket)
+{
+	pthread_mutex_lock(&writer_lock);
+
+	while (writer_running && jobs_done < ticket)
+		pthread_cond_wait(&done_cond, &writer_lock);
+
+	pthread_mutex_unlock(&writer_lock);
+}
+
+static void flush_entry(struct keyfile_entry *entry)
+{
+	char *data;
+	gsize length = 0;
+
+	if (!entry->dirty)
+		return;
+
+	data = g_key_file_to_data(entry->key_file, &length, NULL);
+
+	entry->dirty = false;
+
+	entry->ticket = queue_job(entry->filename, data, length);
+}
+
+/*
+ * Writes and syncs the current contents of entry on the calling thread.
+ * Waiting for the worker instead would mean waiting for every other file
+ * queued before it, so the queued copies of this file are skipped, as
+ * they are older, and only a write of it already in progress is waited
+ * for.
+ */
+static void sync_entry(struct keyfile_entry *entry)
+{
+	struct write_job job;
+	struct write_job *l;
+
+	memset(&job, 0, sizeof(job));
+	job.filename = entry->filename;
+	job.data = g_key_file_to_data(entry->key_file, &job.length, NULL);
+	job.sync = true;
+
+	entry->dirty = false;
+
+	pthread_mutex_lock(&writer_lock);
+
+	for (l = job_head; l; l = l->next) {
+		if (!strcmp(l->filename, entry->filename))
+			l->skip = true;
+	}
+
+	while (job_writing && !strcmp(job_writing, entry->filename))
+		pthread_cond_wait(&done_cond, &writer_lock);
+
+	pthread_mutex_unlock(&writer_lock);
+
+	write_job(&job);
+
+	g_free(job.data);
+}
+
+/*
+ * Drops cached files that are clean and no longer being written. Returns
+ * false if some had to be kept for a later pass.
+ */
+static bool evict_clean(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+	uint64_t done;
+	bool all = true;
+
+	pthread_mutex_lock(&writer_lock);
+	done = jobs_done;
+	pthread_mutex_unlock(&writer_lock);
+
+	g_hash_table_iter_init(&iter, keyfiles);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct keyfile_entry *entry = value;
+
+		/* Reloading before the write lands would read old data */
+		if (entry->dirty || entry->ticket > done) {
+			all = false;
+			continue;
+		}
+
+		g_hash_table_iter_remove(&iter);
+	}
+
+	return all;
+}
+
+static gboolean flush_timeout(gpointer user_data);
+
+static void schedule_flush(void)
+{
+	if (!flush_id)
+		flush_id = g_timeout_add(FLUSH_DELAY, flush_timeout, NULL);
+}
+
+static gboolean flush_timeout(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer value;
+	uint64_t start = now_us();
+	unsigned int count = 0;
+
+	flush_id = 0;
+
+	g_hash_table_iter_init(&iter, keyfiles);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct keyfile_entry *entry = value;
+
+		if (!entry->dirty)
+			continue;
+
+		flush_entry(entry);
+		count++;
+	}
+
+	account_stall(start);
+
+	DBG("queued %u files for %llu updates, stall %llu us (max %llu us)",
+				count, (unsigned long long) puts_total,
+				(unsigned long long) stall_total_us,
+				(unsigned long long) stall_max_us);
+
+	if (!evict_clean())
+		schedule_flush();
+
+	return FALSE;
+}
+
+static void entry_free(gpointer data)
+{
+	struct keyfile_entry *entry = data;
+
+	g_key_file_free(entry->key_file);
+	g_free(entry->filename);
+	g_free(entry);
+}
+
+static struct keyfile_entry *entry_get(const char *filename)
+{
+	struct keyfile_entry *entry;
+
+	if (!keyfiles)
+		keyfiles = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, entry_free);
+
+	entry = g_hash_table_lookup(keyfiles, filename);
+	if (entry)
+		return entry;
+
+	entry = g_new0(struct keyfile_entry, 1);
+	entry->filename = g_strdup(filename);
+	entry->key_file = g_key_file_new();
+	g_key_file_load_from_file(entry->key_file, filename, 0, NULL);
+
+	g_hash_table_insert(keyfiles, entry->filename, entry);
+
+	/* Also evicts files that are only ever read */
+	schedule_flush();
+
+	return entry;
+}
+
+/*
+ * Returns the cached keyfile for filename, loading it on first use.
+ *
+ * The keyfile stays owned by the cache and is not reference counted, so
+ * callers must not free it or keep it around. It remains valid until the
+ * first of:
+ *  - the caller returns to the main loop, where the flush may evict it
+ *  - storage_keyfile_remove() of filename or of a directory above it
+ *  - storage_cleanup()
+ * Getting other files in between does not evict anything. After changing
+ * the keyfile, tell the cache with storage_keyfile_put() before any of
+ * the above, or the change is lost.
+ */
+GKeyFile *storage_keyfile_get(const char *filename)
+{
+	return entry_get(filename)->key_file;
+}
+
+/*
+ * Returns the cached keyfile for filename without loading it, or NULL.
+ * Same lifetime as for storage_keyfile_get().
+ */
+GKeyFile *storage_keyfile_lookup(const char *filename)
+{
+	struct keyfile_entry *entry;
+
+	if (!keyfiles)
+		return NULL;
+
+	entry = g_hash_table_lookup(keyfiles, filename);
+
+	return entry ? entry->key_file : NULL;
+}
+
+/*
+ * Hands a keyfile parsed elsewhere, e.g. by a loader thread, over to the
+ * cache, which takes ownership of key_file either way. A copy that is
+ * already cached takes precedence as it may hold changes not yet written
+ * back.
+ */
+void storage_keyfile_adopt(const char *filename, GKeyFile *key_file)
+{
+	struct keyfile_entry *entry;
+
+	if (!keyfiles)
+		keyfiles = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, entry_free);
+
+	if (g_hash_table_lookup(keyfiles, filename)) {
+		g_key_file_free(key_file);
+		return;
+	}
+
+	entry = g_new0(struct keyfile_entry, 1);
+	entry->filename = g_strdup(filename);
+	entry->key_file = key_file;
+
+	g_hash_table_insert(keyfiles, entry->filename, entry);
+
+	schedule_flush();
+}
+
+/*
+ * Marks filename as changed and schedules the write back. Files are
+ * always written whole, the way GKeyFile serialises them.
+ */
+void storage_keyfile_put(const char *filename)
+{
+	struct keyfile_entry *entry = entry_get(filename);
+
+	puts_total++;
+	entry->dirty = true;
+
+	schedule_flush();
+}
+
+/*
+ * Barrier: returns once the current contents of filename are on disk.
+ * Used for keys, which must not be lost to a crash after the kernel has
+ * been told about them.
+ */
+void storage_keyfile_sync(const char *filename)
+{
+	uint64_t start = now_us();
+
+	sync_entry(entry_get(filename));
+
+	account_stall(start);
+}
+
+/*
+ * Drops the cached copies of path, or of every file below it if it is a
+ * directory, and waits for queued writes so none of them recreates a
+ * file the caller is about to delete.
+ */
+void storage_keyfile_remove(const char *path)
+{
+	GHashTableIter iter;
+	gpointer key;
+	size_t len = strlen(path);
+	uint64_t ticket;
+
+	if (keyfiles) {
+		g_hash_table_iter_init(&iter, keyfiles);
+
+		while (g_hash_table_iter_next(&iter, &key, NULL)) {
+			const char *filename = key;
+
+			if (strncmp(filename, path, len) ||
+				(filename[len] != '\0' && filename[len] != '/'))
+				continue;
+
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	ticket = jobs_queued;
+	pthread_mutex_unlock(&writer_lock);
+
+	wait_for_job(ticket);
+}
+
+/* Writes back everything still pending and stops the worker */
+void storage_cleanup(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (flush_id) {
+		g_source_remove(flush_id);
+		flush_id = 0;
+	}
+
+	if (keyfiles) {
+		g_hash_table_iter_init(&iter, keyfiles);
+
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			flush_entry(value);
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	writer_exit = true;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+
+	if (writer_running) {
+		pthread_join(writer, NULL);
+		writer_running = false;
+	}
+
+	if (keyfiles) {
+		g_hash_table_destroy(keyfiles);
+		keyfiles = NULL;
+	}
+
+	DBG("%llu updates, main loop stall %llu us (max %llu us)",
+				(unsigned long long) puts_total,
+				(unsigned long long) stall_total_us,
+				(unsigned long long) stall_max_us);
+}
+
+/* Counters since startup, the same ones the DBG lines report */
+void storage_get_stats(uint64_t *puts, uint64_t *writes,
+				uint64_t *total_us, uint64_t *max_us)
+{
+	if (puts)
+		*puts = puts_total;
+
+	if (writes)
+		*writes = __sync_fetch_and_add(&writes_total, 0);
+
+	if (total_us)
+		*total_us = stall_total_us;
+
+	if (max_us)
+		*max_us = stall_max_us;
+}
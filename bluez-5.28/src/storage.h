@@ -27,3 +27,13 @@ int read_on_mode(const char *src, char *mode, int length);
 int read_local_name(const bdaddr_t *bdaddr, char *name);
 sdp_record_t *record_from_string(const char *str);
 sdp_record_t *find_record_in_list(sdp_list_t *recs, const char *uuid);
+
+GKeyFile *storage_keyfile_get(const char *filename);
+GKeyFile *storage_keyfile_lookup(const char *filename);
+void storage_keyfile_adopt(const char *filename, GKeyFile *key_file);
+void storage_keyfile_put(const char *filename);
+void storage_keyfile_sync(const char *filename);
+void storage_keyfile_remove(const char *path);
+void storage_cleanup(void);
+void storage_get_stats(uint64_t *puts, uint64_t *writes,
+				uint64_t *total_us, uint64_t *max_us);
@@ -28,18 +28,22 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <assert.h>
 #include <glib.h>
 #include <getopt.h>
 #include <signal.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include "lib/uuid.h"
 
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <btio/btio.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "attrib/att.h"
 #include "attrib/gattrib.h"
@@ -49,8 +53,29 @@
 #include "lib/bluetooth.h"
 #include "lib/hci.h"
 #include "lib/hci_lib.h"
+#include "lib/mgmt.h"
 #include "lib/uuid.h"
 
+#include "src/shared/mgmt.h"
+#include "src/shared/btsnoop.h"
+#include "src/shared/trace.h"
+#include "src/shared/metrics.h"
+#include "src/shared/ad-cache.h"
+#include "src/log.h"
+
+#define LE_MAX_MTU		517
+#define SCAN_CACHE_SIZE		4096
+
+/* Connection parameters: intervals in 1.25 ms, timeouts in 10 ms units */
+#define FAST_CONN_MIN_INTERVAL	0x0006	/* 7.5 ms */
+#define FAST_CONN_MAX_INTERVAL	0x000C	/* 15 ms */
+#define FAST_CONN_LATENCY	0x0000
+#define FAST_CONN_TIMEOUT	0x00C8	/* 2 s */
+#define IDLE_CONN_MIN_INTERVAL	0x0190	/* 500 ms */
+#define IDLE_CONN_MAX_INTERVAL	0x0320	/* 1 s */
+#define IDLE_CONN_LATENCY	0x0004
+#define IDLE_CONN_TIMEOUT	0x0C80	/* 32 s */
+
 static GIOChannel *iochannel = NULL;
 static GAttrib *attrib = NULL;
 static GMainLoop *event_loop;
@@ -65,7 +90,38 @@ static int opt_handle = -1;
 static int opt_start = 0x0001;
 static int opt_end = 0xffff;
 static int opt_mtu = 0;
+static int opt_req_mtu = LE_MAX_MTU;
+static struct timespec op_start;
+static struct timespec connect_start;
+static gchar *opt_replay = NULL;
+static gboolean opt_realtime = FALSE;
+static gchar *opt_latency = NULL;
+static gchar *opt_metrics = NULL;
+static gboolean opt_no_cache = FALSE;
+static gboolean opt_no_prefilter = FALSE;
+static gboolean opt_stream = FALSE;
+static gboolean opt_verbose = FALSE;
+static gchar *opt_btsnoop = NULL;
+static unsigned long opt_btsnoop_size = 0;
+static unsigned int opt_btsnoop_time = 0;
+static unsigned int opt_btsnoop_files = 0;
+static struct btsnoop *capture = NULL;
+
+/* Reports that reach the parser are printed with their AD fields, except
+ * while replaying a capture without --verbose, so the replay measures the
+ * report path and not the terminal. */
+static gboolean print_reports = TRUE;
+static struct ad_cache *scan_cache = NULL;
+static struct timespec scan_start;
+static struct timespec connect_done;
+static enum conn_policy {
+	CONN_POLICY_DEFAULT = 0,	/* Leave the parameters to the kernel */
+	CONN_POLICY_FAST,		/* Fast while provisioning, then disconnect */
+	CONN_POLICY_RELAX,		/* Fast while provisioning, then relax */
+} opt_conn_policy = CONN_POLICY_DEFAULT;
 static struct hci_dev_info di;
+static struct mgmt *mgmt_ctrl = NULL;
+static uint16_t mgmt_index = MGMT_INDEX_NONE;
 static const int opt_psm = 0;
 
 static gboolean opt_listen = FALSE;
@@ -486,6 +542,313 @@ static void gatts_exec_write_req(const uint8_t *pdu, uint16_t len, gpointer user
 		g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
+static void op_timer_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &op_start);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+				(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void op_timer_report(const char *op)
+{
+	printf("# %s took %ld ms at MTU %d\n", op, elapsed_ms(&op_start),
+								opt_mtu);
+}
+
+/*
+ * Per phase latency histograms, HDR style: 16 linear sub-buckets for every
+ * power of two of microseconds, which keeps the value error under 6.25%
+ * with a fixed size table. They are kept per device and over all devices,
+ * and dumped as JSON lines with the raw buckets so runs can be merged.
+ */
+enum phase {
+	PHASE_SCAN,
+	PHASE_GATT_CONNECT,
+	PHASE_CONNECT_CB,
+	PHASE_DISCOVER_CHAR,
+	PHASE_WRITE,
+	PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {
+	"scan", "gatt_connect", "connect_cb", "discover_char", "write"
+};
+
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		(64 * HIST_SUB)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct phase_stats {
+	struct histogram phases[PHASE_MAX];
+};
+
+static struct phase_stats all_stats;
+static GHashTable *device_stats = NULL;
+static volatile sig_atomic_t latency_dump_requested = 0;
+
+static unsigned int hist_index(uint64_t value)
+{
+	unsigned int msb, shift;
+
+	if (value < HIST_SUB)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+/* Highest value that falls into the bucket */
+static uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB)
+		return index;
+
+	shift = index / HIST_SUB - 1;
+
+	return (((uint64_t) HIST_SUB + index % HIST_SUB) << shift) +
+						((uint64_t) 1 << shift) - 1;
+}
+
+static void hist_record(struct histogram *hist, uint64_t value)
+{
+	hist->counts[hist_index(value)]++;
+
+	if (!hist->total || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+
+	hist->total++;
+	hist->sum += value;
+}
+
+static uint64_t hist_percentile(const struct histogram *hist,
+							double percentile)
+{
+	uint64_t target, count = 0;
+	unsigned int i;
+
+	target = (uint64_t) (hist->total * percentile / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		count += hist->counts[i];
+		if (count >= target)
+			return MIN(hist_value(i), hist->max);
+	}
+
+	return hist->max;
+}
+
+static uint64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+				(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void phase_record(enum phase phase, const char *addr,
+					const struct timespec *start)
+{
+	struct phase_stats *stats;
+	uint64_t value = elapsed_us(start);
+
+	hist_record(&all_stats.phases[phase], value);
+
+	if (addr == NULL)
+		return;
+
+	if (device_stats == NULL)
+		device_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+
+	stats = g_hash_table_lookup(device_stats, addr);
+	if (stats == NULL) {
+		stats = g_new0(struct phase_stats, 1);
+		g_hash_table_insert(device_stats, g_strdup(addr), stats);
+	}
+
+	hist_record(&stats->phases[phase], value);
+}
+
+static void phase_dump(FILE *fp, const char *addr,
+					const struct phase_stats *stats)
+{
+	const struct histogram *hist;
+	unsigned int i, j;
+	const char *sep;
+
+	for (i = 0; i < PHASE_MAX; i++) {
+		hist = &stats->phases[i];
+		if (!hist->total)
+			continue;
+
+		fprintf(fp, "{\"device\":\"%s\",\"phase\":\"%s\","
+			"\"count\":%llu,\"min_us\":%llu,\"max_us\":%llu,"
+			"\"mean_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,"
+			"\"p99_us\":%llu,\"p999_us\":%llu,\"buckets\":[",
+			addr, phase_names[i],
+			(unsigned long long) hist->total,
+			(unsigned long long) hist->min,
+			(unsigned long long) hist->max,
+			(unsigned long long) (hist->sum / hist->total),
+			(unsigned long long) hist_percentile(hist, 50),
+			(unsigned long long) hist_percentile(hist, 90),
+			(unsigned long long) hist_percentile(hist, 99),
+			(unsigned long long) hist_percentile(hist, 99.9));
+
+		for (j = 0, sep = ""; j < HIST_BUCKETS; j++) {
+			if (!hist->counts[j])
+				continue;
+
+			fprintf(fp, "%s[%llu,%llu]", sep,
+				(unsigned long long) hist_value(j),
+				(unsigned long long) hist->counts[j]);
+			sep = ",";
+		}
+
+		fprintf(fp, "]}\n");
+	}
+}
+
+static void latency_dump(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	FILE *fp;
+
+	if (opt_latency == NULL)
+		return;
+
+	if (!strcmp(opt_latency, "-"))
+		fp = stdout;
+	else
+		fp = fopen(opt_latency, "a");
+
+	if (fp == NULL) {
+		perror("Could not open latency file");
+		return;
+	}
+
+	phase_dump(fp, "all", &all_stats);
+
+	if (device_stats) {
+		g_hash_table_iter_init(&iter, device_stats);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			phase_dump(fp, key, value);
+	}
+
+	if (fp == stdout)
+		fflush(fp);
+	else
+		fclose(fp);
+}
+
+static void latency_check_dump(void)
+{
+	if (!latency_dump_requested)
+		return;
+
+	latency_dump_requested = 0;
+	latency_dump();
+}
+
+static void sigusr1_handler(int sig)
+{
+	latency_dump_requested = 1;
+}
+
+static gboolean latency_dump_timeout(gpointer user_data)
+{
+	latency_check_dump();
+
+	return TRUE;
+}
+
+static void load_conn_params_complete(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	if (status != MGMT_STATUS_SUCCESS)
+		printf("# Load Connection Parameters failed: %s (0x%02x)\n",
+						mgmt_errstr(status), status);
+}
+
+/*
+ * Hand the connection parameters for opt_dst to the kernel through the
+ * management interface. The kernel owns the LE link, so it is the one that
+ * creates the connection with them, and it accepts updates requested by the
+ * node within the same limits. A link that is already up keeps the
+ * parameters it was created with, bt_io_set_le_conn_params() moves it.
+ */
+static gboolean set_conn_params(uint16_t min_interval, uint16_t max_interval,
+				uint16_t latency, uint16_t timeout,
+				mgmt_request_func_t callback)
+{
+	struct {
+		struct mgmt_cp_load_conn_param cp;
+		struct mgmt_conn_param param;
+	} __packed buf;
+
+	if (opt_conn_policy == CONN_POLICY_DEFAULT || opt_dst == NULL ||
+					mgmt_index == MGMT_INDEX_NONE)
+		return FALSE;
+
+	if (mgmt_ctrl == NULL) {
+		mgmt_ctrl = mgmt_new_default();
+		if (mgmt_ctrl == NULL) {
+			printf("# Failed to open management socket\n");
+			return FALSE;
+		}
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	buf.cp.param_count = htobs(1);
+	str2ba(opt_dst, &buf.param.addr.bdaddr);
+	if (opt_dst_type && strcmp(opt_dst_type, "random") == 0)
+		buf.param.addr.type = BDADDR_LE_RANDOM;
+	else
+		buf.param.addr.type = BDADDR_LE_PUBLIC;
+	buf.param.min_interval = htobs(min_interval);
+	buf.param.max_interval = htobs(max_interval);
+	buf.param.latency = htobs(latency);
+	buf.param.timeout = htobs(timeout);
+
+	if (callback == NULL)
+		callback = load_conn_params_complete;
+
+	if (mgmt_send(mgmt_ctrl, MGMT_OP_LOAD_CONN_PARAM, mgmt_index,
+				sizeof(buf), &buf, callback, NULL, NULL) == 0) {
+		printf("# Load Connection Parameters failed\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static int strtohandle(const char *src)
 {
 	char *e;
@@ -499,10 +862,90 @@ static int strtohandle(const char *src)
 	return dst;
 }
 
+static uint64_t trace_dst(void)
+{
+	bdaddr_t ba;
+
+	if (opt_dst == NULL || str2ba(opt_dst, &ba) < 0)
+		return 0;
+
+	return trace_bdaddr(ba.b);
+}
+
+static void trace_print(const char *str, void *user_data)
+{
+	printf("%s\n", str);
+}
+
+static void trace_decode_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Could not open trace file");
+		exit(1);
+	}
+
+	if (!trace_decode(fd, trace_print, NULL)) {
+		fprintf(stderr, "Invalid trace file %s\n", path);
+		close(fd);
+		exit(1);
+	}
+
+	close(fd);
+	exit(0);
+}
+
+static void start_operation(void)
+{
+	phase_record(PHASE_CONNECT_CB, opt_dst, &connect_done);
+	op_timer_start();
+	operation(attrib);
+}
+
+static void exchange_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	uint16_t mtu;
+
+	if (status != 0) {
+		printf("# Exchange MTU failed: %s\n", att_ecode2str(status));
+		goto done;
+	}
+
+	if (!dec_mtu_resp(pdu, plen, &mtu)) {
+		resp_error(err_PROTO_ERR);
+		goto done;
+	}
+
+	mtu = MIN(mtu, GPOINTER_TO_UINT(user_data));
+	if (mtu < ATT_DEFAULT_LE_MTU)
+		mtu = ATT_DEFAULT_LE_MTU;
+
+	if (g_attrib_set_mtu(attrib, mtu))
+		opt_mtu = mtu;
+	else
+		printf("# Could not resize ATT buffers to MTU %d\n", mtu);
+
+done:
+	/* Discovery and writes go ahead at whatever MTU is now in effect */
+	cmd_status(0, 0, NULL);
+	start_operation();
+}
+
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
 	uint16_t mtu;
 	uint16_t cid;
+	uint16_t local_mtu;
+
+	trace_point(TRACE_CONNECT_DONE, err ? 1 : 0, trace_dst(),
+						elapsed_ms(&connect_start));
+
+	clock_gettime(CLOCK_MONOTONIC, &connect_done);
+	phase_record(PHASE_GATT_CONNECT, opt_dst, &connect_start);
+
 	if (err) {
 		set_state(STATE_DISCONNECTED);
 		resp_error(err_CONN_FAIL);
@@ -512,6 +955,20 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 	bt_io_get(io, &err, BT_IO_OPT_IMTU, &mtu,
                 BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
 
+	if (err) {
+		g_error_free(err);
+		err = NULL;
+		mtu = ATT_DEFAULT_LE_MTU;
+		cid = ATT_CID;
+	}
+
+	/* The LE fixed channel starts at the default ATT MTU, whatever the
+	 * socket reports, until an Exchange MTU has been completed. */
+	local_mtu = MIN(mtu, opt_req_mtu);
+	if (cid == ATT_CID)
+		mtu = ATT_DEFAULT_LE_MTU;
+
+	opt_mtu = mtu;
 	attrib = g_attrib_new(io,mtu);
 	g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
 						events_handler, attrib, NULL);
@@ -543,8 +1000,13 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 	                  gatts_exec_write_req, attrib, NULL);
 
 	set_state(STATE_CONNECTED);
-	operation(attrib);
-	
+
+	if (cid == ATT_CID && local_mtu > ATT_DEFAULT_LE_MTU &&
+			gatt_exchange_mtu(attrib, local_mtu, exchange_mtu_cb,
+					GUINT_TO_POINTER(local_mtu)))
+		return;
+
+	start_operation();
 }
 
 static void disconnect_io()
@@ -651,19 +1113,18 @@ struct le_devices eir_parse_name(uint8_t *eir, size_t eir_len,
 
 			memcpy(buf, &eir[2], name_len);
 			int i;
-		    for(i=1; i<field_len; i++)
-		    {
-		      printf("\tData: 0x%0X\n", eir[i]);
-		    }
+			if (print_reports)
+				for (i = 1; i < field_len; i++)
+					printf("\tData: 0x%0X\n", eir[i]);
 			break;
 		}
 		case EIR_FLAGS:
 		{
-			printf("Flag type: len=%02X\n", field_len);
 		    int i;
-		    for(i=1; i<field_len; i++)
-		    {
-		      printf("\tFlag data: 0x%0X\n", eir[i]);
+		    if (print_reports) {
+			printf("Flag type: len=%02X\n", field_len);
+			for (i = 1; i < field_len; i++)
+				printf("\tFlag data: 0x%0X\n", eir[i]);
 		    }
 		    break;
 		}
@@ -676,11 +1137,11 @@ struct le_devices eir_parse_name(uint8_t *eir, size_t eir_len,
 		case EIR_UUID128_ALL:
 		case EIR_MANUFACTURE_SPECIFIC:
 		{
-			printf("type: %02X len: %02X \n",eir[1],field_len);
 		    int i;
-		    for(i=2; i<field_len; i++)
-		    {
-		      printf("\tData: 0x%0X\n", eir[i]);
+		    if (print_reports) {
+			printf("type: %02X len: %02X \n",eir[1],field_len);
+			for (i = 2; i < field_len; i++)
+				printf("\tData: 0x%0X\n", eir[i]);
 		    }
 		    if(EIR_MANUFACTURE_SPECIFIC)
 		    {
@@ -736,15 +1197,12 @@ static gboolean channel_watcher(GIOChannel *chan, GIOCondition cond,
 
 	return FALSE;
 }
-static void le_connect( )
+static void le_connect_start(void)
 {
 	GError *gerr = NULL;
-	if (opt_dst == NULL) {
-		error("Remote Bluetooth address required\n");
-		resp_error(err_BAD_PARAM);
-		return;
-	}
-	set_state(STATE_CONNECTING);
+
+	clock_gettime(CLOCK_MONOTONIC, &connect_start);
+	trace_point(TRACE_CONNECT_START, 0, trace_dst(), 0);
 	iochannel = gatt_connect(opt_src, opt_dst, opt_dst_type, opt_sec_level,
 						opt_psm, opt_mtu, connect_cb,&gerr);
 
@@ -755,6 +1213,605 @@ static void le_connect( )
 		g_io_add_watch(iochannel, G_IO_HUP, channel_watcher, NULL);
 }
 
+static void fast_params_loaded(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	load_conn_params_complete(status, length, param, user_data);
+
+	le_connect_start();
+}
+
+static void le_connect( )
+{
+	if (opt_dst == NULL) {
+		error("Remote Bluetooth address required\n");
+		resp_error(err_BAD_PARAM);
+		return;
+	}
+	set_state(STATE_CONNECTING);
+
+	/* Discovery and writes are latency bound, so have the kernel create
+	 * the link on a short interval. The connection is only started once
+	 * the parameters are in place. */
+	if (set_conn_params(FAST_CONN_MIN_INTERVAL, FAST_CONN_MAX_INTERVAL,
+				FAST_CONN_LATENCY, FAST_CONN_TIMEOUT,
+				fast_params_loaded))
+		return;
+
+	le_connect_start();
+}
+
+enum {
+	SCAN_METRIC_ADVERTS_SEEN,
+	SCAN_METRIC_ADVERTS_FILTERED,
+	SCAN_METRIC_ADVERTS_MATCHED,
+};
+
+static const struct metrics_desc scan_metrics_desc[] = {
+	{ "adverts_seen_total", "Advertising reports received",
+							METRICS_COUNTER },
+	{ "adverts_filtered_total", "Advertising reports without "
+				"provisioning manufacturer data",
+							METRICS_COUNTER },
+	{ "adverts_matched_total", "Advertising reports from nodes waiting "
+				"to be provisioned", METRICS_COUNTER },
+};
+
+static const struct metrics_family scan_metrics_family = {
+	.subsystem = "scan",
+	.desc = scan_metrics_desc,
+	.num_desc = sizeof(scan_metrics_desc) / sizeof(scan_metrics_desc[0]),
+};
+
+static struct metrics *scan_metrics = NULL;
+
+/*
+ * Cheap first pass over the AD structures of a report: only adverts with
+ * manufacturer specific data for MANU_TYPE whose trailing status byte is
+ * one we act on can match, so everything else is dropped here without
+ * touching the cache or the full parser. Legacy AD payloads are at most
+ * 31 bytes, so a plain walk of the length prefixes is all it takes.
+ */
+static bool manufacturer_prefilter(const uint8_t *data, size_t size)
+{
+	size_t offset = 0;
+
+	while (offset + 1 < size) {
+		uint8_t len = data[offset];
+		const uint8_t *field = data + offset + 1;
+
+		if (len == 0 || offset + 1 + len > size)
+			break;
+
+		/* Type, two company ID bytes and the status byte */
+		if (len >= 4 && field[0] == EIR_MANUFACTURE_SPECIFIC &&
+				field[1] == (MANU_TYPE & 0xff) &&
+				field[2] == (MANU_TYPE >> 8)) {
+			uint8_t status = field[len - 1];
+
+			return status == DEV_UNCONFIGURED ||
+						status == DEV_CONFIGURED;
+		}
+
+		offset += 1 + len;
+	}
+
+	return false;
+}
+
+/* Why a payload stored in the advertising cache did not match */
+enum {
+	REPORT_FILTERED,	/* Rejected by manufacturer_prefilter() */
+	REPORT_NO_MATCH,	/* Parsed, not from a node to provision */
+};
+
+/* Returns 1 when the report comes from a node waiting to be provisioned */
+static int handle_advertising_report(le_advertising_info *info,
+							uint8_t filter_type)
+{
+	char addr[18];
+	char name[30];
+	uint8_t verdict;
+
+	/* The RSSI byte trails the report data */
+	trace_point(TRACE_SCAN_REPORT, info->evt_type,
+				trace_bdaddr(info->bdaddr.b),
+				(int8_t) info->data[info->length]);
+
+	metrics_inc(scan_metrics, SCAN_METRIC_ADVERTS_SEEN);
+
+	/*
+	 * Only payloads that did not match are cached, so a payload seen
+	 * before from the same address cannot match either. Advertising and
+	 * scan response reports are kept apart so they do not evict each
+	 * other.
+	 */
+	if (ad_cache_lookup(scan_cache, info->bdaddr.b,
+				(info->evt_type << 1) | info->bdaddr_type,
+				info->data, info->length,
+				(int8_t) info->data[info->length], &verdict)) {
+		if (verdict == REPORT_FILTERED)
+			metrics_inc(scan_metrics,
+					SCAN_METRIC_ADVERTS_FILTERED);
+		return 0;
+	}
+
+	if (!opt_no_prefilter &&
+			!manufacturer_prefilter(info->data, info->length)) {
+		metrics_inc(scan_metrics, SCAN_METRIC_ADVERTS_FILTERED);
+		verdict = REPORT_FILTERED;
+		goto nomatch;
+	}
+
+	verdict = REPORT_NO_MATCH;
+
+	if (!check_report_filter(filter_type, info))
+		goto nomatch;
+
+	memset(name, 0, sizeof(name));
+	le_devices.bdaddr = info->bdaddr;
+	ba2str(&le_devices.bdaddr, addr);;
+
+	le_devices = eir_parse_name(info->data, info->length,
+					name, sizeof(name) - 1);
+
+	if (print_reports)
+		printf("%s %s\n", addr,name);
+	if(le_devices.manufacturer == MANU_TYPE)
+	{
+		if(le_devices.status == DEV_UNCONFIGURED | le_devices.status == DEV_CONFIGURED)
+		{
+			check_configuration(le_devices.type,le_devices.status);
+			phase_record(PHASE_SCAN, addr, &scan_start);
+			metrics_inc(scan_metrics, SCAN_METRIC_ADVERTS_MATCHED);
+			return 1;
+		}
+	}
+
+nomatch:
+	ad_cache_store(scan_cache, info->bdaddr.b,
+				(info->evt_type << 1) | info->bdaddr_type,
+				info->data, info->length,
+				(int8_t) info->data[info->length], verdict);
+
+	return 0;
+}
+
+/*
+ * In active scan a scannable advert is held back for a short while so
+ * that the scan response answering it can be matched together with it:
+ * identifying data split across the two is then seen in one report and
+ * evaluated once. Adverts nobody answers are evaluated alone once their
+ * wait runs out.
+ *
+ * Held adverts live in a ring in arrival order. Every advert waits the
+ * same time, so the ring is in deadline order too and the next one due
+ * is always at its head. Adverts are found by address through a small
+ * chained hash, so no report walks the whole table.
+ */
+#define MERGE_SLOTS		64
+#define MERGE_BUCKETS		64
+#define MERGE_WAIT_MS		50
+#define MERGE_AD_LEN		31
+
+#define ADV_IND			0x00
+#define ADV_SCAN_IND		0x02
+#define SCAN_RSP		0x04
+
+struct merge_entry {
+	bool used;
+	unsigned int next;	/* Next slot + 1 in the bucket, 0 if none */
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t evt_type;
+	uint8_t length;
+	uint8_t data[MERGE_AD_LEN];
+	int8_t rssi;
+	int64_t deadline;
+};
+
+static bool scan_merge = false;
+static struct merge_entry merge_table[MERGE_SLOTS];
+static unsigned int merge_buckets[MERGE_BUCKETS];	/* Slot + 1 */
+static unsigned int merge_head = 0;
+static unsigned int merge_tail = 0;
+static unsigned int merge_pending = 0;
+
+static int64_t merge_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Length of the AD structures up to a zero length terminator */
+static size_t ad_significant_len(const uint8_t *data, size_t size)
+{
+	size_t offset = 0;
+
+	while (offset < size) {
+		uint8_t len = data[offset];
+
+		if (len == 0 || offset + 1 + len > size)
+			break;
+
+		offset += 1 + len;
+	}
+
+	return offset;
+}
+
+static unsigned int *merge_bucket(const bdaddr_t *bdaddr,
+							uint8_t bdaddr_type)
+{
+	unsigned int hash = bdaddr_type;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		hash = hash * 31 + bdaddr->b[i];
+
+	return &merge_buckets[hash % MERGE_BUCKETS];
+}
+
+static struct merge_entry *merge_lookup(const le_advertising_info *info)
+{
+	unsigned int slot = *merge_bucket(&info->bdaddr, info->bdaddr_type);
+
+	while (slot) {
+		struct merge_entry *entry = &merge_table[slot - 1];
+
+		if (entry->bdaddr_type == info->bdaddr_type &&
+				!bacmp(&entry->bdaddr, &info->bdaddr))
+			return entry;
+
+		slot = entry->next;
+	}
+
+	return NULL;
+}
+
+static void merge_release(struct merge_entry *entry)
+{
+	unsigned int *link = merge_bucket(&entry->bdaddr, entry->bdaddr_type);
+	unsigned int slot = entry - merge_table + 1;
+
+	while (*link != slot)
+		link = &merge_table[*link - 1].next;
+
+	*link = entry->next;
+	entry->used = false;
+	merge_pending--;
+
+	/* Keep a held advert at the head of the ring */
+	while (merge_head != merge_tail &&
+			!merge_table[merge_head % MERGE_SLOTS].used)
+		merge_head++;
+}
+
+/*
+ * Evaluate a held advert, with the scan response appended when there is
+ * one, and release its slot.
+ */
+static int merge_complete(struct merge_entry *entry,
+				const le_advertising_info *rsp,
+				uint8_t filter_type)
+{
+	uint8_t buf[LE_ADVERTISING_INFO_SIZE + 2 * MERGE_AD_LEN + 1];
+	le_advertising_info *info = (void *) buf;
+	int8_t rssi = entry->rssi;
+	size_t len;
+
+	info->evt_type = entry->evt_type;
+	info->bdaddr_type = entry->bdaddr_type;
+	bacpy(&info->bdaddr, &entry->bdaddr);
+
+	len = ad_significant_len(entry->data, entry->length);
+	memcpy(info->data, entry->data, len);
+
+	if (rsp) {
+		size_t rsp_len = ad_significant_len(rsp->data,
+					MIN(rsp->length, MERGE_AD_LEN));
+
+		memcpy(info->data + len, rsp->data, rsp_len);
+		len += rsp_len;
+		rssi = (int8_t) rsp->data[rsp->length];
+	}
+
+	info->length = len;
+	info->data[len] = (uint8_t) rssi;
+
+	merge_release(entry);
+
+	return handle_advertising_report(info, filter_type);
+}
+
+/* Evaluate held adverts whose wait is over, or all of them */
+static int merge_flush(uint8_t filter_type, bool all)
+{
+	int64_t now = merge_now_ms();
+	int matches = 0;
+
+	while (merge_head != merge_tail) {
+		struct merge_entry *entry;
+
+		entry = &merge_table[merge_head % MERGE_SLOTS];
+		if (!all && entry->deadline > now)
+			break;
+
+		matches += merge_complete(entry, NULL, filter_type);
+	}
+
+	return matches;
+}
+
+/* Milliseconds until the next held advert is due, capped at max if set */
+static int merge_timeout(int max)
+{
+	int64_t wait = max ? max : INT_MAX;
+
+	if (merge_head != merge_tail)
+		wait = MIN(wait, MAX(merge_table[merge_head %
+				MERGE_SLOTS].deadline - merge_now_ms(), 0));
+
+	return wait;
+}
+
+static void merge_store(struct merge_entry *entry,
+					const le_advertising_info *info)
+{
+	entry->evt_type = info->evt_type;
+	entry->length = MIN(info->length, MERGE_AD_LEN);
+	memcpy(entry->data, info->data, entry->length);
+	entry->rssi = (int8_t) info->data[info->length];
+}
+
+static int merge_advertising_report(le_advertising_info *info,
+							uint8_t filter_type)
+{
+	struct merge_entry *entry;
+	unsigned int *bucket;
+	int matches = 0;
+
+	if (!scan_merge)
+		return handle_advertising_report(info, filter_type);
+
+	switch (info->evt_type) {
+	case ADV_IND:
+	case ADV_SCAN_IND:
+		/*
+		 * A repeated advert replaces the data of the one still
+		 * waiting, but the wait still ends when the first was due.
+		 */
+		entry = merge_lookup(info);
+		if (entry) {
+			merge_store(entry, info);
+			return 0;
+		}
+
+		/* Ring full: the longest waiting advert goes alone */
+		if (merge_tail - merge_head == MERGE_SLOTS)
+			matches = merge_complete(
+				&merge_table[merge_head % MERGE_SLOTS], NULL,
+				filter_type);
+
+		/* Everything before the head has been released */
+		entry = &merge_table[merge_tail++ % MERGE_SLOTS];
+		entry->used = true;
+		entry->bdaddr_type = info->bdaddr_type;
+		bacpy(&entry->bdaddr, &info->bdaddr);
+		entry->deadline = merge_now_ms() + MERGE_WAIT_MS;
+
+		bucket = merge_bucket(&info->bdaddr, info->bdaddr_type);
+		entry->next = *bucket;
+		*bucket = entry - merge_table + 1;
+
+		merge_store(entry, info);
+		merge_pending++;
+
+		return matches;
+	case SCAN_RSP:
+		entry = merge_lookup(info);
+		if (entry)
+			return merge_complete(entry, info, filter_type);
+		/* fall through */
+	default:
+		return handle_advertising_report(info, filter_type);
+	}
+}
+
+static void merge_reset(void)
+{
+	memset(merge_table, 0, sizeof(merge_table));
+	memset(merge_buckets, 0, sizeof(merge_buckets));
+	merge_head = 0;
+	merge_tail = 0;
+	merge_pending = 0;
+}
+
+/*
+ * Walks the reports of an LE Advertising Report event, stopping at the
+ * first match when first_match is set. Returns the number of matches and
+ * stores the number of reports handled in reports.
+ */
+static int handle_advertising_event(evt_le_meta_event *meta, int len,
+					uint8_t filter_type,
+					gboolean first_match, int *reports)
+{
+	le_advertising_info *info;
+	uint8_t num_reports;
+	uint8_t *end = (uint8_t *) meta + len;
+	int i, matches = 0;
+
+	*reports = 0;
+
+	if (len < 2)
+		return 0;
+
+	if (merge_pending)
+		matches = merge_flush(filter_type, false);
+
+	if (matches && first_match)
+		return matches;
+
+	num_reports = meta->data[0];
+	info = (le_advertising_info *) (meta->data + 1);
+
+	for (i = 0; i < num_reports; i++) {
+		if ((uint8_t *) info + LE_ADVERTISING_INFO_SIZE > end ||
+				info->data + info->length + 1 > end)
+			break;
+
+		(*reports)++;
+
+		if (merge_advertising_report(info, filter_type)) {
+			matches++;
+			if (first_match)
+				break;
+		}
+
+		/* The RSSI byte trails the data of each report */
+		info = (le_advertising_info *) (info->data + info->length + 1);
+	}
+
+	return matches;
+}
+
+/*
+ * Wait up to timeout ms (-1 for ever) for the HCI socket to become
+ * readable, dispatching the sources of the default main context in the
+ * meantime so that timers and the metrics endpoint keep running while
+ * scanning. Returns 1 when the socket is readable, 0 on timeout and -1
+ * with errno set on error, like poll().
+ */
+static int scan_poll(int dd, int timeout)
+{
+	GMainContext *context = g_main_context_default();
+	struct timespec start;
+	GPollFD *fds = NULL;
+	gint priority, context_timeout, nfds, wait, n;
+	int err = 0, ret = 0;
+
+	if (!g_main_context_acquire(context)) {
+		struct pollfd p = { .fd = dd, .events = POLLIN };
+
+		return poll(&p, 1, timeout);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (1) {
+		g_main_context_prepare(context, &priority);
+
+		nfds = g_main_context_query(context, priority,
+						&context_timeout, NULL, 0);
+		fds = g_renew(GPollFD, fds, nfds + 1);
+		nfds = g_main_context_query(context, priority,
+					&context_timeout, fds + 1, nfds);
+
+		fds[0].fd = dd;
+		fds[0].events = G_IO_IN;
+		fds[0].revents = 0;
+
+		wait = timeout;
+		if (timeout >= 0) {
+			wait = timeout - elapsed_ms(&start);
+			if (wait < 0)
+				wait = 0;
+		}
+
+		if (context_timeout >= 0 &&
+				(wait < 0 || context_timeout < wait))
+			wait = context_timeout;
+
+		n = g_poll(fds, nfds + 1, wait);
+		if (n < 0)
+			err = errno;
+
+		if (g_main_context_check(context, priority, fds + 1, nfds))
+			g_main_context_dispatch(context);
+
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+
+		if (fds[0].revents) {
+			ret = 1;
+			break;
+		}
+
+		if (timeout >= 0 && elapsed_ms(&start) >= timeout)
+			break;
+	}
+
+	g_free(fds);
+	g_main_context_release(context);
+
+	if (ret < 0)
+		errno = err;
+
+	return ret;
+}
+
+/*
+ * Every event read on the scan socket is recorded when --btsnoop is given.
+ * The buffered writer only copies the record into its ring here, the file
+ * is written from its own thread.
+ */
+static void capture_event(const unsigned char *buf, int len)
+{
+	struct timeval tv;
+
+	if (!capture || len < 1)
+		return;
+
+	gettimeofday(&tv, NULL);
+	btsnoop_write_hci(capture, &tv, 0, BTSNOOP_OPCODE_EVENT_PKT,
+							buf + 1, len - 1);
+}
+
+static void capture_close(void)
+{
+	if (btsnoop_get_drops(capture))
+		fprintf(stderr, "# capture: %u packets dropped\n",
+						btsnoop_get_drops(capture));
+
+	btsnoop_unref(capture);
+	capture = NULL;
+}
+
+static int capture_open(const char *path)
+{
+	/* Rotating captures are always buffered, they rotate on the writer */
+	if (opt_btsnoop_size || opt_btsnoop_time) {
+		capture = btsnoop_create_rotating(path, BTSNOOP_TYPE_MONITOR,
+					opt_btsnoop_size, opt_btsnoop_time,
+					opt_btsnoop_files);
+		if (!capture)
+			return -errno;
+
+		atexit(capture_close);
+
+		return 0;
+	}
+
+	capture = btsnoop_create(path, BTSNOOP_TYPE_MONITOR);
+	if (!capture)
+		return -errno;
+
+	if (!btsnoop_set_buffered(capture, 0, true)) {
+		btsnoop_unref(capture);
+		capture = NULL;
+		return -ENOMEM;
+	}
+
+	atexit(capture_close);
+
+	return 0;
+}
+
 static int print_advertising_devices(int dd, uint8_t filter_type)
 {
 	
@@ -789,20 +1846,28 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 	while(1)
 	{
 		evt_le_meta_event *meta;
-		le_advertising_info *info;
-		char addr[18];
+		int reports;
 
-		 if (to) {
-              struct pollfd p;
-             int n;
+		 if (to || merge_pending || scan_metrics) {
+             int n, wait = merge_pending ? merge_timeout(to) :
+                                                         (to ? to : -1);
  
-             p.fd = dd; p.events = POLLIN;
-             while ((n = poll(&p, 1, to)) < 0) {
+             while ((n = scan_poll(dd, wait)) < 0) {
+                 latency_check_dump();
                  if (errno == EAGAIN || errno == EINTR)
                      continue;
                  goto done;
              }
  
+             /* Held adverts whose scan response never came */
+             if (!n && merge_pending && (!to || wait < to)) {
+                 if (merge_flush(filter_type, false) > 0) {
+                     flags_connect = FLAGS_CONNECT;
+                     goto done;
+                 }
+                 continue;
+             }
+
              if (!n) {
                  errno = ETIMEDOUT;
                  goto done;
@@ -825,6 +1890,8 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 
 		}
 
+		capture_event(buf, len);
+
 		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
 		len -= (1 + HCI_EVENT_HDR_SIZE);
 
@@ -833,32 +1900,14 @@ static int print_advertising_devices(int dd, uint8_t filter_type)
 		if (meta->subevent != 0x02)
 			goto done;
 
-		/* Ignoring multiple reports */
-		info = (le_advertising_info *) (meta->data + 1);
-
-		if (check_report_filter(filter_type, info)) {
-			char name[30];
-
-			memset(name, 0, sizeof(name));
-			le_devices.bdaddr = info->bdaddr;
-			ba2str(&le_devices.bdaddr, addr);;
-
-			le_devices = eir_parse_name(info->data, info->length,
-							name, sizeof(name) - 1);
-
-			printf("%s %s\n", addr,name);
-			if(le_devices.manufacturer == MANU_TYPE)
-			{
-				if(le_devices.status == DEV_UNCONFIGURED | le_devices.status == DEV_CONFIGURED)
-				{
-					flags_connect = FLAGS_CONNECT;
-					check_configuration(le_devices.type,le_devices.status);
-					goto done;
-				}
-			}
+		if (handle_advertising_event(meta, len, filter_type, TRUE,
+							&reports) > 0) {
+			flags_connect = FLAGS_CONNECT;
+			goto done;
 		}
 	}
 done:
+	merge_reset();
 	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
 
 	if (len < 0)
@@ -867,10 +1916,202 @@ done:
 	return 0; 	
 }
 
+/*
+ * Replay of captured advertising traffic. A feeder thread pushes the LE
+ * Advertising Report events of a btsnoop file into one end of a socketpair
+ * while the scanner's report handling consumes the other end, exactly as
+ * it would consume the HCI socket. The send time of every event is kept in
+ * a ring so the consumer can compute how long each match took.
+ */
+#define REPLAY_RING	8192
+
+struct replay {
+	struct btsnoop *snoop;
+	int fd;
+	gboolean realtime;
+	int64_t sent[REPLAY_RING];
+	unsigned int head;
+	unsigned int tail;
+	unsigned long events;
+};
+
+static int64_t ts_us(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static void *replay_feeder(void *user_data)
+{
+	struct replay *replay = user_data;
+	unsigned char buf[1 + BTSNOOP_MAX_PACKET_SIZE];
+	struct timespec start, now;
+	struct timeval tv;
+	int64_t first = -1, offset;
+	uint16_t index, opcode, size;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (btsnoop_read_hci(replay->snoop, &tv, &index, &opcode,
+							buf + 1, &size)) {
+		if (opcode != BTSNOOP_OPCODE_EVENT_PKT || size < 4 ||
+					buf[1] != EVT_LE_META_EVENT ||
+					buf[3] != EVT_LE_ADVERTISING_REPORT)
+			continue;
+
+		if (replay->realtime) {
+			offset = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+			if (first < 0)
+				first = offset;
+			offset -= first;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (offset > ts_us(&now) - ts_us(&start))
+				usleep(offset - (ts_us(&now) - ts_us(&start)));
+		}
+
+		/* Never run further ahead than the timestamp ring */
+		while (replay->head - __atomic_load_n(&replay->tail,
+					__ATOMIC_ACQUIRE) >= REPLAY_RING)
+			usleep(100);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		__atomic_store_n(&replay->sent[replay->head % REPLAY_RING],
+					ts_us(&now), __ATOMIC_RELEASE);
+		__atomic_store_n(&replay->head, replay->head + 1,
+							__ATOMIC_RELEASE);
+
+		buf[0] = HCI_EVENT_PKT;
+		if (write(replay->fd, buf, size + 1) < 0)
+			break;
+
+		replay->events++;
+	}
+
+	close(replay->fd);
+
+	return NULL;
+}
+
+static int replay_advertising_devices(const char *path, gboolean realtime,
+							uint8_t filter_type)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct replay *replay;
+	struct timespec start, end, cpu_start, cpu_end, now;
+	unsigned long reports = 0, matches = 0;
+	int64_t lat, lat_sum = 0, lat_max = 0, wall_us, cpu_us;
+	pthread_t feeder;
+	int fds[2], len;
+
+	replay = g_try_new0(struct replay, 1);
+	if (replay == NULL)
+		return -1;
+
+	replay->snoop = btsnoop_open(path, BTSNOOP_FLAG_PKLG_SUPPORT |
+							BTSNOOP_FLAG_MMAP);
+	if (replay->snoop == NULL) {
+		fprintf(stderr, "Could not open %s\n", path);
+		g_free(replay);
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		btsnoop_unref(replay->snoop);
+		g_free(replay);
+		return -1;
+	}
+
+	replay->fd = fds[1];
+	replay->realtime = realtime;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
+	if (pthread_create(&feeder, NULL, replay_feeder, replay) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		btsnoop_unref(replay->snoop);
+		g_free(replay);
+		return -1;
+	}
+
+	while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+		evt_le_meta_event *meta;
+		int n, matched;
+
+		capture_event(buf, len);
+
+		meta = (void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+		matched = handle_advertising_event(meta,
+					len - (1 + HCI_EVENT_HDR_SIZE),
+					filter_type, FALSE, &n);
+
+		reports += n;
+
+		if (matched) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			lat = ts_us(&now) - __atomic_load_n(
+				&replay->sent[replay->tail % REPLAY_RING],
+				__ATOMIC_ACQUIRE);
+			lat_sum += lat;
+			if (lat > lat_max)
+				lat_max = lat;
+			matches += matched;
+		}
+
+		__atomic_store_n(&replay->tail, replay->tail + 1,
+							__ATOMIC_RELEASE);
+	}
+
+	matches += merge_flush(filter_type, true);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_join(feeder, NULL);
+	close(fds[0]);
+
+	wall_us = MAX(ts_us(&end) - ts_us(&start), 1);
+	cpu_us = ts_us(&cpu_end) - ts_us(&cpu_start);
+
+	printf("# replay: %lu events, %lu reports, %lu matches in %.3f s\n",
+				replay->events, reports, matches,
+				wall_us / 1000000.0);
+	printf("# replay: %.0f reports/s, %.2f us CPU per report\n",
+				reports * 1000000.0 / wall_us,
+				reports ? (double) cpu_us / reports : 0.0);
+	if (matches)
+		printf("# replay: match latency avg %.1f us, max %lld us\n",
+				(double) lat_sum / matches,
+				(long long) lat_max);
+	if (scan_cache) {
+		uint64_t hits, misses;
+
+		ad_cache_get_stats(scan_cache, &hits, &misses);
+		printf("# replay: advert cache hit rate %.1f%% (%llu/%llu)\n",
+				hits + misses ? 100.0 * hits / (hits + misses) :
+									0.0,
+				(unsigned long long) hits,
+				(unsigned long long) (hits + misses));
+	}
+
+	btsnoop_unref(replay->snoop);
+	g_free(replay);
+
+	return 0;
+}
+
 static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
 							gpointer user_data)
 {
 	printf("char_write_req_cb\n");
+	trace_point(TRACE_WRITE_ACK, status, opt_handle,
+						elapsed_ms(&connect_start));
+	op_timer_report("write");
+	phase_record(PHASE_WRITE, opt_dst, &op_start);
+	printf("# %s connect-to-ack %ld ms\n", opt_dst,
+						elapsed_ms(&connect_start));
+
 	if (status != 0) {
 		resp_error(err_COMM_ERR); // Todo: status
 		goto done;
@@ -881,6 +2122,25 @@ static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
 		goto done;
 	}
 
+	/* Provisioned: move the live link to the idle parameters, and have
+	 * later links to the node, and updates it asks for, use them too. */
+	if (opt_conn_policy == CONN_POLICY_RELAX) {
+		GError *gerr = NULL;
+
+		if (!bt_io_set_le_conn_params(iochannel,
+					IDLE_CONN_MIN_INTERVAL,
+					IDLE_CONN_MAX_INTERVAL,
+					IDLE_CONN_LATENCY, IDLE_CONN_TIMEOUT,
+					&gerr)) {
+			printf("# Connection update failed: %s\n",
+							gerr->message);
+			g_error_free(gerr);
+		}
+
+		set_conn_params(IDLE_CONN_MIN_INTERVAL, IDLE_CONN_MAX_INTERVAL,
+				IDLE_CONN_LATENCY, IDLE_CONN_TIMEOUT, NULL);
+	}
+
         resp_begin(rsp_WRITE);
         resp_end();
 done:
@@ -889,12 +2149,34 @@ done:
 
 }
 
+static void char_write_stream_cb(uint8_t status, size_t written,
+							void *user_data)
+{
+	trace_point(TRACE_WRITE_ACK, status, opt_handle,
+						elapsed_ms(&connect_start));
+	op_timer_report("write");
+	phase_record(PHASE_WRITE, opt_dst, &op_start);
+	printf("# %s streamed %zu bytes, status 0x%02x\n", opt_dst, written,
+								status);
+
+	if (status != 0)
+		resp_error(err_COMM_ERR);
+	else {
+		resp_begin(rsp_WRITE);
+		resp_end();
+	}
+
+	if (opt_listen == FALSE)
+		g_main_loop_quit(event_loop);
+}
+
 static gboolean char_write_auto(gpointer user_data)
 {
 	printf("char_write_auto \n");
 	GAttrib *attrib = user_data;
 	uint8_t *value ;
 	size_t len;
+	gboolean queued;
 	char *str_value = "68656c6c6f"; //string "hello"
 	
 	len = gatt_attr_data_from_string(str_value, &value);
@@ -902,12 +2184,25 @@ static gboolean char_write_auto(gpointer user_data)
 		g_printerr("Invalid value\n");
 		goto error;
 	}
-	gatt_write_char(attrib, opt_handle, value, len, char_write_req_cb,
-									NULL);
+	/* Write Commands carry no acknowledgement, a CRC-32 trails them */
+	if (opt_stream)
+		queued = gatt_write_cmd_stream(attrib, opt_handle, value, len,
+					TRUE, char_write_stream_cb, NULL);
+	else
+		queued = gatt_write_char(attrib, opt_handle, value, len,
+					char_write_req_cb, NULL) != 0;
+
+	/* Both take a copy, the completion callback ends the loop */
+	g_free(value);
+
+	if (queued)
+		return FALSE;
+
+	g_printerr("Unable to queue write\n");
 
 error:
 	g_main_loop_quit(event_loop);
-	return  ;
+	return FALSE;
 }
 static void char_discovered_cb(guint8 status, GSList *characteristics, 
 							void* user_data)
@@ -917,6 +2212,9 @@ static void char_discovered_cb(guint8 status, GSList *characteristics,
 	char string2uuid[5];
 	int handle_value;
 
+	op_timer_report("discovery");
+	phase_record(PHASE_DISCOVER_CHAR, opt_dst, &op_start);
+
 	if (status) {
 		g_printerr("Discover all characteristics failed: %s\n",
 							att_ecode2str(status));
@@ -961,7 +2259,36 @@ static const char *lescan_help =
 	"\tlescan [--whitelist] scan for address in the whitelist only\n"
 	"\tlescan [--discovery=g|l] enable general or limited discovery"
 		"procedure\n"
-	"\tlescan [--duplicates] don't filter duplicates\n";
+	"\tlescan [--duplicates] don't filter duplicates\n"
+	"\tlescan [--replay=<btsnoop>] feed a capture through the report "
+		"handling and print throughput\n"
+	"\tlescan [--realtime] replay at the original capture timing\n"
+	"\tlescan [--btsnoop=<file>] record every scan event to a btsnoop "
+		"file\n"
+	"\tlescan [--btsnoop-size=<bytes>] [--btsnoop-time=<seconds>] "
+		"rotate the capture through <file>.0, <file>.1, ...\n"
+	"\tlescan [--btsnoop-files=<n>] keep only the last <n> rotated "
+		"files\n"
+	"\tlescan [--trace=<file>] record binary tracepoints, "
+		"written at exit\n"
+	"\tlescan [--trace-decode=<file>] print a recorded trace\n"
+	"\tlescan [--latency=<file>|-] append phase latency histograms "
+		"at exit and on SIGUSR1\n"
+	"\tlescan [--metrics=<socket>] serve counters in Prometheus text "
+		"format\n"
+	"\tlescan [--no-cache] parse every report, even unchanged ones\n"
+	"\tlescan [--no-prefilter] parse reports without provisioning "
+		"manufacturer data too\n"
+	"\tlescan [--stream] send the value as flow controlled Write "
+		"Commands with a trailing CRC-32\n"
+	"\tlescan [--verbose] also print every report and its AD fields "
+		"during a replay\n"
+	"\tlescan [--mtu=<n>] largest ATT MTU to negotiate (23 disables "
+		"the exchange)\n"
+	"\tlescan [--conn-policy=fast|relax] shorten the connection interval "
+		"while provisioning, then disconnect (fast) or stay "
+		"connected and use a power saving interval from then on "
+		"(relax)\n";
 
 static struct option lescan_options[] = {
 	{ "help",	0, 0, 'h' },
@@ -970,6 +2297,22 @@ static struct option lescan_options[] = {
 	{ "whitelist",	0, 0, 'w' },
 	{ "discovery",	1, 0, 'd' },
 	{ "duplicates",	0, 0, 'D' },
+	{ "mtu",	1, 0, 'm' },
+	{ "conn-policy",	1, 0, 'c' },
+	{ "replay",	1, 0, 'r' },
+	{ "realtime",	0, 0, 'R' },
+	{ "btsnoop",	1, 0, 'b' },
+	{ "btsnoop-size",	1, 0, 'B' },
+	{ "btsnoop-time",	1, 0, 'I' },
+	{ "btsnoop-files",	1, 0, 'F' },
+	{ "trace",	1, 0, 't' },
+	{ "trace-decode",	1, 0, 'T' },
+	{ "latency",	1, 0, 'l' },
+	{ "metrics",	1, 0, 'M' },
+	{ "no-cache",	0, 0, 'C' },
+	{ "no-prefilter",	0, 0, 'N' },
+	{ "stream",	0, 0, 'S' },
+	{ "verbose",	0, 0, 'v' },
 	{ 0, 0, 0, 0 }
 };
 static void helper_arg(int min_num_arg, int max_num_arg, int *argc,
@@ -1035,13 +2378,122 @@ static void * lescan_bt_devices(int dev_id, int argc, char **argv)
 		case 'D':
 			filter_dup = 0x00;
 			break;
+		case 'm':
+			opt_req_mtu = atoi(optarg);
+			if (opt_req_mtu < ATT_DEFAULT_LE_MTU ||
+						opt_req_mtu > LE_MAX_MTU) {
+				fprintf(stderr, "Invalid MTU %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'r':
+			opt_replay = g_strdup(optarg);
+			break;
+		case 'R':
+			opt_realtime = TRUE;
+			break;
+		case 'b':
+			opt_btsnoop = g_strdup(optarg);
+			break;
+		case 'B':
+			opt_btsnoop_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			opt_btsnoop_time = atoi(optarg);
+			break;
+		case 'F':
+			opt_btsnoop_files = atoi(optarg);
+			break;
+		case 't':
+			__btd_trace_init(optarg);
+			atexit(__btd_trace_dump);
+			break;
+		case 'T':
+			trace_decode_file(optarg);
+			break;
+		case 'l':
+			opt_latency = g_strdup(optarg);
+			break;
+		case 'M':
+			opt_metrics = g_strdup(optarg);
+			break;
+		case 'C':
+			opt_no_cache = TRUE;
+			break;
+		case 'N':
+			opt_no_prefilter = TRUE;
+			break;
+		case 'S':
+			opt_stream = TRUE;
+			break;
+		case 'v':
+			opt_verbose = TRUE;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "fast")) {
+				opt_conn_policy = CONN_POLICY_FAST;
+			} else if (!strcmp(optarg, "relax")) {
+				/* Keep the link up once provisioned */
+				opt_conn_policy = CONN_POLICY_RELAX;
+				opt_listen = TRUE;
+			} else {
+				fprintf(stderr, "Unknown connection policy\n");
+				exit(1);
+			}
+			break;
 		default:
 			printf("%s", lescan_help);
 			
 		}
 	}
 
+	if (opt_latency) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = sigusr1_handler;
+		sigaction(SIGUSR1, &sa, NULL);
+
+		g_timeout_add_seconds(1, latency_dump_timeout, NULL);
+		atexit(latency_dump);
+	}
+
+	if (opt_metrics) {
+		scan_metrics = metrics_new(&scan_metrics_family);
+
+		/* Served from the main context, the scan loop polls it too */
+		if (!metrics_listen(opt_metrics)) {
+			perror("Could not listen on metrics socket");
+			exit(1);
+		}
+
+		atexit(metrics_shutdown);
+	}
+
+	if (opt_btsnoop && capture_open(opt_btsnoop) < 0) {
+		perror("Could not create capture file");
+		exit(1);
+	}
+
+	if (!opt_no_cache)
+		scan_cache = ad_cache_new(SCAN_CACHE_SIZE);
+
+	/* Only an active scan solicits scan responses to merge */
+	scan_merge = scan_type == 0x01;
+
+	clock_gettime(CLOCK_MONOTONIC, &scan_start);
+
+	if (opt_replay) {
+		print_reports = opt_verbose;
+		if (replay_advertising_devices(opt_replay, opt_realtime,
+							filter_type) < 0)
+			exit(1);
+		exit(0);
+	}
+
 	dev_id = hci_get_route(NULL);
+	if (dev_id >= 0)
+		mgmt_index = dev_id;
     dd = hci_open_dev( dev_id );
     if (dev_id < 0 || dd < 0)
     {
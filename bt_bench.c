@@ -0,0 +1,2105 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Micro benchmarks for the code paths the provisioning tools depend on.
+ *
+ * Every benchmark runs without a controller. ATT traffic goes through a
+ * SOCK_SEQPACKET socketpair, which keeps PDU boundaries like an L2CAP
+ * channel does, with a peer thread playing the GATT server.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/sdp.h"
+#include "lib/uuid.h"
+
+#include "src/shared/util.h"
+#include "src/shared/btsnoop.h"
+#include "src/textfile.h"
+#include "src/eir.h"
+#include "src/storage.h"
+
+#include "attrib/att.h"
+#include "attrib/gattrib.h"
+#include "attrib/gatt.h"
+
+#define BENCH_HANDLE		0x0010
+
+static int opt_count = 1000;
+static int opt_size = 4096;
+static int opt_mtu = ATT_DEFAULT_LE_MTU;
+static int opt_delay = 0;
+static int opt_devices = 100;
+
+static GMainLoop *main_loop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * ATT peer
+ *
+ * Answers write traffic the way a GATT server accepting every value does.
+ * Prepare Writes are echoed back unchanged, Write Commands are counted.
+ * opt_delay stands in for the connection interval a response waits for.
+ */
+struct att_peer {
+	int fd;
+	pthread_t thread;
+	uint64_t cmd_bytes;
+	unsigned int cmds;
+};
+
+static void *att_peer_run(void *user_data)
+{
+	struct att_peer *peer = user_data;
+	uint8_t pdu[ATT_MAX_VALUE_LEN + 8];
+	uint8_t rsp[5];
+	ssize_t len;
+
+	while ((len = read(peer->fd, pdu, sizeof(pdu))) > 0) {
+		const uint8_t *out = rsp;
+		size_t olen;
+
+		switch (pdu[0]) {
+		case ATT_OP_WRITE_CMD:
+			peer->cmd_bytes += len - 3;
+			peer->cmds++;
+			continue;
+		case ATT_OP_PREP_WRITE_REQ:
+			pdu[0] = ATT_OP_PREP_WRITE_RESP;
+			out = pdu;
+			olen = len;
+			break;
+		case ATT_OP_EXEC_WRITE_REQ:
+			rsp[0] = ATT_OP_EXEC_WRITE_RESP;
+			olen = 1;
+			break;
+		case ATT_OP_WRITE_REQ:
+			rsp[0] = ATT_OP_WRITE_RESP;
+			olen = 1;
+			break;
+		default:
+			rsp[0] = ATT_OP_ERROR;
+			rsp[1] = pdu[0];
+			put_le16(0x0000, &rsp[2]);
+			rsp[4] = ATT_ECODE_REQ_NOT_SUPP;
+			olen = 5;
+			break;
+		}
+
+		if (opt_delay)
+			usleep(opt_delay);
+
+		if (write(peer->fd, out, olen) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static GAttrib *att_peer_start(struct att_peer *peer)
+{
+	GIOChannel *io;
+	GAttrib *attrib;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		perror("socketpair");
+		return NULL;
+	}
+
+	memset(peer, 0, sizeof(*peer));
+	peer->fd = fds[1];
+
+	if (pthread_create(&peer->thread, NULL, att_peer_run, peer) != 0) {
+		fprintf(stderr, "Unable to start ATT peer\n");
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+
+	io = g_io_channel_unix_new(fds[0]);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	attrib = g_attrib_new(io, opt_mtu);
+	g_io_channel_unref(io);
+
+	return attrib;
+}
+
+static void att_peer_stop(struct att_peer *peer, GAttrib *attrib)
+{
+	/* Shutting down our end makes the peer's read() return 0 */
+	shutdown(g_io_channel_unix_get_fd(g_attrib_get_channel(attrib)),
+								SHUT_RDWR);
+	g_attrib_unref(attrib);
+
+	pthread_join(peer->thread, NULL);
+	close(peer->fd);
+}
+
+/* Long writes: the whole Prepare Write sequence plus Execute Write */
+struct write_run {
+	GAttrib *attrib;
+	uint8_t *value;
+	int done;
+	gboolean failed;
+};
+
+static void long_write_start(struct write_run *run);
+
+static void long_write_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct write_run *run = user_data;
+
+	if (status) {
+		fprintf(stderr, "Write failed: %s\n", att_ecode2str(status));
+		run->failed = TRUE;
+		g_main_loop_quit(main_loop);
+		return;
+	}
+
+	if (++run->done == opt_count) {
+		g_main_loop_quit(main_loop);
+		return;
+	}
+
+	long_write_start(run);
+}
+
+static void long_write_start(struct write_run *run)
+{
+	if (gatt_write_char(run->attrib, BENCH_HANDLE, run->value, opt_size,
+						long_write_cb, run))
+		return;
+
+	fprintf(stderr, "Unable to queue write\n");
+	run->failed = TRUE;
+	g_main_loop_quit(main_loop);
+}
+
+static int bench_prepare_write(void)
+{
+	struct att_peer peer;
+	struct write_run run;
+	double start, elapsed;
+	int i;
+
+	if (opt_size <= opt_mtu - 3) {
+		fprintf(stderr, "Value fits a single Write Request\n");
+		return -1;
+	}
+
+	memset(&run, 0, sizeof(run));
+
+	run.attrib = att_peer_start(&peer);
+	if (!run.attrib)
+		return -1;
+
+	run.value = g_malloc(opt_size);
+	for (i = 0; i < opt_size; i++)
+		run.value[i] = i;
+
+	start = now();
+	long_write_start(&run);
+	if (!run.failed)
+		g_main_loop_run(main_loop);
+	elapsed = now() - start;
+
+	att_peer_stop(&peer, run.attrib);
+	g_free(run.value);
+
+	if (run.failed)
+		return -1;
+
+	printf("prepare-write: %d writes of %d bytes, MTU %d, delay %d us\n",
+					run.done, opt_size, opt_mtu, opt_delay);
+	printf("\t%.0f bytes/s, %.3f ms per write\n",
+				(double) run.done * opt_size / elapsed,
+				elapsed * 1000 / run.done);
+
+	return 0;
+}
+
+/*
+ * Bulk transfer: the same payload once as Write Requests of MTU - 3 bytes,
+ * one round trip each, and once as a Write Command stream. The stream
+ * completes when the last command reached the socket, so a Write Request
+ * follows it and the run ends when the peer answered that one.
+ */
+struct stream_run {
+	GAttrib *attrib;
+	uint8_t *value;
+	size_t offset;
+	int done;
+	gboolean failed;
+};
+
+static void stream_run_fail(struct stream_run *run, const char *what)
+{
+	fprintf(stderr, "%s failed\n", what);
+	run->failed = TRUE;
+	g_main_loop_quit(main_loop);
+}
+
+static void req_write_next(struct stream_run *run);
+
+static void req_write_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct stream_run *run = user_data;
+
+	if (status) {
+		stream_run_fail(run, "Write Request");
+		return;
+	}
+
+	req_write_next(run);
+}
+
+static void req_write_next(struct stream_run *run)
+{
+	size_t chunk = MIN((size_t) opt_mtu - 3, opt_size - run->offset);
+
+	if (run->offset == (size_t) opt_size) {
+		run->offset = 0;
+
+		if (++run->done == opt_count) {
+			g_main_loop_quit(main_loop);
+			return;
+		}
+	}
+
+	if (!gatt_write_char(run->attrib, BENCH_HANDLE,
+					run->value + run->offset, chunk,
+					req_write_cb, run)) {
+		stream_run_fail(run, "Write Request");
+		return;
+	}
+
+	run->offset += chunk;
+}
+
+static void cmd_stream_next(struct stream_run *run);
+
+static void cmd_stream_barrier_cb(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct stream_run *run = user_data;
+
+	if (status) {
+		stream_run_fail(run, "Write Request");
+		return;
+	}
+
+	if (++run->done == opt_count) {
+		g_main_loop_quit(main_loop);
+		return;
+	}
+
+	cmd_stream_next(run);
+}
+
+static void cmd_stream_cb(uint8_t status, size_t written, void *user_data)
+{
+	struct stream_run *run = user_data;
+
+	if (status) {
+		stream_run_fail(run, "Write Command stream");
+		return;
+	}
+
+	if (!gatt_write_char(run->attrib, BENCH_HANDLE, run->value, 1,
+					cmd_stream_barrier_cb, run))
+		stream_run_fail(run, "Write Request");
+}
+
+static void cmd_stream_next(struct stream_run *run)
+{
+	if (!gatt_write_cmd_stream(run->attrib, BENCH_HANDLE, run->value,
+					opt_size, TRUE, cmd_stream_cb, run))
+		stream_run_fail(run, "Write Command stream");
+}
+
+static double stream_run(void (*start)(struct stream_run *run),
+						struct att_peer *peer)
+{
+	struct stream_run run;
+	double start_time, elapsed;
+	int i;
+
+	memset(&run, 0, sizeof(run));
+
+	run.attrib = att_peer_start(peer);
+	if (!run.attrib)
+		return -1;
+
+	run.value = g_malloc(opt_size);
+	for (i = 0; i < opt_size; i++)
+		run.value[i] = i;
+
+	start_time = now();
+	start(&run);
+	if (!run.failed)
+		g_main_loop_run(main_loop);
+	elapsed = now() - start_time;
+
+	att_peer_stop(peer, run.attrib);
+	g_free(run.value);
+
+	return run.failed ? -1 : elapsed;
+}
+
+static int bench_write_stream(void)
+{
+	struct att_peer peer;
+	double total = (double) opt_size * opt_count;
+	double req, cmd;
+
+	req = stream_run(req_write_next, &peer);
+	if (req < 0)
+		return -1;
+
+	cmd = stream_run(cmd_stream_next, &peer);
+	if (cmd < 0)
+		return -1;
+
+	/* The trailing CRC-32 is not counted as payload */
+	if (peer.cmd_bytes != (uint64_t) (opt_size + 4) * opt_count) {
+		fprintf(stderr, "Peer received %llu bytes\n",
+				(unsigned long long) peer.cmd_bytes);
+		return -1;
+	}
+
+	printf("write-stream: %d x %d bytes, MTU %d, delay %d us\n",
+				opt_count, opt_size, opt_mtu, opt_delay);
+	printf("\tWrite Request  %.3f MB/s\n", total / req / 1e6);
+	printf("\tWrite Command  %.3f MB/s (%u PDUs)\n", total / cmd / 1e6,
+								peer.cmds);
+
+	return 0;
+}
+
+/*
+ * btsnoop capture
+ *
+ * Writes opt_count event records of opt_size bytes, the way the scan loop
+ * records every event it reads. The producer time is what the scan loop
+ * pays per packet, the total includes draining the buffer to the file.
+ */
+static void snoop_path(char *path, size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+
+	snprintf(path, size, "%s/bt_bench.%d.snoop", dir ? dir : "/tmp",
+								getpid());
+}
+
+static int snoop_write_run(bool buffered, double *producer, double *total)
+{
+	struct btsnoop *snoop;
+	struct timeval tv;
+	uint8_t *data;
+	char path[PATH_MAX];
+	double start;
+	int i;
+
+	snoop_path(path, sizeof(path));
+
+	snoop = btsnoop_create(path, BTSNOOP_TYPE_MONITOR);
+	if (!snoop) {
+		perror("Failed to create capture");
+		return -1;
+	}
+
+	if (buffered && !btsnoop_set_buffered(snoop, 0, true)) {
+		btsnoop_unref(snoop);
+		return -1;
+	}
+
+	data = g_malloc0(opt_size);
+
+	start = now();
+	*producer = 0;
+
+	for (i = 0; i < opt_count; i++) {
+		double t;
+
+		/* opt_delay spaces the packets like a real scan would */
+		while (opt_delay && now() < start + i * opt_delay / 1e6);
+
+		t = now();
+		gettimeofday(&tv, NULL);
+		data[0] = i;
+		btsnoop_write_hci(snoop, &tv, 0, BTSNOOP_OPCODE_EVENT_PKT,
+								data, opt_size);
+		*producer += now() - t;
+	}
+
+	if (buffered && btsnoop_get_drops(snoop))
+		printf("\t(%u packets dropped)\n", btsnoop_get_drops(snoop));
+
+	btsnoop_unref(snoop);
+
+	*total = now() - start;
+
+	g_free(data);
+	unlink(path);
+
+	return 0;
+}
+
+static int bench_btsnoop_write(void)
+{
+	double producer, total;
+
+	if (opt_size > BTSNOOP_MAX_PACKET_SIZE) {
+		fprintf(stderr, "Packet size above %d\n",
+						BTSNOOP_MAX_PACKET_SIZE);
+		return -1;
+	}
+
+	printf("btsnoop-write: %d x %d bytes, %d us apart\n", opt_count,
+							opt_size, opt_delay);
+
+	if (snoop_write_run(false, &producer, &total) < 0)
+		return -1;
+
+	printf("\twrite()    %.3f us per packet, %.0f packets/s\n",
+			producer * 1e6 / opt_count, opt_count / total);
+
+	if (snoop_write_run(true, &producer, &total) < 0)
+		return -1;
+
+	printf("\tbuffered   %.3f us per packet, %.0f packets/s\n",
+			producer * 1e6 / opt_count, opt_count / total);
+
+	return 0;
+}
+
+/*
+ * Reads back a capture of opt_count records of opt_size bytes, half of
+ * them events and half ACL data, the mix a scan with one link produces.
+ */
+enum snoop_reader {
+	SNOOP_READ,
+	SNOOP_MMAP_COPY,
+	SNOOP_MMAP,
+	SNOOP_MMAP_FILTER,
+};
+
+static int snoop_read_run(const char *path, enum snoop_reader reader,
+							double *elapsed)
+{
+	static uint8_t buf[BTSNOOP_MAX_PACKET_SIZE];
+	struct btsnoop *snoop;
+	struct timeval tv;
+	const void *data;
+	uint16_t index, opcode, size;
+	double start;
+	int count = 0;
+
+	start = now();
+
+	snoop = btsnoop_open(path, reader == SNOOP_READ ? 0 :
+							BTSNOOP_FLAG_MMAP);
+	if (!snoop)
+		return -1;
+
+	switch (reader) {
+	case SNOOP_READ:
+	case SNOOP_MMAP_COPY:
+		while (btsnoop_read_hci(snoop, &tv, &index, &opcode, buf,
+									&size))
+			if (opcode == BTSNOOP_OPCODE_EVENT_PKT)
+				count++;
+		break;
+	case SNOOP_MMAP:
+		while (btsnoop_next_hci(snoop, &tv, &index, &opcode, &data,
+									&size))
+			if (opcode == BTSNOOP_OPCODE_EVENT_PKT)
+				count++;
+		break;
+	case SNOOP_MMAP_FILTER:
+		btsnoop_set_filter(snoop, 1 << BTSNOOP_OPCODE_EVENT_PKT, -1);
+		while (btsnoop_next_hci(snoop, &tv, &index, &opcode, &data,
+									&size))
+			count++;
+		break;
+	}
+
+	btsnoop_unref(snoop);
+
+	*elapsed = now() - start;
+
+	return count;
+}
+
+static int bench_btsnoop_read(void)
+{
+	static const char * const names[] = {
+		"read()", "mmap, copied", "mmap", "mmap, filtered",
+	};
+	struct btsnoop *snoop;
+	struct timeval tv;
+	uint8_t *data;
+	char path[PATH_MAX];
+	double elapsed = 0, best;
+	int i, run, count;
+
+	if (opt_size > BTSNOOP_MAX_PACKET_SIZE) {
+		fprintf(stderr, "Packet size above %d\n",
+						BTSNOOP_MAX_PACKET_SIZE);
+		return -1;
+	}
+
+	snoop_path(path, sizeof(path));
+
+	snoop = btsnoop_create(path, BTSNOOP_TYPE_MONITOR);
+	if (!snoop) {
+		perror("Failed to create capture");
+		return -1;
+	}
+
+	data = g_malloc0(opt_size);
+	gettimeofday(&tv, NULL);
+
+	for (i = 0; i < opt_count; i++)
+		btsnoop_write_hci(snoop, &tv, 0, i & 1 ?
+					BTSNOOP_OPCODE_ACL_RX_PKT :
+					BTSNOOP_OPCODE_EVENT_PKT,
+					data, opt_size);
+
+	btsnoop_unref(snoop);
+	g_free(data);
+
+	printf("btsnoop-read: %d x %d bytes, best of 3\n", opt_count,
+								opt_size);
+
+	for (i = SNOOP_READ; i <= SNOOP_MMAP_FILTER; i++) {
+		best = 0;
+
+		for (run = 0; run < 3; run++) {
+			count = snoop_read_run(path, i, &elapsed);
+			if (count != (opt_count + 1) / 2) {
+				fprintf(stderr, "%s read %d events\n",
+							names[i], count);
+				unlink(path);
+				return -1;
+			}
+
+			if (!best || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("\t%-16s%.0f packets/s, %.1f MB/s\n", names[i],
+				opt_count / best,
+				(double) (opt_size + 24) * opt_count / best / 1e6);
+	}
+
+	unlink(path);
+
+	return 0;
+}
+
+/*
+ * Device storage
+ *
+ * bluetoothd itself can not be linked here, so these replay the storage
+ * calls device.c and adapter.c make, against a directory under TMPDIR.
+ */
+static void storage_dir(char *path, size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+
+	snprintf(path, size, "%s/bt_bench.%d", dir ? dir : "/tmp", getpid());
+}
+
+static int remove_cb(const char *path, const struct stat *st, int flag,
+							struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void storage_dir_remove(const char *path)
+{
+	nftw(path, remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* What every main loop iteration of the daemon would dispatch */
+static double dispatch_pending(void)
+{
+	double start = now();
+
+	while (g_main_context_iteration(NULL, FALSE));
+
+	return now() - start;
+}
+
+/* device_store_cached_name() as it was, one file rewrite per advert */
+static void name_store_direct(const char *filename, const char *name)
+{
+	GKeyFile *key_file;
+	char *data;
+	gsize length = 0;
+
+	create_file(filename, S_IRUSR | S_IWUSR);
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	g_key_file_set_string(key_file, "General", "Name", name);
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+	g_file_set_contents(filename, data, length, NULL);
+
+	g_free(data);
+	g_key_file_free(key_file);
+}
+
+/* device_store_cached_name() now, unchanged names never get queued */
+static void name_store_cached(const char *filename, char **cached,
+							const char *name)
+{
+	if (!*cached)
+		*cached = g_key_file_get_string(storage_keyfile_get(filename),
+						"General", "Name", NULL);
+
+	if (*cached && !strcmp(*cached, name))
+		return;
+
+	g_free(*cached);
+	*cached = g_strdup(name);
+
+	g_key_file_set_string(storage_keyfile_get(filename), "General", "Name",
+									name);
+	storage_keyfile_put(filename);
+}
+
+/*
+ * opt_count adverts with a complete name, spread over opt_devices
+ * devices and opt_delay apart. Every device changes its name once per
+ * 100 adverts. Adverts/s is what the main loop could sustain, from the
+ * time it spends per advert.
+ */
+static int bench_name_cache(void)
+{
+	char dir[256], name[32];
+	char (*filenames)[PATH_MAX];
+	char **cached;
+	uint64_t writes;
+	double busy, stall, stall_max;
+	int cached_mode, i, dev;
+
+	storage_dir(dir, sizeof(dir));
+
+	filenames = g_malloc0(opt_devices * sizeof(*filenames));
+	cached = g_new0(char *, opt_devices);
+
+	for (dev = 0; dev < opt_devices; dev++)
+		snprintf(filenames[dev], PATH_MAX,
+				"%s/cache/00:00:00:00:%02X:%02X", dir,
+				dev >> 8, dev & 0xff);
+
+	printf("name-cache: %d adverts from %d devices, %d us apart\n",
+					opt_count, opt_devices, opt_delay);
+
+	for (cached_mode = 0; cached_mode < 2; cached_mode++) {
+		busy = 0;
+		stall_max = 0;
+
+		for (i = 0; i < opt_count; i++) {
+			double t;
+
+			if (opt_delay)
+				usleep(opt_delay);
+
+			t = now();
+
+			dev = i % opt_devices;
+			snprintf(name, sizeof(name), "Node %d.%d", dev,
+						i / opt_devices / 100);
+
+			if (cached_mode)
+				name_store_cached(filenames[dev], &cached[dev],
+									name);
+			else
+				name_store_direct(filenames[dev], name);
+
+			stall = now() - t + dispatch_pending();
+			if (stall > stall_max)
+				stall_max = stall;
+
+			busy += stall;
+		}
+
+		if (cached_mode) {
+			storage_cleanup();
+			storage_get_stats(NULL, &writes, NULL, NULL);
+		} else {
+			writes = opt_count;
+		}
+
+		printf("\t%-10s%.0f adverts/s, %llu file writes, "
+				"longest advert %.1f us\n",
+				cached_mode ? "cached" : "direct",
+				opt_count / busy, (unsigned long long) writes,
+				stall_max * 1e6);
+
+		storage_dir_remove(dir);
+	}
+
+	for (dev = 0; dev < opt_devices; dev++)
+		g_free(cached[dev]);
+
+	g_free(cached);
+	g_free(filenames);
+
+	return 0;
+}
+
+/* What a new LE bond stores, in the order the mgmt events arrive */
+static const struct bond_step {
+	const char *file;
+	const char *group;
+	bool key;
+} bond_steps[] = {
+	{ "info",	"General",		false },
+	{ "info",	"LongTermKey",		true },
+	{ "info",	"IdentityResolvingKey",	true },
+	{ "info",	"LocalSignatureKey",	true },
+	{ "info",	"RemoteSignatureKey",	true },
+	{ "info",	"ConnectionParameters",	false },
+	{ "cache",	"General",		false },
+	{ "attributes",	"1",			false },
+};
+
+static void bond_step_path(const char *dir, int dev,
+				const struct bond_step *step, char *path)
+{
+	if (!strcmp(step->file, "cache"))
+		snprintf(path, PATH_MAX, "%s/cache/00:00:00:00:%02X:%02X",
+						dir, dev >> 8, dev & 0xff);
+	else
+		snprintf(path, PATH_MAX, "%s/00:00:00:00:%02X:%02X/%s",
+					dir, dev >> 8, dev & 0xff, step->file);
+}
+
+/* How adapter.c and device.c stored every event before the cache */
+static void bond_store_direct(const char *filename,
+				const struct bond_step *step, const char *value)
+{
+	GKeyFile *key_file;
+	char *data;
+	gsize length = 0;
+
+	create_file(filename, S_IRUSR | S_IWUSR);
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	g_key_file_set_string(key_file, step->group, "Key", value);
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+	g_file_set_contents(filename, data, length, NULL);
+
+	g_free(data);
+	g_key_file_free(key_file);
+}
+
+static void bond_store_cached(const char *filename,
+				const struct bond_step *step, const char *value)
+{
+	g_key_file_set_string(storage_keyfile_get(filename), step->group,
+								"Key", value);
+	storage_keyfile_put(filename);
+
+	if (step->key)
+		storage_keyfile_sync(filename);
+}
+
+/*
+ * opt_count new LE bonds back to back, as when a batch of devices is
+ * provisioned, with opt_delay between the mgmt events. The longest event
+ * is how long the main loop was unable to dispatch anything else, e.g.
+ * the next advertising report.
+ */
+static int bench_bond_storm(void)
+{
+	char dir[256], path[PATH_MAX], value[33];
+	uint64_t writes, stall_total, stall_max;
+	double busy, stall, event_max;
+	unsigned int j;
+	int cached_mode, i;
+
+	storage_dir(dir, sizeof(dir));
+
+	printf("bond-storm: %d bonds, %zu stores each, %d us apart\n",
+				opt_count, G_N_ELEMENTS(bond_steps), opt_delay);
+
+	for (cached_mode = 0; cached_mode < 2; cached_mode++) {
+		busy = 0;
+		event_max = 0;
+
+		for (i = 0; i < opt_count; i++) {
+			for (j = 0; j < G_N_ELEMENTS(bond_steps); j++) {
+				const struct bond_step *step = &bond_steps[j];
+				double t;
+
+				if (opt_delay)
+					usleep(opt_delay);
+
+				bond_step_path(dir, i & 0xffff, step, path);
+				snprintf(value, sizeof(value), "%08X%08X", i,
+									j);
+
+				t = now();
+
+				if (cached_mode)
+					bond_store_cached(path, step, value);
+				else
+					bond_store_direct(path, step, value);
+
+				stall = now() - t + dispatch_pending();
+				if (stall > event_max)
+					event_max = stall;
+
+				busy += stall;
+			}
+		}
+
+		if (cached_mode) {
+			storage_cleanup();
+			storage_get_stats(NULL, &writes, &stall_total,
+								&stall_max);
+			printf("\t%-10s%.0f bonds/s, %llu file writes, "
+				"longest event %.1f us, storage stall "
+				"%llu us (max %llu us)\n", "cached",
+				opt_count / busy, (unsigned long long) writes,
+				event_max * 1e6,
+				(unsigned long long) stall_total,
+				(unsigned long long) stall_max);
+		} else {
+			printf("\t%-10s%.0f bonds/s, %zu file writes, "
+				"longest event %.1f us\n", "direct",
+				opt_count / busy,
+				opt_count * G_N_ELEMENTS(bond_steps),
+				event_max * 1e6);
+		}
+
+		storage_dir_remove(dir);
+	}
+
+	return 0;
+}
+
+/*
+ * Known devices
+ *
+ * Stand-ins for btd_device holding what the lookups in adapter.c compare,
+ * and copies of its indexes, as bluetoothd can not be linked here either.
+ */
+struct bench_device {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+};
+
+static struct bench_device *bench_devices_new(int count)
+{
+	struct bench_device *devices;
+	int i;
+
+	devices = g_new0(struct bench_device, count);
+
+	for (i = 0; i < count; i++) {
+		devices[i].bdaddr.b[0] = i & 0xff;
+		devices[i].bdaddr.b[1] = i >> 8;
+		devices[i].bdaddr.b[5] = 0xc0;
+		devices[i].bdaddr_type = BDADDR_LE_RANDOM;
+	}
+
+	return devices;
+}
+
+/* The part of device_addr_type_cmp() an LE lookup goes through */
+static int bench_device_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct bench_device *dev = a;
+	const struct bench_device *addr = b;
+	int cmp;
+
+	cmp = bacmp(&dev->bdaddr, &addr->bdaddr);
+	if (cmp)
+		return cmp;
+
+	return dev->bdaddr_type != addr->bdaddr_type;
+}
+
+/* As in adapter.c */
+static guint bdaddr_hash(gconstpointer key)
+{
+	const uint8_t *b = ((const bdaddr_t *) key)->b;
+
+	return (b[0] | b[1] << 8 | b[2] << 16 | b[3] << 24) ^
+							(b[4] | b[5] << 8);
+}
+
+static gboolean bdaddr_equal(gconstpointer a, gconstpointer b)
+{
+	return !bacmp(a, b);
+}
+
+static void index_free(gpointer data)
+{
+	g_queue_free(data);
+}
+
+/* Adverts come from the known devices in a scattered order */
+static int advert_source(int i, int count)
+{
+	return (int) (((unsigned int) i * 7919) % count);
+}
+
+static double device_lookup_list(struct bench_device *devices, int count)
+{
+	GSList *list = NULL;
+	double start;
+	int i, found = 0;
+
+	for (i = 0; i < count; i++)
+		list = g_slist_append(list, &devices[i]);
+
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		struct bench_device *addr;
+
+		addr = &devices[advert_source(i, count)];
+		if (g_slist_find_custom(list, addr, bench_device_cmp))
+			found++;
+	}
+
+	start = now() - start;
+
+	g_slist_free(list);
+
+	return found == opt_count ? start : -1;
+}
+
+static double device_lookup_index(struct bench_device *devices, int count)
+{
+	GHashTable *index;
+	double start;
+	int i, found = 0;
+
+	index = g_hash_table_new_full(bdaddr_hash, bdaddr_equal, NULL,
+								index_free);
+
+	for (i = 0; i < count; i++) {
+		GQueue *queue = g_queue_new();
+
+		g_queue_push_tail(queue, &devices[i]);
+		g_hash_table_insert(index, &devices[i].bdaddr, queue);
+	}
+
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		struct bench_device *addr;
+		GQueue *queue;
+
+		addr = &devices[advert_source(i, count)];
+
+		queue = g_hash_table_lookup(index, &addr->bdaddr);
+		if (queue && g_queue_find_custom(queue, addr,
+							bench_device_cmp))
+			found++;
+	}
+
+	start = now() - start;
+
+	g_hash_table_destroy(index);
+
+	return found == opt_count ? start : -1;
+}
+
+/*
+ * btd_adapter_find_device() for every advert, with 10, 100, ... up to
+ * opt_devices known devices, through a scan of the device list as before
+ * and through the address index.
+ */
+static int bench_device_lookup(void)
+{
+	struct bench_device *devices;
+	double list, index;
+	int count;
+
+	devices = bench_devices_new(opt_devices);
+
+	printf("device-lookup: %d adverts\n", opt_count);
+
+	for (count = 10; ; count *= 10) {
+		if (count > opt_devices)
+			count = opt_devices;
+
+		list = device_lookup_list(devices, count);
+		index = device_lookup_index(devices, count);
+		if (list < 0 || index < 0) {
+			fprintf(stderr, "Lookup missed a device\n");
+			g_free(devices);
+			return -1;
+		}
+
+		printf("\t%6d devices  list %10.0f adverts/s  "
+				"index %10.0f adverts/s\n", count,
+				opt_count / list, opt_count / index);
+
+		if (count == opt_devices)
+			break;
+	}
+
+	g_free(devices);
+
+	return 0;
+}
+
+/* adapter.c's device_set: a list plus a device -> link table */
+struct device_set {
+	GList *head;
+	GList *tail;
+	GHashTable *links;
+};
+
+static bool device_set_contains(struct device_set *set, gpointer device)
+{
+	return g_hash_table_lookup(set->links, device) != NULL;
+}
+
+static void device_set_prepend(struct device_set *set, gpointer device)
+{
+	if (device_set_contains(set, device))
+		return;
+
+	set->head = g_list_prepend(set->head, device);
+	if (!set->tail)
+		set->tail = set->head;
+
+	g_hash_table_insert(set->links, device, set->head);
+}
+
+static void device_set_remove(struct device_set *set, gpointer device)
+{
+	GList *link;
+
+	link = g_hash_table_lookup(set->links, device);
+	if (!link)
+		return;
+
+	g_hash_table_remove(set->links, device);
+
+	if (link == set->tail)
+		set->tail = link->prev;
+
+	set->head = g_list_delete_link(set->head, link);
+}
+
+/*
+ * The membership work update_found_devices() does per advert: the
+ * connect list check and the discovery_found check. One advert in 100
+ * comes from a device that was lost and is found again, which costs a
+ * removal and an insertion. A tenth of the devices are on the connect
+ * list.
+ */
+static double found_set_list(struct bench_device *devices, int count,
+								int *hits)
+{
+	GSList *found = NULL, *connect = NULL;
+	double start;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		found = g_slist_prepend(found, &devices[i]);
+		if (i % 10 == 0)
+			connect = g_slist_prepend(connect, &devices[i]);
+	}
+
+	*hits = 0;
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		struct bench_device *dev = &devices[advert_source(i, count)];
+
+		if (i % 100 == 0)
+			found = g_slist_remove(found, dev);
+
+		if (g_slist_find(connect, dev))
+			(*hits)++;
+
+		if (!g_slist_find(found, dev))
+			found = g_slist_prepend(found, dev);
+	}
+
+	start = now() - start;
+
+	g_slist_free(found);
+	g_slist_free(connect);
+
+	return start;
+}
+
+static double found_set_indexed(struct bench_device *devices, int count,
+								int *hits)
+{
+	struct device_set found, connect;
+	double start;
+	int i;
+
+	memset(&found, 0, sizeof(found));
+	memset(&connect, 0, sizeof(connect));
+	found.links = g_hash_table_new(NULL, NULL);
+	connect.links = g_hash_table_new(NULL, NULL);
+
+	for (i = 0; i < count; i++) {
+		device_set_prepend(&found, &devices[i]);
+		if (i % 10 == 0)
+			device_set_prepend(&connect, &devices[i]);
+	}
+
+	*hits = 0;
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		struct bench_device *dev = &devices[advert_source(i, count)];
+
+		if (i % 100 == 0)
+			device_set_remove(&found, dev);
+
+		if (device_set_contains(&connect, dev))
+			(*hits)++;
+
+		if (!device_set_contains(&found, dev))
+			device_set_prepend(&found, dev);
+	}
+
+	start = now() - start;
+
+	g_list_free(found.head);
+	g_list_free(connect.head);
+	g_hash_table_destroy(found.links);
+	g_hash_table_destroy(connect.links);
+
+	return start;
+}
+
+/* Adverts/s against 10, 100, ... up to opt_devices found devices */
+static int bench_found_set(void)
+{
+	struct bench_device *devices;
+	double list, set;
+	int count, list_hits, set_hits;
+
+	devices = bench_devices_new(opt_devices);
+
+	printf("found-set: %d adverts\n", opt_count);
+
+	for (count = 10; ; count *= 10) {
+		if (count > opt_devices)
+			count = opt_devices;
+
+		list = found_set_list(devices, count, &list_hits);
+		set = found_set_indexed(devices, count, &set_hits);
+		if (list_hits != set_hits) {
+			fprintf(stderr, "Connect list results differ\n");
+			g_free(devices);
+			return -1;
+		}
+
+		printf("\t%6d found  list %10.0f adverts/s  "
+				"device_set %10.0f adverts/s\n", count,
+				opt_count / list, opt_count / set);
+
+		if (count == opt_devices)
+			break;
+	}
+
+	g_free(devices);
+
+	return 0;
+}
+
+/*
+ * Adapter startup
+ *
+ * The part of load_devices() that can run here: listing the device
+ * directories and parsing each info file for its keys, on the main
+ * thread as before and spread over threads as adapter.c does now.
+ * Creating the devices needs D-Bus and is deferred at startup anyway.
+ */
+#define LOAD_THREADS_MAX	8
+
+struct load_job {
+	char **filenames;
+	unsigned int count;
+	unsigned int next;
+	unsigned int keys;
+};
+
+static void load_info(struct load_job *job, const char *filename)
+{
+	static const char * const groups[] = {
+		"LinkKey", "LongTermKey", "IdentityResolvingKey",
+	};
+	GKeyFile *key_file;
+	unsigned int i;
+	char *str;
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+
+	str = g_key_file_get_string(key_file, "General", "AddressType",
+									NULL);
+	g_free(str);
+
+	for (i = 0; i < G_N_ELEMENTS(groups); i++) {
+		str = g_key_file_get_string(key_file, groups[i], "Key", NULL);
+		if (str)
+			__sync_fetch_and_add(&job->keys, 1);
+		g_free(str);
+	}
+
+	g_key_file_get_integer(key_file, "ConnectionParameters",
+							"MinInterval", NULL);
+
+	g_key_file_free(key_file);
+}
+
+static void *load_thread(void *user_data)
+{
+	struct load_job *job = user_data;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+		load_info(job, job->filenames[i]);
+
+	return NULL;
+}
+
+static double load_run(const char *dir, int nthreads, unsigned int *keys)
+{
+	struct load_job job;
+	pthread_t threads[LOAD_THREADS_MAX];
+	GPtrArray *filenames;
+	struct dirent *entry;
+	double start;
+	DIR *d;
+	int i, n = 0;
+
+	*keys = 0;
+	start = now();
+
+	d = opendir(dir);
+	if (!d)
+		return -1;
+
+	filenames = g_ptr_array_new_with_free_func(g_free);
+
+	while ((entry = readdir(d)) != NULL) {
+		if (bachk(entry->d_name) < 0)
+			continue;
+
+		g_ptr_array_add(filenames, g_strdup_printf("%s/%s/info", dir,
+							entry->d_name));
+	}
+
+	closedir(d);
+
+	memset(&job, 0, sizeof(job));
+	job.filenames = (char **) filenames->pdata;
+	job.count = filenames->len;
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[n], NULL, load_thread, &job) == 0)
+			n++;
+	}
+
+	load_thread(&job);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	start = now() - start;
+
+	g_ptr_array_free(filenames, TRUE);
+
+	*keys = job.keys;
+
+	return start;
+}
+
+/* opt_devices bonded LE devices in storage, best of 3 */
+static int bench_startup(void)
+{
+	char dir[256], path[PATH_MAX], *data;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads, run, i, err = 0;
+	unsigned int keys;
+	double elapsed, best;
+
+	storage_dir(dir, sizeof(dir));
+
+	for (i = 0; i < opt_devices; i++) {
+		snprintf(path, sizeof(path), "%s/00:00:00:00:%02X:%02X/info",
+						dir, i >> 8, i & 0xff);
+
+		data = g_strdup_printf("[General]\nName=Node %d\n"
+				"AddressType=static\n"
+				"SupportedTechnologies=LE;\n"
+				"Trusted=false\nBlocked=false\n\n"
+				"[LongTermKey]\nKey=%032X\n"
+				"Authenticated=0\nEncSize=16\n"
+				"EDiv=0\nRand=0\n\n"
+				"[IdentityResolvingKey]\nKey=%032X\n\n"
+				"[ConnectionParameters]\nMinInterval=24\n"
+				"MaxInterval=40\nLatency=0\nTimeout=42\n",
+				i, i, i);
+
+		create_file(path, S_IRUSR | S_IWUSR);
+		g_file_set_contents(path, data, -1, NULL);
+		g_free(data);
+	}
+
+	printf("startup: %d stored devices, %ld CPUs, best of 3\n",
+							opt_devices, cpus);
+
+	for (nthreads = 1; ; nthreads = MIN(cpus, LOAD_THREADS_MAX)) {
+		best = 0;
+
+		for (run = 0; run < 3; run++) {
+			elapsed = load_run(dir, nthreads, &keys);
+			if (elapsed < 0 ||
+				keys != (unsigned int) opt_devices * 2) {
+				fprintf(stderr, "Loaded %u keys\n", keys);
+				err = -1;
+				goto done;
+			}
+
+			if (!best || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("\t%d thread%s  %.1f ms, %.1f us per device\n",
+				nthreads, nthreads > 1 ? "s" : " ",
+				best * 1e3, best * 1e6 / opt_devices);
+
+		if (nthreads >= MIN(cpus, LOAD_THREADS_MAX))
+			break;
+	}
+
+done:
+	storage_dir_remove(dir);
+
+	return err;
+}
+
+/*
+ * Property signals
+ *
+ * device.c's coalescing of PropertiesChanged during discovery, with the
+ * emission counted instead of sent, as gdbus can not be linked here.
+ */
+struct prop_device {
+	uint32_t dirty;
+	guint id;
+	gint64 last;
+};
+
+static unsigned int prop_interval;
+static unsigned int prop_signals;
+
+static void prop_flush(struct prop_device *dev)
+{
+	/* gdbus merges all pending properties into one signal */
+	prop_signals++;
+
+	dev->dirty = 0;
+	dev->last = g_get_monotonic_time();
+}
+
+static gboolean prop_flush_timeout(gpointer user_data)
+{
+	struct prop_device *dev = user_data;
+
+	dev->id = 0;
+
+	prop_flush(dev);
+
+	return FALSE;
+}
+
+static void prop_changed(struct prop_device *dev, uint32_t prop)
+{
+	gint64 elapsed;
+
+	dev->dirty |= prop;
+
+	if (dev->id)
+		return;
+
+	elapsed = (g_get_monotonic_time() - dev->last) / 1000;
+
+	if (!prop_interval || elapsed >= prop_interval) {
+		prop_flush(dev);
+		return;
+	}
+
+	dev->id = g_timeout_add(prop_interval - elapsed, prop_flush_timeout,
+									dev);
+}
+
+/*
+ * opt_count adverts from opt_devices devices, opt_delay apart, each one
+ * changing RSSI and every tenth one also the name. Signals/s is counted
+ * over the run for a few DevicePropertyInterval values.
+ */
+static int bench_prop_signals(void)
+{
+	static const unsigned int intervals[] = { 0, 50, 200, 1000 };
+	struct prop_device *devices;
+	unsigned int j;
+	double start, elapsed;
+	int i;
+
+	devices = g_new0(struct prop_device, opt_devices);
+
+	printf("prop-signals: %d adverts from %d devices, %d us apart\n",
+					opt_count, opt_devices, opt_delay);
+
+	for (j = 0; j < G_N_ELEMENTS(intervals); j++) {
+		prop_interval = intervals[j];
+		prop_signals = 0;
+		memset(devices, 0, opt_devices * sizeof(*devices));
+
+		start = now();
+
+		for (i = 0; i < opt_count; i++) {
+			struct prop_device *dev = &devices[i % opt_devices];
+
+			if (opt_delay)
+				usleep(opt_delay);
+
+			prop_changed(dev, i % 10 ? 1 : 3);
+
+			dispatch_pending();
+		}
+
+		elapsed = now() - start;
+
+		for (i = 0; i < opt_devices; i++) {
+			if (devices[i].id)
+				g_source_remove(devices[i].id);
+		}
+
+		printf("\t%4u ms  %6u signals, %8.0f signals/s, "
+				"%.2f per advert\n", prop_interval,
+				prop_signals, prop_signals / elapsed,
+				(double) prop_signals / opt_count);
+	}
+
+	g_free(devices);
+
+	return 0;
+}
+
+/*
+ * Advertising data
+ *
+ * eir_parse(), which copies every field out, against the eir_view the
+ * advert path uses now, both run to the point of having the name, UUIDs
+ * and manufacturer data.
+ */
+static unsigned int eir_build_advert(uint8_t *buf)
+{
+	static const uint8_t advert[] = {
+		0x02, EIR_FLAGS, 0x06,
+		0x0a, EIR_NAME_COMPLETE, 'N', 'o', 'd', 'e', ' ', '1', '2',
+								'3', '4',
+		0x05, EIR_UUID16_ALL, 0x0f, 0x18, 0x0a, 0x18,
+		0x09, EIR_MANUFACTURER_DATA, 0x5c, 0x00, 0x00, 0x01, 0x02,
+							0x03, 0x04, 0x05,
+	};
+
+	memcpy(buf, advert, sizeof(advert));
+
+	return sizeof(advert);
+}
+
+/* A full EIR block with one field per UUID, as some stacks send them */
+static unsigned int eir_build_full(uint8_t *buf)
+{
+	unsigned int len = 0, i;
+
+	buf[len++] = 0x0a;
+	buf[len++] = EIR_NAME_COMPLETE;
+	memcpy(buf + len, "Node 1234", 9);
+	len += 9;
+
+	for (i = 0; len + 6 <= 200; i++) {
+		buf[len++] = 0x05;
+		buf[len++] = EIR_MANUFACTURER_DATA;
+		put_le16(0x005c + i, buf + len);
+		len += 2;
+		buf[len++] = i;
+		buf[len++] = i;
+	}
+
+	for (i = 0; len + 4 <= 255; i++) {
+		buf[len++] = 0x03;
+		buf[len++] = EIR_UUID16_SOME;
+		put_le16(0x1800 + i, buf + len);
+		len += 2;
+	}
+
+	return len;
+}
+
+static void eir_count_uuid(const bt_uuid_t *uuid, void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+}
+
+static void eir_count_msd(uint16_t company, const uint8_t *data,
+					uint8_t data_len, void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+}
+
+static double eir_run(const uint8_t *buf, unsigned int len, bool view,
+				unsigned int *uuids, unsigned int *msd)
+{
+	double start;
+	int i;
+
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		*uuids = 0;
+		*msd = 0;
+
+		if (view) {
+			struct eir_view eir;
+			char name[HCI_MAX_NAME_LENGTH + 1];
+
+			eir_parse_view(&eir, buf, len);
+			eir_view_get_name(&eir, name, sizeof(name));
+			eir_view_foreach_uuid(&eir, eir_count_uuid, uuids);
+			eir_view_foreach_msd(&eir, eir_count_msd, msd);
+		} else {
+			struct eir_data eir;
+
+			memset(&eir, 0, sizeof(eir));
+			eir_parse(&eir, buf, len);
+			*uuids = g_slist_length(eir.services);
+			*msd = g_slist_length(eir.msd_list);
+			eir_data_free(&eir);
+		}
+	}
+
+	return now() - start;
+}
+
+static int bench_eir_parse(void)
+{
+	static const char * const names[] = { "advert", "full EIR" };
+	uint8_t buf[HCI_MAX_EIR_LENGTH];
+	unsigned int len, uuids[2], msd[2];
+	double parse, view;
+	int i;
+
+	printf("eir-parse: %d parses\n", opt_count);
+
+	for (i = 0; i < 2; i++) {
+		len = i ? eir_build_full(buf) : eir_build_advert(buf);
+
+		parse = eir_run(buf, len, false, &uuids[0], &msd[0]);
+		view = eir_run(buf, len, true, &uuids[1], &msd[1]);
+
+		if (uuids[0] != uuids[1] || msd[0] != msd[1]) {
+			fprintf(stderr, "%s: view found %u UUIDs, %u MSD, "
+					"parse %u UUIDs, %u MSD\n", names[i],
+					uuids[1], msd[1], uuids[0], msd[0]);
+			return -1;
+		}
+
+		printf("\t%-9s%3u bytes, %2u UUIDs, %2u MSD  "
+				"eir_parse %5.0f ns  eir_view %5.0f ns\n",
+				names[i], len, uuids[0], msd[0],
+				parse * 1e9 / opt_count,
+				view * 1e9 / opt_count);
+	}
+
+	return 0;
+}
+
+/*
+ * Private address resolution
+ *
+ * One bt_crypto_ah() per IRK until one matches, on either backend,
+ * against the batched resolver, with a fresh RPA per advert so nothing
+ * is cached and with every device keeping its RPA. Each method runs for
+ * opt_count adverts or a second, whichever ends first.
+ */
+#define RPA_RUN_MAX	1.0
+
+struct rpa_run {
+	struct bt_crypto *crypto;
+	struct bt_crypto_resolver *resolver;
+	uint8_t (*irks)[16];
+	uint8_t (*rpas)[6];
+	unsigned int count;
+};
+
+static bool rpa_resolve_ah(struct rpa_run *run, const uint8_t rpa[6])
+{
+	uint8_t hash[3];
+	unsigned int i;
+
+	for (i = 0; i < run->count; i++) {
+		if (!bt_crypto_ah(run->crypto, run->irks[i], rpa + 3, hash))
+			return false;
+
+		if (!memcmp(hash, rpa, 3))
+			return true;
+	}
+
+	return false;
+}
+
+static double rpa_rate(struct rpa_run *run, bool resolver, int rpas)
+{
+	double start, elapsed = 0;
+	int i;
+
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		const uint8_t *rpa = run->rpas[i % rpas];
+		bool found;
+
+		if (resolver)
+			found = bt_crypto_resolver_resolve(run->resolver,
+								rpa) != NULL;
+		else
+			found = rpa_resolve_ah(run, rpa);
+
+		if (!found)
+			return -1;
+
+		elapsed = now() - start;
+		if (elapsed > RPA_RUN_MAX)
+			break;
+	}
+
+	return (i < opt_count ? i + 1 : i) / elapsed;
+}
+
+static int bench_rpa_resolve(void)
+{
+	static const unsigned int counts[] = { 10, 100, 1000 };
+	struct rpa_run run;
+	double af_alg, internal, cold, cached;
+	char af_alg_str[16];
+	unsigned int j, i;
+	int err = 0;
+
+	memset(&run, 0, sizeof(run));
+
+	run.crypto = bt_crypto_new();
+	if (!run.crypto) {
+		fprintf(stderr, "Failed to set up crypto\n");
+		return -1;
+	}
+
+	run.irks = g_malloc(counts[G_N_ELEMENTS(counts) - 1] *
+							sizeof(*run.irks));
+	run.rpas = g_malloc(opt_count * sizeof(*run.rpas));
+
+	printf("rpa-resolve: %d adverts, resolutions/s\n", opt_count);
+	printf("\t%6s %10s %10s %10s %10s\n", "IRKs", "AF_ALG",
+				"in-process", "resolver", "cached");
+
+	for (j = 0; j < G_N_ELEMENTS(counts); j++) {
+		run.count = counts[j];
+		run.resolver = bt_crypto_resolver_new();
+
+		bt_crypto_set_backend(run.crypto, BT_CRYPTO_BACKEND_INTERNAL);
+
+		for (i = 0; i < run.count; i++) {
+			bt_crypto_random_bytes(run.crypto, run.irks[i], 16);
+			bt_crypto_resolver_add_irk(run.resolver, run.irks[i],
+								run.irks[i]);
+		}
+
+		for (i = 0; i < (unsigned int) opt_count; i++) {
+			uint8_t *rpa = run.rpas[i];
+
+			bt_crypto_random_bytes(run.crypto, rpa + 3, 3);
+			rpa[5] = (rpa[5] & 0x3f) | 0x40;
+			bt_crypto_ah(run.crypto,
+					run.irks[advert_source(i, run.count)],
+					rpa + 3, rpa);
+		}
+
+		internal = rpa_rate(&run, false, opt_count);
+
+		if (bt_crypto_set_backend(run.crypto,
+						BT_CRYPTO_BACKEND_AF_ALG))
+			af_alg = rpa_rate(&run, false, opt_count);
+		else
+			af_alg = 0;
+
+		cold = rpa_rate(&run, true, opt_count);
+		cached = rpa_rate(&run, true, MIN(run.count, 64));
+
+		bt_crypto_resolver_free(run.resolver);
+
+		if (internal < 0 || af_alg < 0 || cold < 0 || cached < 0) {
+			fprintf(stderr, "RPA did not resolve\n");
+			err = -1;
+			break;
+		}
+
+		if (af_alg)
+			snprintf(af_alg_str, sizeof(af_alg_str), "%.0f",
+								af_alg);
+		else
+			strcpy(af_alg_str, "n/a");
+
+		printf("\t%6u %10s %10.0f %10.0f %10.0f\n", run.count,
+					af_alg_str, internal, cold, cached);
+	}
+
+	g_free(run.rpas);
+	g_free(run.irks);
+	bt_crypto_unref(run.crypto);
+
+	return err;
+}
+
+/*
+ * Signed Write Commands
+ *
+ * What a server does per Signed Write Command: decode the PDU, check
+ * that the sign counter went up and recompute the signature over opcode,
+ * handle and value. The PDUs are signed up front with one CSRK and
+ * consecutive counters, then verified on each backend, for the default
+ * MTU and for two larger ones.
+ */
+struct sign_run {
+	struct bt_crypto *crypto;
+	uint8_t csrk[16];
+	uint8_t *pdus;
+	uint16_t *lens;
+	size_t stride;
+};
+
+static double sign_verify_rate(struct sign_run *run)
+{
+	uint8_t value[ATT_MAX_VALUE_LEN];
+	uint8_t sig[ATT_SIGNATURE_LEN], check[ATT_SIGNATURE_LEN];
+	uint32_t cnt, next = 0;
+	uint16_t handle;
+	size_t vlen;
+	double start;
+	int i;
+
+	start = now();
+
+	for (i = 0; i < opt_count; i++) {
+		const uint8_t *pdu = run->pdus + i * run->stride;
+		uint16_t len = run->lens[i];
+
+		if (!dec_signed_write_cmd(pdu, len, &handle, value, &vlen,
+									sig))
+			return -1;
+
+		cnt = get_le32(sig);
+		if (cnt < next)
+			return -1;
+
+		next = cnt + 1;
+
+		if (!bt_crypto_sign_att(run->crypto, run->csrk, pdu,
+					len - ATT_SIGNATURE_LEN, cnt, check))
+			return -1;
+
+		if (memcmp(check, sig, sizeof(sig)))
+			return -1;
+	}
+
+	return opt_count / (now() - start);
+}
+
+static int bench_signed_write(void)
+{
+	static const uint16_t mtus[] = { ATT_DEFAULT_LE_MTU, 185, 517 };
+	struct sign_run run;
+	uint8_t value[ATT_MAX_VALUE_LEN];
+	double af_alg, internal;
+	char af_alg_str[16];
+	unsigned int j;
+	int i, err = 0;
+
+	memset(&run, 0, sizeof(run));
+
+	run.crypto = bt_crypto_new();
+	if (!run.crypto) {
+		fprintf(stderr, "Failed to set up crypto\n");
+		return -1;
+	}
+
+	bt_crypto_random_bytes(run.crypto, run.csrk, sizeof(run.csrk));
+	for (i = 0; i < (int) sizeof(value); i++)
+		value[i] = i;
+
+	run.stride = mtus[G_N_ELEMENTS(mtus) - 1];
+	run.pdus = g_malloc(opt_count * run.stride);
+	run.lens = g_malloc(opt_count * sizeof(*run.lens));
+
+	printf("signed-write: %d PDUs, verifications/s\n", opt_count);
+	printf("\t%6s %6s %10s %10s %10s\n", "MTU", "value", "AF_ALG",
+				"in-process", "MB/s");
+
+	for (j = 0; j < G_N_ELEMENTS(mtus); j++) {
+		size_t vlen = mtus[j] - 3 - ATT_SIGNATURE_LEN;
+
+		bt_crypto_set_backend(run.crypto, BT_CRYPTO_BACKEND_INTERNAL);
+
+		for (i = 0; i < opt_count; i++) {
+			run.lens[i] = enc_signed_write_cmd(BENCH_HANDLE, value,
+						vlen, run.crypto, run.csrk, i,
+						run.pdus + i * run.stride,
+						mtus[j]);
+			if (!run.lens[i]) {
+				fprintf(stderr, "Failed to sign PDU\n");
+				err = -1;
+				goto done;
+			}
+		}
+
+		internal = sign_verify_rate(&run);
+
+		if (bt_crypto_set_backend(run.crypto,
+						BT_CRYPTO_BACKEND_AF_ALG))
+			af_alg = sign_verify_rate(&run);
+		else
+			af_alg = 0;
+
+		if (internal < 0 || af_alg < 0) {
+			fprintf(stderr, "Signature did not verify\n");
+			err = -1;
+			break;
+		}
+
+		if (af_alg)
+			snprintf(af_alg_str, sizeof(af_alg_str), "%.0f",
+								af_alg);
+		else
+			strcpy(af_alg_str, "n/a");
+
+		printf("\t%6u %6zu %10s %10.0f %10.2f\n", mtus[j], vlen,
+				af_alg_str, internal,
+				internal * vlen / (1024 * 1024));
+	}
+
+done:
+	g_free(run.lens);
+	g_free(run.pdus);
+	bt_crypto_unref(run.crypto);
+
+	return err;
+}
+
+struct bench {
+	const char *name;
+	const char *desc;
+	int (*run)(void);
+};
+
+static const struct bench benches[] = {
+	{ "prepare-write", "Long writes through the Prepare Write queue",
+						bench_prepare_write },
+	{ "write-stream", "Write Requests against a Write Command stream",
+						bench_write_stream },
+	{ "btsnoop-write", "Capture records written directly and buffered",
+						bench_btsnoop_write },
+	{ "btsnoop-read", "Capture read back through read() and mmap",
+						bench_btsnoop_read },
+	{ "name-cache", "Cached device names stored per advert",
+						bench_name_cache },
+	{ "bond-storm", "Keys and device info stored for new bonds",
+						bench_bond_storm },
+	{ "device-lookup", "Known devices looked up per advert",
+						bench_device_lookup },
+	{ "found-set", "Found and connect list membership per advert",
+						bench_found_set },
+	{ "startup", "Stored devices parsed at adapter startup",
+						bench_startup },
+	{ "prop-signals", "PropertiesChanged signals during discovery",
+						bench_prop_signals },
+	{ "eir-parse", "Advertising data parsed with and without copies",
+						bench_eir_parse },
+	{ "rpa-resolve", "Private addresses resolved against bonded IRKs",
+						bench_rpa_resolve },
+	{ "signed-write", "Signed Write Commands verified per backend",
+						bench_signed_write },
+	{ }
+};
+
+static void usage(void)
+{
+	const struct bench *bench;
+
+	printf("bt_bench - Benchmarks for the provisioning code paths\n"
+		"Usage:\n");
+	printf("\tbt_bench [options] <benchmark>\n");
+	printf("Benchmarks:\n");
+
+	for (bench = benches; bench->name; bench++)
+		printf("\t%-20s%s\n", bench->name, bench->desc);
+
+	printf("Options:\n"
+		"\t-n, --count <count>        Number of iterations\n"
+		"\t-s, --size <bytes>         Value size\n"
+		"\t-m, --mtu <mtu>            ATT MTU\n"
+		"\t-d, --delay <us>           Peer delay before each response,\n"
+		"\t                           or the gap between captured packets\n"
+		"\t-D, --devices <count>      Number of remote devices\n"
+		"\t-h, --help                 Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "count",	required_argument,	NULL, 'n' },
+	{ "size",	required_argument,	NULL, 's' },
+	{ "mtu",	required_argument,	NULL, 'm' },
+	{ "delay",	required_argument,	NULL, 'd' },
+	{ "devices",	required_argument,	NULL, 'D' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	const struct bench *bench;
+	int err;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "n:s:m:d:D:h", main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'n':
+			opt_count = atoi(optarg);
+			break;
+		case 's':
+			opt_size = atoi(optarg);
+			break;
+		case 'm':
+			opt_mtu = atoi(optarg);
+			break;
+		case 'd':
+			opt_delay = atoi(optarg);
+			break;
+		case 'D':
+			opt_devices = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (opt_count <= 0 || opt_size <= 0 || opt_delay < 0 ||
+				opt_devices <= 0 || opt_devices > 0xffff ||
+				opt_mtu < ATT_DEFAULT_LE_MTU ||
+				opt_mtu > ATT_MAX_VALUE_LEN) {
+		fprintf(stderr, "Invalid parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	for (bench = benches; bench->name; bench++) {
+		if (!strcmp(bench->name, argv[optind]))
+			break;
+	}
+
+	if (!bench->name) {
+		fprintf(stderr, "Unknown benchmark %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	err = bench->run();
+
+	g_main_loop_unref(main_loop);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
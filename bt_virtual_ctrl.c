@@ -0,0 +1,1337 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Userspace stand-in for an LE controller.
+ *
+ * The controller speaks H:4 framed HCI either through /dev/vhci, in which
+ * case the kernel registers it as a regular hciX device, or through a pty
+ * that can be attached with hciattach/btattach. It synthesises advertising
+ * reports for a configurable population of Linksys nodes, accepts LE Create
+ * Connection for any of them and bridges the ATT fixed channel of each link
+ * to a bt_gatt_server carrying the simple provisioning service, so the
+ * scanner and the provisioning path can run without any radio.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/uuid.h"
+
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-server.h"
+
+#define VHCI_DEV		"/dev/vhci"
+
+#define MAX_CONN		8
+#define FIRST_CONN_HANDLE	0x0040
+#define ACL_PKT_LEN		251
+#define ACL_MAX_PKT		8
+#define ATT_CID			0x0004
+
+#define MANU_TYPE		0x005C
+#define OTHER_MANU_TYPE		0x004C
+#define EIR_FLAGS		0x01
+#define EIR_NAME_COMPLETE	0x09
+#define EIR_MANUFACTURE_SPECIFIC	0xFF
+
+#define SIMPLE_SVC_UUID		0xfff0
+#define SIMPLE_READ1_CHAR_UUID	0xfff1
+#define SIMPLE_READ2_CHAR_UUID	0xfff2
+#define SIMPLE_WRITE_CHAR_UUID	0xfff3
+#define SIMPLE_NOTIFY_CHAR_UUID	0xfff4
+
+struct vdev {
+	bdaddr_t bdaddr;
+	uint8_t type;
+	uint8_t status;
+	int8_t rssi;
+	uint16_t company;
+	gboolean reported;
+};
+
+struct pkt {
+	gint64 due;
+	size_t len;
+	uint8_t data[0];
+};
+
+struct vconn {
+	uint16_t handle;
+	struct vdev *dev;
+	uint16_t interval;
+	uint16_t latency;
+	uint16_t timeout;
+	int fd;
+	GIOChannel *io;
+	guint watch;
+	struct gatt_db *db;
+	struct bt_att *att;
+	struct bt_gatt_server *server;
+	uint8_t rx[ACL_PKT_LEN + 4 + BT_ATT_MAX_LE_MTU];
+	size_t rx_len;
+	struct queue *to_host;
+	struct queue *to_server;
+	guint timer;
+	unsigned int writes;
+	size_t bytes;
+};
+
+static int opt_devices = 16;
+static int opt_latency = 0;
+static int opt_adv_interval = 100;
+static int opt_reports = 1;
+static int opt_match_every = 1;
+static int opt_write_delay = 0;
+static bdaddr_t opt_base = {{ 0x0B, 0x71, 0xDA, 0x7D, 0x1A, 0x00 }};
+static bdaddr_t ctrl_bdaddr = {{ 0x01, 0x00, 0x00, 0xC0, 0xFF, 0x00 }};
+
+static GMainLoop *main_loop;
+static int hci_fd = -1;
+static uint8_t hci_buf[HCI_MAX_FRAME_SIZE * 2];
+static size_t hci_len;
+
+static struct vdev *devices;
+static struct vconn conns[MAX_CONN];
+static uint8_t scan_type;
+static gboolean scan_enabled;
+static gboolean scan_filter_dup;
+static guint adv_timer;
+static unsigned int adv_next;
+static gboolean connect_pending;
+static struct vdev *pending_connect;
+static guint connect_timer;
+
+static void send_packet(const void *data, size_t len)
+{
+	ssize_t written;
+
+	written = write(hci_fd, data, len);
+	if (written < 0)
+		fprintf(stderr, "HCI write failed: %s\n", strerror(errno));
+}
+
+static void send_event(uint8_t evt, const void *data, uint8_t len)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE + 1 + HCI_EVENT_HDR_SIZE];
+	hci_event_hdr *hdr = (void *) (buf + 1);
+
+	buf[0] = HCI_EVENT_PKT;
+	hdr->evt = evt;
+	hdr->plen = len;
+	if (len)
+		memcpy(buf + 1 + HCI_EVENT_HDR_SIZE, data, len);
+
+	send_packet(buf, 1 + HCI_EVENT_HDR_SIZE + len);
+}
+
+static void send_le_meta(uint8_t subevent, const void *data, uint8_t len)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+
+	buf[0] = subevent;
+	memcpy(buf + 1, data, len);
+
+	send_event(EVT_LE_META_EVENT, buf, len + 1);
+}
+
+static void cmd_complete(uint16_t opcode, const void *rp, uint8_t len)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	evt_cmd_complete *cc = (void *) buf;
+
+	cc->ncmd = 1;
+	cc->opcode = htobs(opcode);
+	memcpy(buf + EVT_CMD_COMPLETE_SIZE, rp, len);
+
+	send_event(EVT_CMD_COMPLETE, buf, EVT_CMD_COMPLETE_SIZE + len);
+}
+
+static void cmd_status(uint16_t opcode, uint8_t status)
+{
+	evt_cmd_status cs;
+
+	cs.status = status;
+	cs.ncmd = 1;
+	cs.opcode = htobs(opcode);
+
+	send_event(EVT_CMD_STATUS, &cs, EVT_CMD_STATUS_SIZE);
+}
+
+static void cmd_complete_status(uint16_t opcode, uint8_t status)
+{
+	cmd_complete(opcode, &status, 1);
+}
+
+static gint64 link_delay(struct vconn *conn)
+{
+	/* A PDU waits for the next connection event before it goes out */
+	gint64 delay = conn->interval * 1250;
+
+	return MAX(delay, (gint64) opt_latency * 1000);
+}
+
+static uint8_t build_adv_data(struct vdev *dev, uint8_t *ad)
+{
+	uint8_t len = 0;
+
+	ad[len++] = 2;
+	ad[len++] = EIR_FLAGS;
+	ad[len++] = 0x06;
+
+	/* Company ID, device type and provisioning status */
+	ad[len++] = 5;
+	ad[len++] = EIR_MANUFACTURE_SPECIFIC;
+	put_le16(dev->company, ad + len);
+	len += 2;
+	ad[len++] = dev->type;
+	ad[len++] = dev->status;
+
+	return len;
+}
+
+static uint8_t build_scan_rsp(struct vdev *dev, uint8_t *ad)
+{
+	char name[HCI_MAX_NAME_LENGTH];
+	int n;
+
+	n = snprintf(name, sizeof(name), "Linksys-%02X%02X",
+					dev->bdaddr.b[1], dev->bdaddr.b[0]);
+
+	ad[0] = n + 1;
+	ad[1] = EIR_NAME_COMPLETE;
+	memcpy(ad + 2, name, n);
+
+	return n + 2;
+}
+
+static size_t add_report(uint8_t *buf, uint8_t evt_type, struct vdev *dev)
+{
+	le_advertising_info *info = (void *) buf;
+
+	info->evt_type = evt_type;
+	info->bdaddr_type = LE_PUBLIC_ADDRESS;
+	bacpy(&info->bdaddr, &dev->bdaddr);
+
+	if (evt_type == 0x04)
+		info->length = build_scan_rsp(dev, info->data);
+	else
+		info->length = build_adv_data(dev, info->data);
+
+	/* RSSI trails the data of each report */
+	info->data[info->length] = (uint8_t) dev->rssi;
+
+	return LE_ADVERTISING_INFO_SIZE + info->length + 1;
+}
+
+static gboolean adv_timeout(gpointer user_data)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	size_t len = 1;
+	int i, adverts = 0, num = 0;
+
+	/*
+	 * Pack up to opt_reports advertising reports in one event, walking
+	 * the device population round robin. In active scanning every
+	 * advertising report is followed by a scan response from the same
+	 * device, which does not count against opt_reports.
+	 */
+	for (i = 0; i < opt_devices && adverts < opt_reports; i++) {
+		struct vdev *dev = &devices[adv_next];
+
+		adv_next = (adv_next + 1) % opt_devices;
+
+		if (scan_filter_dup && dev->reported)
+			continue;
+
+		if (len + 2 * (LE_ADVERTISING_INFO_SIZE + 32) >
+						HCI_MAX_EVENT_SIZE - 1)
+			break;
+
+		len += add_report(buf + len, 0x00, dev);
+		adverts++;
+		num++;
+
+		if (scan_type == 0x01) {
+			len += add_report(buf + len, 0x04, dev);
+			num++;
+		}
+
+		dev->reported = TRUE;
+	}
+
+	if (num == 0)
+		return TRUE;
+
+	buf[0] = num;
+	send_le_meta(EVT_LE_ADVERTISING_REPORT, buf, len);
+
+	return TRUE;
+}
+
+static void set_scan_enable(gboolean enable, gboolean filter_dup)
+{
+	int i;
+
+	scan_filter_dup = filter_dup;
+
+	if (enable == scan_enabled)
+		return;
+
+	scan_enabled = enable;
+
+	if (!enable) {
+		g_source_remove(adv_timer);
+		adv_timer = 0;
+		return;
+	}
+
+	for (i = 0; i < opt_devices; i++)
+		devices[i].reported = FALSE;
+
+	adv_timer = g_timeout_add(opt_adv_interval, adv_timeout, NULL);
+}
+
+static struct vdev *find_device(const bdaddr_t *bdaddr)
+{
+	int i;
+
+	for (i = 0; i < opt_devices; i++) {
+		if (!bacmp(&devices[i].bdaddr, bdaddr))
+			return &devices[i];
+	}
+
+	return NULL;
+}
+
+static struct vconn *find_conn(uint16_t handle)
+{
+	int i;
+
+	for (i = 0; i < MAX_CONN; i++) {
+		if (conns[i].dev && conns[i].handle == handle)
+			return &conns[i];
+	}
+
+	return NULL;
+}
+
+static void free_pkt(void *data)
+{
+	g_free(data);
+}
+
+static void conn_flush(struct vconn *conn);
+
+static gboolean conn_timeout(gpointer user_data)
+{
+	struct vconn *conn = user_data;
+
+	conn->timer = 0;
+	conn_flush(conn);
+
+	return FALSE;
+}
+
+static void conn_schedule(struct vconn *conn)
+{
+	struct pkt *a = queue_peek_head(conn->to_host);
+	struct pkt *b = queue_peek_head(conn->to_server);
+	gint64 due, now;
+
+	if (conn->timer || (!a && !b))
+		return;
+
+	if (a && b)
+		due = MIN(a->due, b->due);
+	else
+		due = a ? a->due : b->due;
+
+	now = g_get_monotonic_time();
+	conn->timer = g_timeout_add(due > now ? (due - now + 999) / 1000 : 0,
+							conn_timeout, conn);
+}
+
+static void conn_flush(struct vconn *conn)
+{
+	gint64 now = g_get_monotonic_time();
+	struct pkt *pkt;
+
+	while ((pkt = queue_peek_head(conn->to_host)) && pkt->due <= now) {
+		queue_pop_head(conn->to_host);
+		send_packet(pkt->data, pkt->len);
+		g_free(pkt);
+	}
+
+	while ((pkt = queue_peek_head(conn->to_server)) && pkt->due <= now) {
+		queue_pop_head(conn->to_server);
+		if (write(conn->fd, pkt->data, pkt->len) < 0)
+			fprintf(stderr, "ATT write failed: %s\n",
+							strerror(errno));
+		g_free(pkt);
+	}
+
+	conn_schedule(conn);
+}
+
+static void conn_queue(struct vconn *conn, struct queue *queue,
+						const void *data, size_t len)
+{
+	struct pkt *pkt;
+
+	pkt = g_malloc(sizeof(*pkt) + len);
+	pkt->due = g_get_monotonic_time() + link_delay(conn);
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+
+	queue_push_tail(queue, pkt);
+	conn_schedule(conn);
+}
+
+static gboolean att_read_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct vconn *conn = user_data;
+	uint8_t pdu[4 + BT_ATT_MAX_LE_MTU];
+	uint8_t buf[1 + HCI_ACL_HDR_SIZE + ACL_PKT_LEN];
+	hci_acl_hdr *acl = (void *) (buf + 1);
+	size_t offset, frag;
+	ssize_t len;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		conn->watch = 0;
+		return FALSE;
+	}
+
+	len = read(conn->fd, pdu + 4, BT_ATT_MAX_LE_MTU);
+	if (len <= 0)
+		return TRUE;
+
+	put_le16(len, pdu);
+	put_le16(ATT_CID, pdu + 2);
+	len += 4;
+
+	/* Split the L2CAP frame into fragments the host buffers can take */
+	buf[0] = HCI_ACLDATA_PKT;
+
+	for (offset = 0; offset < (size_t) len; offset += frag) {
+		frag = MIN(len - offset, ACL_PKT_LEN);
+
+		acl->handle = htobs(acl_handle_pack(conn->handle,
+					offset ? ACL_CONT : ACL_START));
+		acl->dlen = htobs(frag);
+		memcpy(buf + 1 + HCI_ACL_HDR_SIZE, pdu + offset, frag);
+
+		conn_queue(conn, conn->to_host, buf,
+						1 + HCI_ACL_HDR_SIZE + frag);
+	}
+
+	return TRUE;
+}
+
+static void read_cb(struct gatt_db_attribute *attrib, unsigned int id,
+					uint16_t offset, uint8_t opcode,
+					bdaddr_t *bdaddr, void *user_data)
+{
+	const char *value = user_data;
+	size_t len = strlen(value);
+
+	if (offset > len) {
+		gatt_db_attribute_read_result(attrib, id,
+					BT_ATT_ERROR_INVALID_OFFSET, NULL, 0);
+		return;
+	}
+
+	gatt_db_attribute_read_result(attrib, id, 0,
+				(const uint8_t *) value + offset, len - offset);
+}
+
+struct write_result {
+	struct gatt_db *db;
+	struct gatt_db_attribute *attrib;
+	unsigned int id;
+};
+
+static gboolean write_result_cb(gpointer user_data)
+{
+	struct write_result *result = user_data;
+
+	gatt_db_attribute_write_result(result->attrib, result->id, 0);
+	gatt_db_unref(result->db);
+	g_free(result);
+
+	return FALSE;
+}
+
+static void write_cb(struct gatt_db_attribute *attrib, unsigned int id,
+				uint16_t offset, const uint8_t *value,
+				size_t len, uint8_t opcode, bdaddr_t *bdaddr,
+				void *user_data)
+{
+	struct vconn *conn = user_data;
+	struct write_result *result;
+
+	conn->writes++;
+	conn->bytes += len;
+
+	if (opcode == BT_ATT_OP_WRITE_CMD)
+		return;
+
+	if (!opt_write_delay) {
+		gatt_db_attribute_write_result(attrib, id, 0);
+		return;
+	}
+
+	/* The link may go away before the response is due */
+	result = g_new0(struct write_result, 1);
+	result->db = gatt_db_ref(conn->db);
+	result->attrib = attrib;
+	result->id = id;
+	g_timeout_add(opt_write_delay, write_result_cb, result);
+}
+
+/*
+ * Every link gets a database of its own, so that a write can be accounted
+ * to the link it arrived on.
+ */
+static struct gatt_db *populate_db(struct vconn *conn)
+{
+	struct gatt_db_attribute *svc;
+	struct gatt_db *db;
+	bt_uuid_t uuid;
+
+	db = gatt_db_new();
+
+	bt_uuid16_create(&uuid, SIMPLE_SVC_UUID);
+	svc = gatt_db_add_service(db, &uuid, true, 10);
+
+	bt_uuid16_create(&uuid, SIMPLE_READ1_CHAR_UUID);
+	gatt_db_service_add_characteristic(svc, &uuid, BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ, read_cb, NULL,
+					"read1");
+
+	bt_uuid16_create(&uuid, SIMPLE_READ2_CHAR_UUID);
+	gatt_db_service_add_characteristic(svc, &uuid, BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ, read_cb, NULL,
+					"read2");
+
+	bt_uuid16_create(&uuid, SIMPLE_WRITE_CHAR_UUID);
+	gatt_db_service_add_characteristic(svc, &uuid, BT_ATT_PERM_WRITE,
+					BT_GATT_CHRC_PROP_WRITE |
+					BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP,
+					NULL, write_cb, conn);
+
+	bt_uuid16_create(&uuid, SIMPLE_NOTIFY_CHAR_UUID);
+	gatt_db_service_add_characteristic(svc, &uuid, BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_NOTIFY, NULL, NULL,
+					NULL);
+
+	gatt_db_service_set_active(svc, true);
+
+	return db;
+}
+
+static struct vconn *conn_new(struct vdev *dev,
+					const le_create_connection_cp *cp)
+{
+	struct vconn *conn = NULL;
+	int i, fds[2];
+
+	for (i = 0; i < MAX_CONN; i++) {
+		if (!conns[i].dev) {
+			conn = &conns[i];
+			break;
+		}
+	}
+
+	if (!conn)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+		return NULL;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->handle = FIRST_CONN_HANDLE + i;
+	conn->dev = dev;
+	conn->interval = btohs(cp->max_interval);
+	conn->latency = btohs(cp->latency);
+	conn->timeout = btohs(cp->supervision_timeout);
+	conn->fd = fds[0];
+	conn->to_host = queue_new();
+	conn->to_server = queue_new();
+
+	conn->db = populate_db(conn);
+	conn->att = bt_att_new(fds[1]);
+	bt_att_set_close_on_unref(conn->att, true);
+	conn->server = bt_gatt_server_new(conn->db, conn->att,
+							BT_ATT_MAX_LE_MTU);
+
+	conn->io = g_io_channel_unix_new(conn->fd);
+	conn->watch = g_io_add_watch(conn->io,
+					G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+					att_read_cb, conn);
+
+	return conn;
+}
+
+static void conn_print_params(struct vconn *conn)
+{
+	char addr[18];
+
+	ba2str(&conn->dev->bdaddr, addr);
+	printf("%s handle 0x%04x: interval %u.%02u ms, latency %u, "
+				"timeout %u ms\n", addr, conn->handle,
+				conn->interval * 125 / 100,
+				conn->interval * 125 % 100, conn->latency,
+				conn->timeout * 10);
+}
+
+static void conn_free(struct vconn *conn)
+{
+	char addr[18];
+
+	ba2str(&conn->dev->bdaddr, addr);
+	printf("%s handle 0x%04x: %u writes, %zu bytes\n", addr,
+					conn->handle, conn->writes, conn->bytes);
+
+	if (conn->timer)
+		g_source_remove(conn->timer);
+
+	if (conn->watch)
+		g_source_remove(conn->watch);
+
+	g_io_channel_unref(conn->io);
+	close(conn->fd);
+
+	bt_gatt_server_unref(conn->server);
+	bt_att_unref(conn->att);
+	gatt_db_unref(conn->db);
+
+	queue_destroy(conn->to_host, free_pkt);
+	queue_destroy(conn->to_server, free_pkt);
+
+	memset(conn, 0, sizeof(*conn));
+}
+
+static le_create_connection_cp connect_cp;
+
+static gboolean connect_timeout(gpointer user_data)
+{
+	evt_le_connection_complete evt;
+	struct vconn *conn;
+
+	connect_timer = 0;
+	connect_pending = FALSE;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.role = 0x00;
+	evt.peer_bdaddr_type = connect_cp.peer_bdaddr_type;
+	bacpy(&evt.peer_bdaddr, &connect_cp.peer_bdaddr);
+
+	conn = conn_new(pending_connect, &connect_cp);
+	pending_connect = NULL;
+
+	if (!conn) {
+		evt.status = HCI_REJECTED_LIMITED_RESOURCES;
+	} else {
+		evt.handle = htobs(conn->handle);
+		evt.interval = htobs(conn->interval);
+		evt.latency = htobs(conn->latency);
+		evt.supervision_timeout = htobs(conn->timeout);
+		conn_print_params(conn);
+	}
+
+	send_le_meta(EVT_LE_CONN_COMPLETE, &evt, EVT_LE_CONN_COMPLETE_SIZE);
+
+	return FALSE;
+}
+
+static void le_create_conn(uint16_t opcode, const void *data, uint8_t len)
+{
+	const le_create_connection_cp *cp = data;
+	struct vdev *dev;
+
+	if (len < LE_CREATE_CONN_CP_SIZE || connect_pending) {
+		cmd_status(opcode, HCI_COMMAND_DISALLOWED);
+		return;
+	}
+
+	cmd_status(opcode, 0);
+
+	memcpy(&connect_cp, cp, sizeof(connect_cp));
+	connect_pending = TRUE;
+
+	/* Unknown peers never answer; the host cancels on its own timeout */
+	dev = find_device(&cp->peer_bdaddr);
+	if (!dev)
+		return;
+
+	pending_connect = dev;
+
+	/* Connection setup takes the first connection event to complete */
+	connect_timer = g_timeout_add(MAX(opt_latency,
+					btohs(cp->max_interval) * 5 / 4),
+					connect_timeout, NULL);
+}
+
+static void le_create_conn_cancel(uint16_t opcode)
+{
+	evt_le_connection_complete evt;
+
+	if (!connect_pending) {
+		cmd_complete_status(opcode, HCI_COMMAND_DISALLOWED);
+		return;
+	}
+
+	if (connect_timer) {
+		g_source_remove(connect_timer);
+		connect_timer = 0;
+	}
+
+	cmd_complete_status(opcode, 0);
+
+	memset(&evt, 0, sizeof(evt));
+	evt.status = HCI_NO_CONNECTION;
+	evt.peer_bdaddr_type = connect_cp.peer_bdaddr_type;
+	bacpy(&evt.peer_bdaddr, &connect_cp.peer_bdaddr);
+	connect_pending = FALSE;
+	pending_connect = NULL;
+
+	send_le_meta(EVT_LE_CONN_COMPLETE, &evt, EVT_LE_CONN_COMPLETE_SIZE);
+}
+
+static void le_conn_update(uint16_t opcode, const void *data, uint8_t len)
+{
+	const le_connection_update_cp *cp = data;
+	evt_le_connection_update_complete evt;
+	struct vconn *conn;
+
+	conn = len < LE_CONN_UPDATE_CP_SIZE ? NULL :
+					find_conn(btohs(cp->handle));
+	if (!conn) {
+		cmd_status(opcode, HCI_NO_CONNECTION);
+		return;
+	}
+
+	cmd_status(opcode, 0);
+
+	/* Honour the request by taking the largest allowed interval */
+	conn->interval = btohs(cp->max_interval);
+	conn->latency = btohs(cp->latency);
+	conn->timeout = btohs(cp->supervision_timeout);
+	conn_print_params(conn);
+
+	evt.status = 0;
+	evt.handle = cp->handle;
+	evt.interval = htobs(conn->interval);
+	evt.latency = htobs(conn->latency);
+	evt.supervision_timeout = htobs(conn->timeout);
+
+	send_le_meta(EVT_LE_CONN_UPDATE_COMPLETE, &evt,
+					EVT_LE_CONN_UPDATE_COMPLETE_SIZE);
+}
+
+static void le_read_remote_features(uint16_t opcode, const void *data,
+								uint8_t len)
+{
+	const le_read_remote_used_features_cp *cp = data;
+	evt_le_read_remote_used_features_complete evt;
+
+	if (len < LE_READ_REMOTE_USED_FEATURES_CP_SIZE ||
+					!find_conn(btohs(cp->handle))) {
+		cmd_status(opcode, HCI_NO_CONNECTION);
+		return;
+	}
+
+	cmd_status(opcode, 0);
+
+	memset(&evt, 0, sizeof(evt));
+	evt.handle = cp->handle;
+
+	send_le_meta(EVT_LE_READ_REMOTE_USED_FEATURES_COMPLETE, &evt,
+			EVT_LE_READ_REMOTE_USED_FEATURES_COMPLETE_SIZE);
+}
+
+static void disconnect(uint16_t opcode, const void *data, uint8_t len)
+{
+	const disconnect_cp *cp = data;
+	evt_disconn_complete evt;
+	struct vconn *conn;
+
+	conn = len < DISCONNECT_CP_SIZE ? NULL : find_conn(btohs(cp->handle));
+	if (!conn) {
+		cmd_status(opcode, HCI_NO_CONNECTION);
+		return;
+	}
+
+	cmd_status(opcode, 0);
+	conn_free(conn);
+
+	evt.status = 0;
+	evt.handle = cp->handle;
+	evt.reason = HCI_CONNECTION_TERMINATED;
+
+	send_event(EVT_DISCONN_COMPLETE, &evt, EVT_DISCONN_COMPLETE_SIZE);
+}
+
+static void reset(void)
+{
+	int i;
+
+	set_scan_enable(FALSE, FALSE);
+
+	if (connect_timer) {
+		g_source_remove(connect_timer);
+		connect_timer = 0;
+	}
+
+	connect_pending = FALSE;
+	pending_connect = NULL;
+
+	for (i = 0; i < MAX_CONN; i++) {
+		if (conns[i].dev)
+			conn_free(&conns[i]);
+	}
+}
+
+static void process_cmd(const uint8_t *data, size_t size)
+{
+	const hci_command_hdr *hdr = (const void *) data;
+	const uint8_t *param = data + HCI_COMMAND_HDR_SIZE;
+	uint16_t opcode = btohs(hdr->opcode);
+	uint8_t plen = hdr->plen;
+
+	switch (opcode) {
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_RESET):
+		reset();
+		cmd_complete_status(opcode, 0);
+		break;
+	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION): {
+		read_local_version_rp rp;
+
+		memset(&rp, 0, sizeof(rp));
+		rp.hci_ver = 0x06;
+		rp.lmp_ver = 0x06;
+		rp.manufacturer = htobs(0x003f);
+		cmd_complete(opcode, &rp, READ_LOCAL_VERSION_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_COMMANDS): {
+		read_local_commands_rp rp;
+
+		/* Only the mandatory commands, keeps host init minimal */
+		memset(&rp, 0, sizeof(rp));
+		cmd_complete(opcode, &rp, READ_LOCAL_COMMANDS_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_FEATURES): {
+		read_local_features_rp rp;
+
+		/* LE Supported (Controller), BR/EDR Not Supported */
+		memset(&rp, 0, sizeof(rp));
+		rp.features[4] = 0x60;
+		cmd_complete(opcode, &rp, READ_LOCAL_FEATURES_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_EXT_FEATURES): {
+		read_local_ext_features_rp rp;
+
+		memset(&rp, 0, sizeof(rp));
+		rp.page_num = plen ? param[0] : 0;
+		if (rp.page_num == 0)
+			rp.features[4] = 0x60;
+		cmd_complete(opcode, &rp, READ_LOCAL_EXT_FEATURES_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE): {
+		read_buffer_size_rp rp;
+
+		/* No BR/EDR buffers, the host falls back to the LE ones */
+		memset(&rp, 0, sizeof(rp));
+		cmd_complete(opcode, &rp, READ_BUFFER_SIZE_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BD_ADDR): {
+		read_bd_addr_rp rp;
+
+		rp.status = 0;
+		bacpy(&rp.bdaddr, &ctrl_bdaddr);
+		cmd_complete(opcode, &rp, READ_BD_ADDR_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_BUFFER_SIZE): {
+		le_read_buffer_size_rp rp;
+
+		rp.status = 0;
+		rp.pkt_len = htobs(ACL_PKT_LEN);
+		rp.max_pkt = ACL_MAX_PKT;
+		cmd_complete(opcode, &rp, LE_READ_BUFFER_SIZE_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES):
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_SUPPORTED_STATES):
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_RAND): {
+		uint8_t rp[9];
+		int i;
+
+		memset(rp, 0, sizeof(rp));
+		if (opcode == cmd_opcode_pack(OGF_LE_CTL, OCF_LE_RAND)) {
+			for (i = 1; i < 9; i++)
+				rp[i] = rand();
+		}
+		cmd_complete(opcode, rp, sizeof(rp));
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_WHITE_LIST_SIZE): {
+		le_read_white_list_size_rp rp;
+
+		rp.status = 0;
+		rp.size = 8;
+		cmd_complete(opcode, &rp, LE_READ_WHITE_LIST_SIZE_RP_SIZE);
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_ADVERTISING_CHANNEL_TX_POWER): {
+		uint8_t rp[2] = { 0x00, 0x00 };
+
+		cmd_complete(opcode, rp, sizeof(rp));
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS): {
+		const le_set_scan_parameters_cp *cp = (const void *) param;
+
+		if (plen >= LE_SET_SCAN_PARAMETERS_CP_SIZE)
+			scan_type = cp->type;
+		cmd_complete_status(opcode, 0);
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE): {
+		const le_set_scan_enable_cp *cp = (const void *) param;
+
+		if (plen < LE_SET_SCAN_ENABLE_CP_SIZE) {
+			cmd_complete_status(opcode, HCI_INVALID_PARAMETERS);
+			break;
+		}
+
+		cmd_complete_status(opcode, 0);
+		set_scan_enable(cp->enable, cp->filter_dup);
+		break;
+	}
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CREATE_CONN):
+		le_create_conn(opcode, param, plen);
+		break;
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CREATE_CONN_CANCEL):
+		le_create_conn_cancel(opcode);
+		break;
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CONN_UPDATE):
+		le_conn_update(opcode, param, plen);
+		break;
+	case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_REMOTE_USED_FEATURES):
+		le_read_remote_features(opcode, param, plen);
+		break;
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_DISCONNECT):
+		disconnect(opcode, param, plen);
+		break;
+	default:
+		/*
+		 * Event masks, host support bits and the like: accept them
+		 * without side effects.
+		 */
+		cmd_complete_status(opcode, 0);
+		break;
+	}
+}
+
+static void process_acl(const uint8_t *data, size_t size)
+{
+	const hci_acl_hdr *hdr = (const void *) data;
+	uint16_t handle = btohs(hdr->handle);
+	uint16_t dlen = btohs(hdr->dlen);
+	struct {
+		uint8_t num_hndl;
+		uint16_t handle;
+		uint16_t count;
+	} __attribute__ ((packed)) ncp;
+	struct vconn *conn;
+	uint16_t l2len;
+
+	conn = find_conn(acl_handle(handle));
+	if (!conn)
+		return;
+
+	/* Give the buffer back to the host right away */
+	ncp.num_hndl = 1;
+	ncp.handle = htobs(conn->handle);
+	ncp.count = htobs(1);
+	send_event(EVT_NUM_COMP_PKTS, &ncp, sizeof(ncp));
+
+	if (acl_flags(handle) != ACL_CONT)
+		conn->rx_len = 0;
+
+	if (conn->rx_len + dlen > sizeof(conn->rx)) {
+		conn->rx_len = 0;
+		return;
+	}
+
+	memcpy(conn->rx + conn->rx_len, data + HCI_ACL_HDR_SIZE, dlen);
+	conn->rx_len += dlen;
+
+	if (conn->rx_len < 4)
+		return;
+
+	l2len = get_le16(conn->rx);
+	if (conn->rx_len < (size_t) l2len + 4)
+		return;
+
+	/* Only the ATT fixed channel is bridged, signalling is dropped */
+	if (get_le16(conn->rx + 2) == ATT_CID)
+		conn_queue(conn, conn->to_server, conn->rx + 4, l2len);
+
+	conn->rx_len = 0;
+}
+
+/* Returns the size of the H:4 packet at the head of buf, 0 if partial */
+static size_t h4_packet_len(const uint8_t *buf, size_t len)
+{
+	size_t hlen;
+
+	if (len < 1)
+		return 0;
+
+	switch (buf[0]) {
+	case HCI_COMMAND_PKT:
+		hlen = 1 + HCI_COMMAND_HDR_SIZE;
+		if (len < hlen)
+			return 0;
+		hlen += buf[3];
+		break;
+	case HCI_ACLDATA_PKT:
+		hlen = 1 + HCI_ACL_HDR_SIZE;
+		if (len < hlen)
+			return 0;
+		hlen += get_le16(buf + 3);
+		break;
+	case HCI_VENDOR_PKT:
+		/* vhci device creation reply: opcode and index */
+		hlen = 4;
+		break;
+	default:
+		return len;
+	}
+
+	return len < hlen ? 0 : hlen;
+}
+
+static gboolean hci_read_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	ssize_t len;
+	size_t plen, off = 0;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		g_main_loop_quit(main_loop);
+		return FALSE;
+	}
+
+	len = read(hci_fd, hci_buf + hci_len, sizeof(hci_buf) - hci_len);
+	if (len <= 0)
+		return TRUE;
+
+	hci_len += len;
+
+	while ((plen = h4_packet_len(hci_buf + off, hci_len - off)) > 0) {
+		const uint8_t *pkt = hci_buf + off;
+
+		if (pkt[0] == HCI_COMMAND_PKT)
+			process_cmd(pkt + 1, plen - 1);
+		else if (pkt[0] == HCI_ACLDATA_PKT)
+			process_acl(pkt + 1, plen - 1);
+
+		off += plen;
+	}
+
+	memmove(hci_buf, hci_buf + off, hci_len - off);
+	hci_len -= off;
+
+	return TRUE;
+}
+
+static int open_vhci(void)
+{
+	uint8_t create[2] = { HCI_VENDOR_PKT, HCI_BREDR };
+	int fd;
+
+	fd = open(VHCI_DEV, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Failed to open " VHCI_DEV);
+		return -1;
+	}
+
+	if (write(fd, create, sizeof(create)) < 0) {
+		perror("Failed to create virtual controller");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int open_pty(void)
+{
+	struct termios ti;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror("Failed to create pty");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	tcgetattr(fd, &ti);
+	cfmakeraw(&ti);
+	tcsetattr(fd, TCSANOW, &ti);
+
+	printf("Attach with: btattach -B %s\n", ptsname(fd));
+
+	return fd;
+}
+
+static gboolean signal_handler(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct signalfd_siginfo si;
+	ssize_t result;
+	int fd;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		return FALSE;
+
+	fd = g_io_channel_unix_get_fd(channel);
+
+	result = read(fd, &si, sizeof(si));
+	if (result != sizeof(si))
+		return FALSE;
+
+	switch (si.ssi_signo) {
+	case SIGINT:
+	case SIGTERM:
+		g_main_loop_quit(main_loop);
+		break;
+	}
+
+	return TRUE;
+}
+
+static guint setup_signalfd(void)
+{
+	GIOChannel *channel;
+	guint source;
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		perror("Failed to set signal mask");
+		return 0;
+	}
+
+	fd = signalfd(-1, &mask, 0);
+	if (fd < 0) {
+		perror("Failed to create signal descriptor");
+		return 0;
+	}
+
+	channel = g_io_channel_unix_new(fd);
+
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	source = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				signal_handler, NULL);
+
+	g_io_channel_unref(channel);
+
+	return source;
+}
+
+static void create_devices(void)
+{
+	int i;
+
+	devices = g_new0(struct vdev, opt_devices);
+
+	for (i = 0; i < opt_devices; i++) {
+		struct vdev *dev = &devices[i];
+		uint16_t low = get_le16(opt_base.b) + i;
+
+		bacpy(&dev->bdaddr, &opt_base);
+		put_le16(low, dev->bdaddr.b);
+
+		dev->rssi = -40 - (i % 50);
+		dev->status = i % 2;
+		dev->type = 0;
+		dev->company = (i % opt_match_every) ? OTHER_MANU_TYPE :
+								MANU_TYPE;
+	}
+}
+
+static void usage(void)
+{
+	printf("bt_virtual_ctrl - Virtual LE controller\n"
+		"Usage:\n");
+	printf("\tbt_virtual_ctrl [options]\n");
+	printf("Options:\n"
+		"\t-p, --pty                  Use a pty instead of "
+							VHCI_DEV "\n"
+		"\t-n, --devices <count>      Number of advertisers\n"
+		"\t-a, --address <bdaddr>     Address of the first advertiser\n"
+		"\t-i, --adv-interval <ms>    Advertising event interval\n"
+		"\t-r, --reports <count>      Reports per advertising event\n"
+		"\t-m, --match-every <n>      Only every n-th advertiser "
+						"carries the Linksys ID\n"
+		"\t-l, --latency <ms>         One way link latency\n"
+		"\t-w, --write-delay <ms>     Delay before each Write Response\n"
+		"\t-h, --help                 Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "pty",		no_argument,		NULL, 'p' },
+	{ "devices",		required_argument,	NULL, 'n' },
+	{ "address",		required_argument,	NULL, 'a' },
+	{ "adv-interval",	required_argument,	NULL, 'i' },
+	{ "reports",		required_argument,	NULL, 'r' },
+	{ "match-every",	required_argument,	NULL, 'm' },
+	{ "latency",		required_argument,	NULL, 'l' },
+	{ "write-delay",	required_argument,	NULL, 'w' },
+	{ "help",		no_argument,		NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	gboolean use_pty = FALSE;
+	GIOChannel *channel;
+	guint signal;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "pn:a:i:r:m:l:w:h",
+						main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'p':
+			use_pty = TRUE;
+			break;
+		case 'n':
+			opt_devices = atoi(optarg);
+			break;
+		case 'a':
+			if (str2ba(optarg, &opt_base) < 0) {
+				fprintf(stderr, "Invalid address\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			opt_adv_interval = atoi(optarg);
+			break;
+		case 'r':
+			opt_reports = atoi(optarg);
+			break;
+		case 'm':
+			opt_match_every = atoi(optarg);
+			break;
+		case 'l':
+			opt_latency = atoi(optarg);
+			break;
+		case 'w':
+			opt_write_delay = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opt_devices <= 0 || opt_reports <= 0 || opt_match_every <= 0 ||
+				opt_adv_interval <= 0 || opt_latency < 0) {
+		fprintf(stderr, "Invalid parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	hci_fd = use_pty ? open_pty() : open_vhci();
+	if (hci_fd < 0)
+		return EXIT_FAILURE;
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+	signal = setup_signalfd();
+
+	create_devices();
+
+	channel = g_io_channel_unix_new(hci_fd);
+	g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+							hci_read_cb, NULL);
+
+	printf("Virtual controller with %d advertisers\n", opt_devices);
+
+	g_main_loop_run(main_loop);
+
+	reset();
+
+	g_source_remove(signal);
+	g_io_channel_unref(channel);
+	close(hci_fd);
+
+	g_free(devices);
+	g_main_loop_unref(main_loop);
+
+	return EXIT_SUCCESS;
+}